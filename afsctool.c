@@ -2,19 +2,30 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <ctype.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <sys/param.h>
 #include <sys/mount.h>
 #include <fts.h>
+#include <fnmatch.h>
+#include <pwd.h>
 #include <sys/xattr.h>
 #include <hfs/hfs_format.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
 #include <zlib.h>
+#include <CommonCrypto/CommonDigest.h>
 
 #include <CoreServices/CoreServices.h>
 
+#include "libafsc.h"
+
 const char *sizeunit10_short[] = {"KB", "MB", "GB", "TB", "PB", "EB"};
 const char *sizeunit10_long[] = {"kilobytes", "megabytes", "gigabytes", "terabytes", "petabytes", "exabytes"};
 const long long int sizeunit10[] = {1000, 1000 * 1000, 1000 * 1000 * 1000, (long long int) 1000 * 1000 * 1000 * 1000, (long long int) 1000 * 1000 * 1000 * 1000 * 1000, (long long int) 1000 * 1000 * 1000 * 1000 * 1000 * 1000};
@@ -22,6 +33,155 @@ const char *sizeunit2_short[] = {"KiB", "MiB", "GiB", "TiB", "PiB", "EiB"};
 const char *sizeunit2_long[] = {"kibibytes", "mebibytes", "gibibytes", "tebibytes", "pebibytes", "exbibytes"};
 const long long int sizeunit2[] = {1024, 1024 * 1024, 1024 * 1024 * 1024, (long long int) 1024 * 1024 * 1024 * 1024, (long long int) 1024 * 1024 * 1024 * 1024 * 1024, (long long int) 1024 * 1024 * 1024 * 1024 * 1024 * 1024};
 
+pthread_mutex_t zeroBlockLock = PTHREAD_MUTEX_INITIALIZER;
+void *zeroBlockOut[10];
+unsigned long int zeroBlockOutSize[10];
+
+#define BLOCK_MEMO_SLOTS 8
+// Files finished out of order wait for the ones found before them; at most this many can be outstanding at once
+#define REORDER_WINDOW 1024
+
+struct file_signature
+{
+	const char *name;
+	long int offset;
+	unsigned int length;
+	const char *magic;
+};
+
+// Formats whose content is already compressed or encrypted; a negative offset is counted back from the end of the file
+const struct file_signature builtinSignatures[] = {
+	{"gzip", 0, 2, "\x1F\x8B"},
+	{"bzip2", 0, 3, "BZh"},
+	{"xz", 0, 6, "\xFD" "7zXZ\0"},
+	{"zstd", 0, 4, "\x28\xB5\x2F\xFD"},
+	{"lz4", 0, 4, "\x04\x22\x4D\x18"},
+	{"lzfse", 0, 4, "bvx2"},
+	{"lzvn", 0, 4, "bvxn"},
+	{"7z", 0, 6, "7z\xBC\xAF\x27\x1C"},
+	{"rar", 0, 6, "Rar!\x1A\x07"},
+	{"zip", 0, 4, "PK\x03\x04"},
+	{"xar", 0, 4, "xar!"},
+	{"dmg", -512, 4, "koly"},
+	{"png", 0, 8, "\x89PNG\r\n\x1A\n"},
+	{"jpeg", 0, 3, "\xFF\xD8\xFF"},
+	{"gif", 0, 4, "GIF8"},
+	{"webp", 8, 4, "WEBP"},
+	{"mp4/mov/heic", 4, 4, "ftyp"},
+	{"matroska/webm", 0, 4, "\x1A\x45\xDF\xA3"},
+	{"mp3", 0, 3, "ID3"},
+	{"ogg", 0, 4, "OggS"},
+	{"flac", 0, 4, "fLaC"},
+	{"openssl", 0, 8, "Salted__"},
+	{"age", 0, 21, "age-encryption.org/v1"}
+};
+
+struct extension_ratio
+{
+	const char *ext;
+	double ratio;
+};
+
+// Typical compressed size as a fraction of the original, for predicting savings before a file has been read
+const struct extension_ratio builtinRatios[] = {
+	{"txt", 0.35}, {"log", 0.2}, {"csv", 0.3}, {"c", 0.3}, {"h", 0.3}, {"cpp", 0.3}, {"m", 0.3}, {"swift", 0.3},
+	{"py", 0.35}, {"js", 0.35}, {"html", 0.3}, {"css", 0.3}, {"json", 0.25}, {"xml", 0.2}, {"plist", 0.3},
+	{"strings", 0.3}, {"nib", 0.5}, {"dylib", 0.45}, {"so", 0.45}, {"a", 0.4}, {"o", 0.4}, {"pdf", 0.85},
+	{"jpg", 1.0}, {"jpeg", 1.0}, {"png", 1.0}, {"gif", 1.0}, {"heic", 1.0}, {"mp3", 1.0}, {"m4a", 1.0},
+	{"mp4", 1.0}, {"mov", 1.0}, {"zip", 1.0}, {"gz", 1.0}, {"bz2", 1.0}, {"xz", 1.0}, {"dmg", 1.0}, {"pkg", 1.0}
+};
+
+struct ratio_entry
+{
+	char *ext;
+	long long int num_files;
+	long long int logical_size;
+	long long int stored_size;
+};
+
+struct ratio_cache
+{
+	struct ratio_entry *entries;
+	long int numEntries;
+	long int currSize;
+};
+
+struct size_bucket
+{
+	long long int num_files;
+	long long int logical_size;
+	long long int stored_size;
+};
+
+// Files counted by extension and by size, where bucket n holds the files from 2^(n-1) up to 2^n bytes (bucket 0 the empty ones)
+struct file_histograms
+{
+	struct ratio_cache by_ext;
+	struct size_bucket by_size[64];
+	bool print_table;
+	const char *json_path;
+};
+
+struct scheduled_file
+{
+	char *filepath;
+	struct stat fileinfo;
+	struct folder_info *rootinfo;
+	struct dir_node *dir;
+	double priority;
+};
+
+struct file_schedule
+{
+	struct scheduled_file *files;
+	long int numFiles;
+	long int currSize;
+};
+
+struct signature_table
+{
+	pthread_mutex_t lock;
+	struct file_signature *signatures;
+	long long int *hits;
+	int numSignatures;
+	long long int num_skipped;
+};
+
+// A folder whose totals are still being collected; it is referred to by the walk while the walk is inside it, by
+// its subfolders until they are finished and by its files until they are counted
+struct dir_node
+{
+	char *path;
+	int level;
+	int refs;
+	long long int num_files;
+	long long int uncompressed_size;
+	long long int compressed_size;
+	long long int total_size;
+	struct dir_node *parent;
+};
+
+struct dir_rank
+{
+	char *path;
+	long long int value;
+};
+
+struct dir_heap
+{
+	struct dir_rank *ranks;
+	int count;
+};
+
+struct dir_report
+{
+	struct dir_node *curr;
+	int maxRanks;
+	struct dir_heap by_size;
+	struct dir_heap by_savings;
+	struct dir_heap by_files;
+};
+
 struct folder_info
 {
 	long long int uncompressed_size;
@@ -43,1264 +203,4988 @@ struct folder_info
 	bool compress_files;
 	bool check_files;
 	bool check_hard_links;
+	int read_threads;
+	int read_batch;
+	int compress_threads;
+	int commit_threads;
+	bool ordered_output;
+	long long int max_memory;
+	struct dedup_index *dedup;
+	struct file_filter *filter;
+	struct signature_table *signatures;
+	struct ratio_cache *ratios;
+	bool savings_first;
+	time_t deadline;
+	bool deadline_reached;
+	double target_mbps;
+	long long int level_counts[10];
+	struct dir_report *report;
+	struct file_histograms *histograms;
+	struct throttle *throttle;
+	struct progress *progress;
+	struct hard_link_table *hard_links;
+};
+
+struct extension_set
+{
+	char **slots;
+	unsigned int size;
+	unsigned int count;
+};
+
+struct file_filter
+{
+	char **include_globs;
+	int num_include_globs;
+	char **exclude_globs;
+	int num_exclude_globs;
+	struct extension_set include_exts;
+	struct extension_set exclude_exts;
+	long long int min_size;
+	long long int max_size;
+	time_t min_age;
+	time_t max_age;
+	uid_t owner;
+	bool check_owner;
+	time_t now;
+};
+
+// An inode is only unique within its volume, and a walk can cover several volumes
+struct hard_link_id
+{
+	dev_t dev;
+	ino_t ino;
+};
+
+// Inodes with more than one link seen so far in a walk, sorted so they can be binary searched, with the path each was first seen at
+struct hard_link_table
+{
+	struct hard_link_id *hardLinks;
+	char **paths;
+	long int currSize;
+	long int numLinks;
 };
 
-char* getSizeStr(long long int size, long long int size_rounded)
+struct file_xattr_info
 {
-	static char sizeStr[90];
-	int unit2, unit10;
+	ssize_t xattrssize;
+	ssize_t RFsize;
+	ssize_t compattrsize;
+	int numxattrs;
+	int numhiddenattr;
+	bool hasRF;
+};
+
+struct dedup_entry
+{
+	long long int filesize;
+	unsigned char hash[CC_SHA256_DIGEST_LENGTH];
+	// The level the payload was compressed at, which files that reuse it are counted under
+	int level;
+	void *decmpfs;
+	unsigned int decmpfsSize;
+	void *resourceFork;
+	long long int resourceForkSize;
+};
+
+struct dedup_index
+{
+	pthread_mutex_t lock;
+	struct dedup_entry *entries;
+	long int numEntries;
+	long int currSize;
+	long long int payloadSize;
+	long long int maxPayloadSize;
+	long long int num_deduplicated;
+};
+
+struct compress_job
+{
+	char *filepath;
+	struct stat fileinfo;
+	struct file_xattr_info xattrinfo;
+	bool xattrinfo_valid;
+	struct timeval times[2];
+	void *inBuf;
+	void *outBuf;
+	void *outdecmpfsBuf;
+	long long int outBufSize;
+	size_t outdecmpfsSize;
+	unsigned int numBlocks;
+	int fd;
+	bool large;
+	int level;
+	long long int reserved;
+	bool keep_input;
+	bool already_compressed;
+	// Files that are only counted skip the pipeline stages and just wait their turn to be reported
+	bool count_only;
+	// Pipeline jobs keep what their threads print until they are reported, so it comes out in order with the file
+	bool queue_messages;
+	char *out_messages;
+	char *err_messages;
+	long long int seq;
+	struct folder_info *rootinfo;
+	struct dir_node *dir;
+	struct compress_job *next;
+};
+
+struct job_queue
+{
+	struct compress_job *head;
+	struct compress_job *tail;
+	int count;
+	int max;
+	bool closed;
+	pthread_cond_t changed;
+};
+
+struct compress_pipeline
+{
+	pthread_mutex_t lock;
+	struct job_queue read_queue;
+	struct job_queue compress_queue;
+	struct job_queue commit_queue;
+	struct job_queue done_queue;
+	int active_readers;
+	int active_compressors;
+	int active_committers;
+	long long int memory_used;
+	pthread_cond_t memory_released;
+	pthread_t *threads;
+	int num_threads;
+	struct compress_job *reorder[REORDER_WINDOW];
+	long long int next_seq;
+	long long int next_report;
+	struct folder_info *folderinfo;
+};
+
+struct block_memo_slot
+{
+	UInt64 hash;
+	void *inBlock;
+	void *outBlock;
+	unsigned long int outSize;
+};
+
+struct block_memo
+{
+	struct block_memo_slot slots[BLOCK_MEMO_SLOTS];
+};
+
+// Formats into sizeStr, which must hold 90 characters, so that threads never share a buffer
+char* getSizeStr(long long int size, long long int size_rounded, char *sizeStr)
+{
+	int unit2, unit10, len;
 	
 	for (unit2 = 0; unit2 + 1 < sizeof(sizeunit2) && (size_rounded / sizeunit2[unit2 + 1]) > 0; unit2++);
 	for (unit10 = 0; unit10 + 1 < sizeof(sizeunit10) && (size_rounded / sizeunit10[unit10 + 1]) > 0; unit10++);
 	
-	sprintf(sizeStr, "%lld bytes / ", size);
+	len = sprintf(sizeStr, "%lld bytes / ", size);
 
 	switch (unit10)
 	{
 		case 0:
-			sprintf(sizeStr, "%s%0.0f %s (%s) / ", sizeStr, (double) size_rounded / sizeunit10[unit10], sizeunit10_short[unit10], sizeunit10_long[unit10]);
+			len += sprintf(sizeStr + len, "%0.0f %s (%s) / ", (double) size_rounded / sizeunit10[unit10], sizeunit10_short[unit10], sizeunit10_long[unit10]);
 			break;
 		case 1:
-			sprintf(sizeStr, "%s%.12g %s (%s) / ", sizeStr, (double) (((long long int) ((double) size_rounded / sizeunit10[unit10] * 100) + 5) / 10) / 10, sizeunit10_short[unit10], sizeunit10_long[unit10]);
+			len += sprintf(sizeStr + len, "%.12g %s (%s) / ", (double) (((long long int) ((double) size_rounded / sizeunit10[unit10] * 100) + 5) / 10) / 10, sizeunit10_short[unit10], sizeunit10_long[unit10]);
 			break;
 		default:
-			sprintf(sizeStr, "%s%0.12g %s (%s) / ", sizeStr,  (double) (((long long int) ((double) size_rounded / sizeunit10[unit10] * 1000) + 5) / 10) / 100, sizeunit10_short[unit10], sizeunit10_long[unit10]);
+			len += sprintf(sizeStr + len, "%0.12g %s (%s) / ", (double) (((long long int) ((double) size_rounded / sizeunit10[unit10] * 1000) + 5) / 10) / 100, sizeunit10_short[unit10], sizeunit10_long[unit10]);
 			break;
 	}
 	
 	switch (unit2)
 	{
 		case 0:
-			sprintf(sizeStr, "%s%0.0f %s (%s)", sizeStr, (double) size_rounded / sizeunit2[unit2], sizeunit2_short[unit2], sizeunit2_long[unit2]);
+			sprintf(sizeStr + len, "%0.0f %s (%s)", (double) size_rounded / sizeunit2[unit2], sizeunit2_short[unit2], sizeunit2_long[unit2]);
 			break;
 		case 1:
-			sprintf(sizeStr, "%s%.12g %s (%s)", sizeStr, (double) (((long long int) ((double) size_rounded / sizeunit2[unit2] * 100) + 5) / 10) / 10, sizeunit2_short[unit2], sizeunit2_long[unit2]);
+			sprintf(sizeStr + len, "%.12g %s (%s)", (double) (((long long int) ((double) size_rounded / sizeunit2[unit2] * 100) + 5) / 10) / 10, sizeunit2_short[unit2], sizeunit2_long[unit2]);
 			break;
 		default:
-			sprintf(sizeStr, "%s%0.12g %s (%s)", sizeStr,  (double) (((long long int) ((double) size_rounded / sizeunit2[unit2] * 1000) + 5) / 10) / 100, sizeunit2_short[unit2], sizeunit2_long[unit2]);
+			sprintf(sizeStr + len, "%0.12g %s (%s)", (double) (((long long int) ((double) size_rounded / sizeunit2[unit2] * 1000) + 5) / 10) / 100, sizeunit2_short[unit2], sizeunit2_long[unit2]);
 			break;
 	}
 	
 	return sizeStr;
 }
 
-void compressFile(const char *inFile, struct stat *inFileInfo, long long int maxSize, int compressionlevel, double minSavings, bool checkFiles)
+bool parseSize(const char *str, long long int *size)
 {
-	FILE *in;
-	struct statfs fsInfo;
-	unsigned int compblksize = 0x10000, numBlocks, outdecmpfsSize = 0;
-	void *inBuf, *outBuf, *outBufBlock, *outdecmpfsBuf, *currBlock, *blockStart;
-	long long int inBufPos, filesize = inFileInfo->st_size;
-	unsigned long int cmpedsize;
-	char *xattrnames, *curr_attr;
-	ssize_t xattrnamesize;
-	UInt32 cmpf = 0x636D7066;
-	struct timeval times[2];
+	const char *units = "KMGTPE", *unit;
+	char *end;
+	double value;
 	
-	times[0].tv_sec = inFileInfo->st_atimespec.tv_sec;
-	times[0].tv_usec = inFileInfo->st_atimespec.tv_nsec / 1000;
-	times[1].tv_sec = inFileInfo->st_mtimespec.tv_sec;
-	times[1].tv_usec = inFileInfo->st_mtimespec.tv_nsec / 1000;
+	value = strtod(str, &end);
+	if (end == str || value < 0)
+		return FALSE;
+	if (*end != '\0')
+	{
+		unit = strchr(units, toupper(*end));
+		if (unit == NULL)
+			return FALSE;
+		value *= sizeunit2[unit - units];
+		end++;
+		if (toupper(*end) == 'B')
+			end++;
+	}
+	if (*end != '\0')
+		return FALSE;
+	*size = (long long int) value;
+	return TRUE;
+}
+
+// Returns TRUE if str is a whole number (such as a compression parameter) rather than a path
+bool isNumberArg(const char *str)
+{
+	char *end;
+
+	strtod(str, &end);
+	return (end != str && *end == '\0');
+}
+
+void revertLargeFile(const char *inFile, void *blockStart, long long int filesize)
+{
+	struct afsc_layout layout;
+	enum afsc_result result;
+	int outFd;
 	
-	if (statfs(inFile, &fsInfo) < 0)
-		return;
-	if (fsInfo.f_type != 17 && fsInfo.f_type != 23 && fsInfo.f_type != 24) {
-		printf("Expecting f_type of 17, 23 or 24. f_type is %i.\n", fsInfo.f_type);
+	outFd = open(inFile, O_WRONLY | O_TRUNC);
+	if (outFd < 0)
+	{
+		fprintf(stderr, "%s: %s\n", inFile, strerror(errno));
 		return;
 	}
-	if (!S_ISREG(inFileInfo->st_mode))
-		return;
-	if ((inFileInfo->st_flags & UF_COMPRESSED) != 0)
-		return;
-	if (filesize > maxSize && maxSize != 0)
-		return;
-	if (filesize == 0)
+	// The block table is still in memory, so only the blocks are read back
+	memset(&layout, 0, sizeof(layout));
+	layout.block_start = 0x104;
+	layout.block_table = blockStart;
+	if ((result = afsc_decode_resource_fork(inFile, &layout, filesize, outFd, 0, NULL)) != AFSC_OK)
+	{
+		close(outFd);
+		fprintf(stderr, "%s: Unable to restore file data (%s), leaving compressed data in place\n", inFile,
+				(result == AFSC_ERR_IO) ? strerror(errno) : afsc_strerror(result));
 		return;
+	}
+	close(outFd);
+	if (removexattr(inFile, "com.apple.decmpfs", XATTR_NOFOLLOW | XATTR_SHOWCOMPRESSION) < 0)
+	{
+		fprintf(stderr, "%s: removexattr: %s\n", inFile, strerror(errno));
+	}
+	if (removexattr(inFile, "com.apple.ResourceFork", XATTR_NOFOLLOW | XATTR_SHOWCOMPRESSION) < 0)
+	{
+		fprintf(stderr, "%s: removexattr: %s\n", inFile, strerror(errno));
+	}
+}
+
+bool compressZeroBlock(void *outBlock, unsigned long int *outSize, int compressionlevel)
+{
+	void *zeroBlock;
+	bool ret = TRUE;
 	
-	if (chflags(inFile, UF_COMPRESSED | inFileInfo->st_flags) < 0 || chflags(inFile, inFileInfo->st_flags) < 0)
+	// The compressed all-zero block is worked out once per compression level and shared by every file
+	pthread_mutex_lock(&zeroBlockLock);
+	if (zeroBlockOut[compressionlevel] == NULL)
 	{
-		fprintf(stderr, "%s: chflags: %s\n", inFile, strerror(errno));
-		return;
+		zeroBlock = calloc(1, 0x10000);
+		zeroBlockOut[compressionlevel] = malloc(compressBound(0x10000));
+		zeroBlockOutSize[compressionlevel] = compressBound(0x10000);
+		if (zeroBlock == NULL || zeroBlockOut[compressionlevel] == NULL ||
+			compress2(zeroBlockOut[compressionlevel], &zeroBlockOutSize[compressionlevel], zeroBlock, 0x10000, compressionlevel) != Z_OK)
+		{
+			free(zeroBlockOut[compressionlevel]);
+			zeroBlockOut[compressionlevel] = NULL;
+			ret = FALSE;
+		}
+		free(zeroBlock);
+	}
+	if (ret)
+	{
+		memcpy(outBlock, zeroBlockOut[compressionlevel], zeroBlockOutSize[compressionlevel]);
+		*outSize = zeroBlockOutSize[compressionlevel];
 	}
+	pthread_mutex_unlock(&zeroBlockLock);
+	return ret;
+}
+
+void freeBlockMemo(struct block_memo *memo)
+{
+	int i;
 	
-	xattrnamesize = listxattr(inFile, NULL, 0, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW);
+	for (i = 0; i < BLOCK_MEMO_SLOTS; i++)
+	{
+		free(memo->slots[i].inBlock);
+		free(memo->slots[i].outBlock);
+		memo->slots[i].inBlock = memo->slots[i].outBlock = NULL;
+	}
+}
+
+// Compresses one block into outBlock, which must hold compressBound(0x10000) bytes, storing it raw if it doesn't shrink.
+// With a memo, full blocks that are all zero or that repeat a block seen earlier in the file are copied from the earlier result.
+bool compressBlock(struct block_memo *memo, void *outBlock, unsigned long int *outSize, const void *inBlock, unsigned long int inSize, int compressionlevel)
+{
+	struct block_memo_slot *slot = NULL;
+	const UInt64 *words = inBlock;
+	UInt64 hash = 0, bits = 0;
+	unsigned long int i;
 	
-	if (xattrnamesize > 0)
+	if (memo != NULL && inSize == 0x10000)
 	{
-		xattrnames = (char *) malloc(xattrnamesize);
-		if (xattrnames == NULL)
+		for (i = 0; i < 0x10000 / 8; i++)
 		{
-			fprintf(stderr, "%s: malloc error, unable to get file information\n", inFile);
-			return;
+			bits |= words[i];
+			hash = (hash ^ words[i]) * 0x100000001B3ULL;
 		}
-		if ((xattrnamesize = listxattr(inFile, xattrnames, xattrnamesize, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW)) <= 0)
+		if (bits == 0 && compressZeroBlock(outBlock, outSize, compressionlevel))
+			return TRUE;
+		slot = &memo->slots[(hash ^ (hash >> 32)) % BLOCK_MEMO_SLOTS];
+		if (slot->inBlock != NULL && slot->hash == hash && memcmp(slot->inBlock, inBlock, inSize) == 0)
 		{
-			fprintf(stderr, "%s: listxattr: %s\n", inFile, strerror(errno));
-			free(xattrnames);
-			return;
+			memcpy(outBlock, slot->outBlock, slot->outSize);
+			*outSize = slot->outSize;
+			return TRUE;
 		}
-		for (curr_attr = xattrnames; curr_attr < xattrnames + xattrnamesize; curr_attr += strlen(curr_attr) + 1)
+	}
+	
+	if (afsc_encode_block(outBlock, outSize, inBlock, inSize, compressionlevel) != AFSC_OK)
+		return FALSE;
+	
+	if (slot != NULL)
+	{
+		if (slot->inBlock == NULL)
 		{
-			if ((strcmp(curr_attr, "com.apple.ResourceFork") == 0 && strlen(curr_attr) == 22) ||
-				(strcmp(curr_attr, "com.apple.decmpfs") == 0 && strlen(curr_attr) == 17))
-				return;
+			slot->inBlock = malloc(0x10000);
+			slot->outBlock = malloc(compressBound(0x10000));
+			if (slot->inBlock == NULL || slot->outBlock == NULL)
+			{
+				free(slot->inBlock);
+				free(slot->outBlock);
+				slot->inBlock = slot->outBlock = NULL;
+				return TRUE;
+			}
 		}
-		free(xattrnames);
+		memcpy(slot->inBlock, inBlock, inSize);
+		memcpy(slot->outBlock, outBlock, *outSize);
+		slot->outSize = *outSize;
+		slot->hash = hash;
 	}
+	return TRUE;
+}
+
+void jobMessage(struct compress_job *job, FILE *stream, const char *format, ...)
+{
+	va_list args;
+	char *text, **messages;
+	size_t len;
 	
-	numBlocks = (filesize + compblksize - 1) / compblksize;
-	if ((filesize + 0x13A + (numBlocks * 9)) > 2147483647)
-		return;
-	
-	in = fopen(inFile, "r+");
-	if (in == NULL)
+	va_start(args, format);
+	if (job == NULL || !job->queue_messages)
 	{
-		fprintf(stderr, "%s: %s\n", inFile, strerror(errno));
+		vfprintf(stream, format, args);
+		va_end(args);
 		return;
 	}
-	inBuf = malloc(filesize);
-	if (inBuf == NULL)
+	if (vasprintf(&text, format, args) < 0)
 	{
-		fprintf(stderr, "%s: malloc error, unable to allocate input buffer\n", inFile);
-		fclose(in);
-		utimes(inFile, times);
-		return;
+		va_end(args);
+		fprintf(stderr, "Malloc error allocating message, exiting...\n");
+		exit(-1);
 	}
-	if (fread(inBuf, filesize, 1, in) != 1)
+	va_end(args);
+	messages = (stream == stderr) ? &job->err_messages : &job->out_messages;
+	len = (*messages != NULL) ? strlen(*messages) : 0;
+	if ((*messages = (char *) realloc(*messages, len + strlen(text) + 1)) == NULL)
 	{
-		fprintf(stderr, "%s: Error reading file\n", inFile);
-		fclose(in);
-		utimes(inFile, times);
-		free(inBuf);
-		return;
+		fprintf(stderr, "Malloc error allocating message, exiting...\n");
+		exit(-1);
 	}
-	fclose(in);
-	outBuf = malloc(filesize + 0x13A + (numBlocks * 9));
+	strcpy(*messages + len, text);
+	free(text);
+}
+
+// The resource fork header and block table of a file of this size; the resource fork has to hold them, and more
+long long int blockTableSize(long long int filesize)
+{
+	return 0x104 + 0x4 + ((filesize + 0xFFFF) / 0x10000) * 8;
+}
+
+void compressLargeFile(const char *inFile, struct stat *inFileInfo, unsigned int numBlocks, int compressionlevel, double minSavings, bool checkFiles, struct timeval *times, struct compress_job *job)
+{
+	FILE *in;
+	unsigned int compblksize = 0x10000, currBlock, writeBufSize = 0x100000, writeBufLen = 0;
+	void *inBuf, *outBuf, *outBufBlock, *writeBuf, *blockStart;
+	long long int filesize = inFileInfo->st_size, tableSize = blockTableSize(inFileInfo->st_size), blockLen, RFpos, RFwritePos, maxRFSize = 2147483647;
+	unsigned long int cmpedsize, crc = crc32(0L, Z_NULL, 0), checkcrc;
+	char outdecmpfsBuf[0x10];
+	struct block_memo memo;
+	
+	// Resource fork header, block count and block table; the compressed blocks are written behind it as they are produced
+	outBuf = malloc(tableSize);
 	if (outBuf == NULL)
 	{
-		fprintf(stderr, "%s: malloc error, unable to allocate output buffer\n", inFile);
+		jobMessage(job, stderr, "%s: malloc error, unable to allocate block table\n", inFile);
 		utimes(inFile, times);
-		free(inBuf);
 		return;
 	}
-	outdecmpfsBuf = malloc(3802);
-	if (outdecmpfsBuf == NULL)
+	inBuf = malloc(compblksize);
+	outBufBlock = malloc(compressBound(compblksize));
+	writeBuf = malloc(writeBufSize);
+	if (inBuf == NULL || outBufBlock == NULL || writeBuf == NULL)
 	{
-		fprintf(stderr, "%s: malloc error, unable to allocate xattr buffer\n", inFile);
+		jobMessage(job, stderr, "%s: malloc error, unable to allocate compression buffer\n", inFile);
 		utimes(inFile, times);
-		free(inBuf);
 		free(outBuf);
+		free(inBuf);
+		free(outBufBlock);
+		free(writeBuf);
 		return;
 	}
-	outBufBlock = malloc(compressBound(compblksize));
-	if (outBufBlock == NULL)
+	
+	RFpos = RFwritePos = tableSize;
+	afsc_write_resource_fork_header(outBuf, numBlocks, RFpos);
+	blockStart = outBuf + 0x104;
+	memset(blockStart + 0x4, 0, tableSize - 0x104 - 0x4);
+	
+	// Reserve the header and block table space; XATTR_CREATE makes sure an existing resource fork is never overwritten
+	if (setxattr(inFile, "com.apple.ResourceFork", outBuf, RFpos, 0, XATTR_NOFOLLOW | XATTR_CREATE) < 0)
 	{
-		fprintf(stderr, "%s: malloc error, unable to allocate compression buffer\n", inFile);
+		jobMessage(job, stderr, "%s: setxattr: %s\n", inFile, strerror(errno));
 		utimes(inFile, times);
-		free(inBuf);
 		free(outBuf);
-		free(outdecmpfsBuf);
+		free(inBuf);
+		free(outBufBlock);
+		free(writeBuf);
 		return;
 	}
-	*(UInt32 *) outdecmpfsBuf = EndianU32_NtoL(cmpf);
-	*(UInt32 *) (outdecmpfsBuf + 4) = EndianU32_NtoL(4);
-	*(UInt64 *) (outdecmpfsBuf + 8) = EndianU64_NtoL(filesize);
-	outdecmpfsSize = 0x10;
-	*(UInt32 *) outBuf = EndianU32_NtoB(0x100);
-	*(UInt32 *) (outBuf + 12) = EndianU32_NtoB(0x32);
-	memset(outBuf + 16, 0, 0xF0);
-	blockStart = outBuf + 0x104;
-	*(UInt32 *) blockStart = EndianU32_NtoL(numBlocks);
-	currBlock = blockStart + 0x4 + (numBlocks * 8);
-	for (inBufPos = 0; inBufPos < filesize; inBufPos += compblksize, currBlock += cmpedsize)
+	
+	memset(&memo, 0, sizeof(memo));
+	in = fopen(inFile, "r");
+	if (in == NULL)
 	{
-		cmpedsize = compressBound(compblksize);
-		if (compress2(outBufBlock, &cmpedsize, inBuf + inBufPos, ((filesize - inBufPos) > compblksize) ? compblksize : filesize - inBufPos, compressionlevel) != Z_OK)
+		jobMessage(job, stderr, "%s: %s\n", inFile, strerror(errno));
+		goto large_abort;
+	}
+	for (currBlock = 0; currBlock < numBlocks; currBlock++)
+	{
+		blockLen = ((filesize - ((long long int) currBlock * compblksize)) > compblksize) ? compblksize : filesize - ((long long int) currBlock * compblksize);
+		if (fread(inBuf, blockLen, 1, in) != 1)
 		{
-			utimes(inFile, times);
-			free(inBuf);
-			free(outBuf);
-			free(outdecmpfsBuf);
-			free(outBufBlock);
-			return;
+			jobMessage(job, stderr, "%s: Error reading file\n", inFile);
+			fclose(in);
+			goto large_abort;
 		}
-		if (cmpedsize > (((filesize - inBufPos) > compblksize) ? compblksize : filesize - inBufPos))
+		if (checkFiles)
+			crc = crc32(crc, inBuf, blockLen);
+		if (!compressBlock(&memo, outBufBlock, &cmpedsize, inBuf, blockLen, compressionlevel))
 		{
-			*(unsigned char *) outBufBlock = 0xFF;
-			memcpy(outBufBlock + 1, inBuf + inBufPos, ((filesize - inBufPos) > compblksize) ? compblksize : filesize - inBufPos);
-			cmpedsize = ((filesize - inBufPos) > compblksize) ? compblksize : filesize - inBufPos;
-			cmpedsize++;
+			fclose(in);
+			goto large_abort;
 		}
-		if (((cmpedsize + outdecmpfsSize) <= 3802) && (numBlocks <= 1))
+		// Give up as soon as the resource fork can no longer meet the savings requirement or the size limit
+		if ((((double) (RFpos + cmpedsize + 50) / filesize) >= (1.0 - minSavings / 100) && minSavings != 0.0) ||
+			RFpos + cmpedsize + 50 >= filesize || RFpos + cmpedsize + 50 > maxRFSize)
 		{
-			*(UInt32 *) (outdecmpfsBuf + 4) = EndianU32_NtoL(3);
-			memcpy(outdecmpfsBuf + outdecmpfsSize, outBufBlock, cmpedsize);
-			outdecmpfsSize += cmpedsize;
-			break;
+			fclose(in);
+			goto large_abort;
 		}
-		memcpy(currBlock, outBufBlock, cmpedsize);
-		*(UInt32 *) (blockStart + ((inBufPos / compblksize) * 8) + 0x4) = EndianU32_NtoL(currBlock - blockStart);
-		*(UInt32 *) (blockStart + ((inBufPos / compblksize) * 8) + 0x8) = EndianU32_NtoL(cmpedsize);
+		if (writeBufLen + cmpedsize > writeBufSize)
+		{
+			if (setxattr(inFile, "com.apple.ResourceFork", writeBuf, writeBufLen, RFwritePos, XATTR_NOFOLLOW) < 0)
+			{
+				jobMessage(job, stderr, "%s: setxattr: %s\n", inFile, strerror(errno));
+				fclose(in);
+				goto large_abort;
+			}
+			RFwritePos += writeBufLen;
+			writeBufLen = 0;
+		}
+		memcpy(writeBuf + writeBufLen, outBufBlock, cmpedsize);
+		writeBufLen += cmpedsize;
+		*(UInt32 *) (blockStart + (currBlock * 8) + 0x4) = EndianU32_NtoL(RFpos - 0x104);
+		*(UInt32 *) (blockStart + (currBlock * 8) + 0x8) = EndianU32_NtoL(cmpedsize);
+		RFpos += cmpedsize;
 	}
+	fclose(in);
+	freeBlockMemo(&memo);
 	
-	if (EndianU32_LtoN(*(UInt32 *) (outdecmpfsBuf + 4)) == 4)
+	if (writeBufLen + 50 > writeBufSize)
 	{
-		if ((((double) (currBlock - outBuf + 50) / filesize) >= (1.0 - minSavings / 100) && minSavings != 0.0) ||
-			currBlock - outBuf + 50 >= filesize)
+		if (setxattr(inFile, "com.apple.ResourceFork", writeBuf, writeBufLen, RFwritePos, XATTR_NOFOLLOW) < 0)
 		{
-			utimes(inFile, times);
-			free(inBuf);
-			free(outBuf);
-			free(outdecmpfsBuf);
-			free(outBufBlock);
-			return;
-		}
-		*(UInt32 *) (outBuf + 4) = EndianU32_NtoB(currBlock - outBuf);
-		*(UInt32 *) (outBuf + 8) = EndianU32_NtoB(currBlock - outBuf - 0x100);
-		*(UInt32 *) (blockStart - 4) = EndianU32_NtoB(currBlock - outBuf - 0x104);
-		memset(currBlock, 0, 24);
-		*(UInt16 *) (currBlock + 24) = EndianU16_NtoB(0x1C);
-		*(UInt16 *) (currBlock + 26) = EndianU16_NtoB(0x32);
-		*(UInt16 *) (currBlock + 28) = 0;
-		*(UInt32 *) (currBlock + 30) = EndianU32_NtoB(cmpf);
-		*(UInt32 *) (currBlock + 34) = EndianU32_NtoB(0xA);
-		*(UInt64 *) (currBlock + 38) = EndianU64_NtoL(0xFFFF0100);
-		*(UInt32 *) (currBlock + 46) = 0;
-		if (setxattr(inFile, "com.apple.ResourceFork", outBuf, currBlock - outBuf + 50, 0, XATTR_NOFOLLOW | XATTR_CREATE) < 0)
-		{
-			fprintf(stderr, "%s: setxattr: %s\n", inFile, strerror(errno));
-			free(inBuf);
-			free(outBuf);
-			free(outdecmpfsBuf);
-			free(outBufBlock);
-			return;
+			jobMessage(job, stderr, "%s: setxattr: %s\n", inFile, strerror(errno));
+			goto large_abort;
 		}
+		RFwritePos += writeBufLen;
+		writeBufLen = 0;
 	}
-	if (setxattr(inFile, "com.apple.decmpfs", outdecmpfsBuf, outdecmpfsSize, 0, XATTR_NOFOLLOW | XATTR_CREATE) < 0)
+	afsc_write_resource_fork_trailer(writeBuf + writeBufLen);
+	writeBufLen += 50;
+	if (setxattr(inFile, "com.apple.ResourceFork", writeBuf, writeBufLen, RFwritePos, XATTR_NOFOLLOW) < 0)
 	{
-		fprintf(stderr, "%s: setxattr: %s\n", inFile, strerror(errno));
-		free(inBuf);
-		free(outBuf);
-		free(outdecmpfsBuf);
-		free(outBufBlock);
-		return;
+		jobMessage(job, stderr, "%s: setxattr: %s\n", inFile, strerror(errno));
+		goto large_abort;
 	}
-	in = fopen(inFile, "w");
-	if (in == NULL)
+	
+	// Now that the size of the compressed data is known, finalize the header and write the block table
+	afsc_write_resource_fork_header(outBuf, numBlocks, RFpos);
+	if (setxattr(inFile, "com.apple.ResourceFork", outBuf, tableSize, 0, XATTR_NOFOLLOW) < 0)
 	{
-		fprintf(stderr, "%s: %s\n", inFile, strerror(errno));
-		return;
+		jobMessage(job, stderr, "%s: setxattr: %s\n", inFile, strerror(errno));
+		goto large_abort;
 	}
-	fclose(in);
-	if (chflags(inFile, UF_COMPRESSED | inFileInfo->st_flags) < 0)
+	if (getxattr(inFile, "com.apple.ResourceFork", NULL, 0, 0, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW) != RFpos + 50)
+	{
+		jobMessage(job, stderr, "%s: Resource fork size does not match the data written\n", inFile);
+		goto large_abort;
+	}
+	
+	afsc_write_decmpfs_header(outdecmpfsBuf, 4, filesize);
+	if (setxattr(inFile, "com.apple.decmpfs", outdecmpfsBuf, 0x10, 0, XATTR_NOFOLLOW | XATTR_CREATE) < 0)
+	{
+		jobMessage(job, stderr, "%s: setxattr: %s\n", inFile, strerror(errno));
+		goto large_abort;
+	}
+	in = fopen(inFile, "w");
+	if (in == NULL)
 	{
-		fprintf(stderr, "%s: chflags: %s\n", inFile, strerror(errno));
+		jobMessage(job, stderr, "%s: %s\n", inFile, strerror(errno));
 		if (removexattr(inFile, "com.apple.decmpfs", XATTR_NOFOLLOW | XATTR_SHOWCOMPRESSION) < 0)
 		{
-			fprintf(stderr, "%s: removexattr: %s\n", inFile, strerror(errno));
-		}
-		if (EndianU32_LtoN(*(UInt32 *) (outdecmpfsBuf + 4)) == 4 &&
-			removexattr(inFile, "com.apple.ResourceFork", XATTR_NOFOLLOW | XATTR_SHOWCOMPRESSION) < 0)
-		{
-			fprintf(stderr, "%s: removexattr: %s\n", inFile, strerror(errno));
-		}
-		in = fopen(inFile, "w");
-		if (in == NULL)
-		{
-			free(inBuf);
-			free(outBuf);
-			free(outdecmpfsBuf);
-			free(outBufBlock);
-			fprintf(stderr, "%s: %s\n", inFile, strerror(errno));
-			return;
+			jobMessage(job, stderr, "%s: removexattr: %s\n", inFile, strerror(errno));
 		}
-		if (fwrite(inBuf, filesize, 1, in) != 1)
+		if (removexattr(inFile, "com.apple.ResourceFork", XATTR_NOFOLLOW | XATTR_SHOWCOMPRESSION) < 0)
 		{
-			free(inBuf);
-			free(outBuf);
-			free(outdecmpfsBuf);
-			free(outBufBlock);
-			fprintf(stderr, "%s: Error writing to file\n", inFile);
-			return;
+			jobMessage(job, stderr, "%s: removexattr: %s\n", inFile, strerror(errno));
 		}
-		fclose(in);
 		utimes(inFile, times);
+		free(outBuf);
+		free(inBuf);
+		free(outBufBlock);
+		free(writeBuf);
+		return;
+	}
+	fclose(in);
+	if (chflags(inFile, UF_COMPRESSED | inFileInfo->st_flags) < 0)
+	{
+		jobMessage(job, stderr, "%s: chflags: %s\n", inFile, strerror(errno));
+		revertLargeFile(inFile, blockStart, filesize);
+		utimes(inFile, times);
+		free(outBuf);
+		free(inBuf);
+		free(outBufBlock);
+		free(writeBuf);
 		return;
 	}
 	if (checkFiles)
 	{
+		checkcrc = crc32(0L, Z_NULL, 0);
 		lstat(inFile, inFileInfo);
 		in = fopen(inFile, "r");
 		if (in == NULL)
 		{
-			fprintf(stderr, "%s: %s\n", inFile, strerror(errno));
+			jobMessage(job, stderr, "%s: %s\n", inFile, strerror(errno));
+			free(outBuf);
+			free(inBuf);
+			free(outBufBlock);
+			free(writeBuf);
 			return;
 		}
-		if (inFileInfo->st_size != filesize || 
-			fread(outBuf, filesize, 1, in) != 1 ||
-			memcmp(outBuf, inBuf, filesize) != 0)
+		for (currBlock = 0; currBlock < numBlocks && inFileInfo->st_size == filesize; currBlock++)
 		{
-			fclose(in);
-			printf("%s: Compressed file check failed, reverting file changes\n", inFile);
+			blockLen = ((filesize - ((long long int) currBlock * compblksize)) > compblksize) ? compblksize : filesize - ((long long int) currBlock * compblksize);
+			if (fread(inBuf, blockLen, 1, in) != 1)
+				break;
+			checkcrc = crc32(checkcrc, inBuf, blockLen);
+		}
+		fclose(in);
+		if (currBlock != numBlocks || checkcrc != crc)
+		{
+			jobMessage(job, stdout, "%s: Compressed file check failed, reverting file changes\n", inFile);
 			if (chflags(inFile, (~UF_COMPRESSED) & inFileInfo->st_flags) < 0)
 			{
-				free(inBuf);
-				free(outBuf);
-				free(outdecmpfsBuf);
-				free(outBufBlock);
-				fprintf(stderr, "%s: chflags: %s\n", inFile, strerror(errno));
-				return;
-			}
-			if (removexattr(inFile, "com.apple.decmpfs", XATTR_NOFOLLOW | XATTR_SHOWCOMPRESSION) < 0)
-			{
-				fprintf(stderr, "%s: removexattr: %s\n", inFile, strerror(errno));
-			}
-			if (EndianU32_LtoN(*(UInt32 *) (outdecmpfsBuf + 4)) == 4 && 
-				removexattr(inFile, "com.apple.ResourceFork", XATTR_NOFOLLOW | XATTR_SHOWCOMPRESSION) < 0)
-			{
-				fprintf(stderr, "%s: removexattr: %s\n", inFile, strerror(errno));
-			}
-			in = fopen(inFile, "w");
-			if (in == NULL)
-			{
-				free(inBuf);
+				jobMessage(job, stderr, "%s: chflags: %s\n", inFile, strerror(errno));
 				free(outBuf);
-				free(outdecmpfsBuf);
-				free(outBufBlock);
-				fprintf(stderr, "%s: %s\n", inFile, strerror(errno));
-				return;
-			}
-			if (fwrite(inBuf, filesize, 1, in) != 1)
-			{
 				free(inBuf);
-				free(outBuf);
-				free(outdecmpfsBuf);
 				free(outBufBlock);
-				fprintf(stderr, "%s: Error writing to file\n", inFile);
+				free(writeBuf);
 				return;
 			}
+			revertLargeFile(inFile, blockStart, filesize);
 		}
-		fclose(in);
 	}
 	utimes(inFile, times);
+	free(outBuf);
 	free(inBuf);
+	free(outBufBlock);
+	free(writeBuf);
+	return;
+	
+large_abort:
+	freeBlockMemo(&memo);
+	if (removexattr(inFile, "com.apple.ResourceFork", XATTR_NOFOLLOW | XATTR_SHOWCOMPRESSION) < 0)
+	{
+		jobMessage(job, stderr, "%s: removexattr: %s\n", inFile, strerror(errno));
+	}
+	utimes(inFile, times);
 	free(outBuf);
-	free(outdecmpfsBuf);
+	free(inBuf);
 	free(outBufBlock);
+	free(writeBuf);
 }
 
-void decompressFile(const char *inFile, struct stat *inFileInfo)
+void freeCompressJobBuffers(struct compress_job *job)
 {
-	FILE *in;
-	int uncmpret;
-	unsigned int compblksize = 0x10000, numBlocks, currBlock;
-	long long int filesize;
-	unsigned long int uncmpedsize;
-	void *inBuf = NULL, *outBuf, *indecmpfsBuf = NULL, *blockStart;
-	char *xattrnames, *curr_attr;
-	ssize_t xattrnamesize, indecmpfsLen = 0, inRFLen = 0, getxattrret, RFpos = 0;
-	struct timeval times[2];
-	
-	times[0].tv_sec = inFileInfo->st_atimespec.tv_sec;
-	times[0].tv_usec = inFileInfo->st_atimespec.tv_nsec / 1000;
-	times[1].tv_sec = inFileInfo->st_mtimespec.tv_sec;
-	times[1].tv_usec = inFileInfo->st_mtimespec.tv_nsec / 1000;
-	
-	if (!S_ISREG(inFileInfo->st_mode))
-		return;
-	if ((inFileInfo->st_flags & UF_COMPRESSED) == 0)
-		return;
+	// When copying, the input buffer belongs to the caller, which still needs it if the data isn't compressed
+	if (job->inBuf != NULL && !job->keep_input)
+		free(job->inBuf);
+	if (job->outBuf != NULL)
+		free(job->outBuf);
+	if (job->outdecmpfsBuf != NULL)
+		free(job->outdecmpfsBuf);
+	job->inBuf = job->outBuf = job->outdecmpfsBuf = NULL;
+}
+
+long long int compressFileMemory(long long int filesize, unsigned int numBlocks, bool large)
+{
+	long long int memoSize = (numBlocks > 1) ? BLOCK_MEMO_SLOTS * (0x10000 + compressBound(0x10000)) : 0;
 	
-	xattrnamesize = listxattr(inFile, NULL, 0, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW);
+	// The streaming path only holds its block table, one block in each direction, its write buffer and the block memo
+	if (large)
+		return blockTableSize(filesize) + 0x10000 + compressBound(0x10000) + 0x100000 + memoSize;
+	return filesize + (filesize + 0x13A + ((long long int) numBlocks * 9)) + 0x10 + memoSize;
+}
+
+bool reserveJobMemory(struct compress_pipeline *pipeline, struct compress_job *job, bool wait)
+{
+	long long int size, limit = pipeline->folderinfo->max_memory;
+	bool reserved = FALSE, streamed = FALSE;
 	
-	if (xattrnamesize > 0)
+	pthread_mutex_lock(&pipeline->lock);
+	while (TRUE)
 	{
-		xattrnames = (char *) malloc(xattrnamesize);
-		if (xattrnames == NULL)
+		size = compressFileMemory(job->fileinfo.st_size, job->numBlocks, job->large);
+		// A file is always let through when nothing else is in flight, so a reservation can't wait forever
+		if (pipeline->memory_used == 0 || pipeline->memory_used + size <= limit)
 		{
-			fprintf(stderr, "%s: malloc error, unable to get file information\n", inFile);
-			return;
-		}
-		if ((xattrnamesize = listxattr(inFile, xattrnames, xattrnamesize, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW)) <= 0)
-		{
-			fprintf(stderr, "%s: listxattr: %s\n", inFile, strerror(errno));
-			free(xattrnames);
-			return;
+			pipeline->memory_used += size;
+			job->reserved = size;
+			reserved = TRUE;
+			break;
 		}
-		for (curr_attr = xattrnames; curr_attr < xattrnames + xattrnamesize; curr_attr += strlen(curr_attr) + 1)
+		if (!wait)
+			break;
+		// Rather than hold up the reader for a large share of the limit, stream the file in a fixed amount of memory
+		if (!job->large && size > limit / 4 && size > compressFileMemory(job->fileinfo.st_size, job->numBlocks, TRUE))
 		{
-			if (strcmp(curr_attr, "com.apple.ResourceFork") == 0 && strlen(curr_attr) == 22)
-			{
-				inRFLen = getxattr(inFile, curr_attr, NULL, 0, 0, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW);
-				if (inRFLen < 0)
-				{
-					fprintf(stderr, "%s: getxattr: %s\n", inFile, strerror(errno));
-					free(xattrnames);
-					return;
-				}
-				if (inRFLen != 0)
-				{
-					inBuf = malloc(inRFLen);
-					if (inBuf == NULL)
-					{
-						fprintf(stderr, "%s: malloc error, unable to allocate input buffer\n", inFile);
-						return;
-					}
-					do
-					{
-						getxattrret = getxattr(inFile, curr_attr, inBuf + RFpos, inRFLen - RFpos, RFpos, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW);
-						if (getxattrret < 0)
-						{
-							fprintf(stderr, "getxattr: %s\n", strerror(errno));
-							free(xattrnames);
-							return;
-						}
-						RFpos += getxattrret;
-					} while (RFpos < inRFLen && getxattrret > 0);
-				}
-			}
-			if (strcmp(curr_attr, "com.apple.decmpfs") == 0 && strlen(curr_attr) == 17)
-			{
-				indecmpfsLen = getxattr(inFile, curr_attr, NULL, 0, 0, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW);
-				if (indecmpfsLen < 0)
-				{
-					fprintf(stderr, "%s: getxattr: %s\n", inFile, strerror(errno));
-					free(xattrnames);
-					return;
-				}
-				if (indecmpfsLen != 0)
-				{
-					indecmpfsBuf = malloc(indecmpfsLen);
-					if (indecmpfsBuf == NULL)
-					{
-						fprintf(stderr, "%s: malloc error, unable to allocate xattr buffer\n", inFile);
-						utimes(inFile, times);
-						free(inBuf);
-						return;
-					}
-					if (indecmpfsLen != 0)
-					{
-						indecmpfsBuf = malloc(indecmpfsLen);
-						if (indecmpfsBuf == NULL)
-						{
-							fprintf(stderr, "%s: malloc error, unable to get file information\n", inFile);
-							return;
-						}
-						indecmpfsLen = getxattr(inFile, curr_attr, indecmpfsBuf, indecmpfsLen, 0, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW);
-						if (indecmpfsLen < 0)
-						{
-							fprintf(stderr, "getxattr: %s\n", strerror(errno));
-							free(xattrnames);
-							return;
-						}
-					}
-				}
-			}
+			job->large = streamed = TRUE;
+			continue;
 		}
-		free(xattrnames);
+		pthread_cond_wait(&pipeline->memory_released, &pipeline->lock);
 	}
-	
-	if (indecmpfsBuf == NULL)
+	pthread_mutex_unlock(&pipeline->lock);
+	if (streamed)
 	{
-		fprintf(stderr, "%s: Decompression failed; file flags indicate file is compressed but it does not have a com.apple.decmpfs extended attribute\n", inFile);
-		if (inBuf != NULL)
-			free(inBuf);
-		if (indecmpfsBuf != NULL)
-			free(indecmpfsBuf);
-		return;
+		close(job->fd);
+		job->fd = -1;
 	}
-	if (indecmpfsLen < 0x10)
-	{
-		fprintf(stderr, "%s: Decompression failed; extended attribute com.apple.decmpfs is only %ld bytes (it is required to have a 16 byte header)\n", inFile, indecmpfsLen);
-		if (inBuf != NULL)
-			free(inBuf);
-		if (indecmpfsBuf != NULL)
-			free(indecmpfsBuf);
+	return reserved;
+}
+
+void releaseJobMemory(struct compress_pipeline *pipeline, struct compress_job *job)
+{
+	if (job->reserved == 0)
 		return;
+	pthread_mutex_lock(&pipeline->lock);
+	pipeline->memory_used -= job->reserved;
+	job->reserved = 0;
+	pthread_cond_broadcast(&pipeline->memory_released);
+	pthread_mutex_unlock(&pipeline->lock);
+}
+
+void addSignature(struct signature_table *table, const struct file_signature *signature)
+{
+	table->signatures = (struct file_signature *) realloc(table->signatures, (table->numSignatures + 1) * sizeof(struct file_signature));
+	table->hits = (long long int *) realloc(table->hits, (table->numSignatures + 1) * sizeof(long long int));
+	if (table->signatures == NULL || table->hits == NULL)
+	{
+		fprintf(stderr, "Malloc error allocating file signature table, exiting...\n");
+		exit(-1);
 	}
+	table->signatures[table->numSignatures] = *signature;
+	table->hits[table->numSignatures] = 0;
+	table->numSignatures++;
+}
+
+struct signature_table *createSignatureTable()
+{
+	struct signature_table *table;
+	int i;
 	
-	filesize = EndianU64_LtoN(*(UInt64 *) (indecmpfsBuf + 8));
-	if (filesize == 0)
+	table = (struct signature_table *) calloc(1, sizeof(struct signature_table));
+	if (table == NULL)
 	{
-		fprintf(stderr, "%s: Decompression failed; file size given in header is 0\n", inFile);
-		if (inBuf != NULL)
-			free(inBuf);
-		if (indecmpfsBuf != NULL)
-			free(indecmpfsBuf);
-		return;
+		fprintf(stderr, "Malloc error allocating file signature table, exiting...\n");
+		exit(-1);
 	}
-	outBuf = malloc(filesize);
-	if (outBuf == NULL)
+	pthread_mutex_init(&table->lock, NULL);
+	for (i = 0; i < sizeof(builtinSignatures) / sizeof(builtinSignatures[0]); i++)
+		addSignature(table, &builtinSignatures[i]);
+	return table;
+}
+
+// Parses a signature given as name:offset:hexbytes, e.g. zstd:0:28b52ffd
+bool parseSignature(const char *str, struct file_signature *signature)
+{
+	const char *offsetStr, *hexStr;
+	char *end, *magic, *name;
+	unsigned int i, byte;
+	
+	offsetStr = strchr(str, ':');
+	if (offsetStr == NULL || offsetStr == str)
+		return FALSE;
+	signature->offset = strtol(offsetStr + 1, &end, 0);
+	if (end == offsetStr + 1 || *end != ':')
+		return FALSE;
+	hexStr = end + 1;
+	signature->length = strlen(hexStr) / 2;
+	if (signature->length == 0 || signature->length > 256 || strlen(hexStr) % 2 != 0 ||
+		signature->offset < -4096 || signature->offset + signature->length > 4096)
+		return FALSE;
+	magic = (char *) malloc(signature->length);
+	name = strndup(str, offsetStr - str);
+	if (magic == NULL || name == NULL)
 	{
-		fprintf(stderr, "%s: malloc error, unable to allocate output buffer\n", inFile);
-		if (inBuf != NULL)
-			free(inBuf);
-		if (indecmpfsBuf != NULL)
-			free(indecmpfsBuf);
-		return;
+		fprintf(stderr, "Malloc error allocating file signature table, exiting...\n");
+		exit(-1);
 	}
-	
-	if (EndianU32_LtoN(*(UInt32 *) (indecmpfsBuf + 4)) == 4)
+	for (i = 0; i < signature->length; i++)
 	{
-		if (inBuf == NULL)
-		{
-			fprintf(stderr, "%s: Decompression failed; resource fork required for compression type 4 but none exists\n", inFile);
-			if (inBuf != NULL)
-				free(inBuf);
-			if (indecmpfsBuf != NULL)
-				free(indecmpfsBuf);
-			free(outBuf);
-			return;
-		}
-		if (inRFLen < 0x13A ||
-			inRFLen < EndianU32_BtoN(*(UInt32 *) inBuf) + 0x4)
-		{
-			fprintf(stderr, "%s: Decompression failed; resource fork data is incomplete\n", inFile);
-			if (inBuf != NULL)
-				free(inBuf);
-			if (indecmpfsBuf != NULL)
-				free(indecmpfsBuf);
-			free(outBuf);
-			return;
-		}
-		
-		blockStart = inBuf + EndianU32_BtoN(*(UInt32 *) inBuf) + 0x4;
-		numBlocks = EndianU32_NtoL(*(UInt32 *) blockStart);
-		
-		if (inRFLen < EndianU32_BtoN(*(UInt32 *) inBuf) + 0x3A + (numBlocks * 8))
-		{
-			fprintf(stderr, "%s: Decompression failed; resource fork data is incomplete\n", inFile);
-			if (inBuf != NULL)
-				free(inBuf);
-			if (indecmpfsBuf != NULL)
-				free(indecmpfsBuf);
-			free(outBuf);
-			return;
-		}
-		if (compblksize * (numBlocks - 1) + (filesize % compblksize) > filesize)
+		if (!isxdigit(hexStr[i*2]) || !isxdigit(hexStr[i*2+1]) || sscanf(hexStr + i*2, "%2x", &byte) != 1)
 		{
-			fprintf(stderr, "%s: Decompression failed; file size given in header is incorrect\n", inFile);
-			if (inBuf != NULL)
-				free(inBuf);
-			if (indecmpfsBuf != NULL)
-				free(indecmpfsBuf);
-			free(outBuf);
-			return;
-		}
-		for (currBlock = 0; currBlock < numBlocks; currBlock++)
-		{
-			if (blockStart + EndianU32_LtoN(*(UInt32 *) (blockStart + 0x4 + (currBlock * 8))) + EndianU32_LtoN(*(UInt32 *) (blockStart + 0x8 + (currBlock * 8))) > inBuf + inRFLen)
-			{
-				fprintf(stderr, "%s: Decompression failed; resource fork data is incomplete\n", inFile);
-				if (inBuf != NULL)
-					free(inBuf);
-				if (indecmpfsBuf != NULL)
-					free(indecmpfsBuf);
-				free(outBuf);
-				return;
-			}
-			if (currBlock + 1 != numBlocks)
-				uncmpedsize = compblksize;
-			else
-				uncmpedsize = (filesize - (currBlock * compblksize) < compblksize) ? filesize - (currBlock * compblksize) : compblksize;
-			if ((compblksize * currBlock) + uncmpedsize > filesize)
-			{
-				fprintf(stderr, "%s: Decompression failed; file size given in header is incorrect\n", inFile);
-				if (inBuf != NULL)
-					free(inBuf);
-				if (indecmpfsBuf != NULL)
-					free(indecmpfsBuf);
-				free(outBuf);
-				return;
-			}
-			if ((*(unsigned char *) (blockStart + EndianU32_LtoN(*(UInt32 *) (blockStart + 0x4 + (currBlock * 8))))) == 0xFF)
-			{
-				uncmpedsize = EndianU32_LtoN(*(UInt32 *) (blockStart + 0x8 + (currBlock * 8))) - 1;
-				memcpy(outBuf + (compblksize * currBlock), blockStart + EndianU32_LtoN(*(UInt32 *) (blockStart + 0x4 + (currBlock * 8))) + 1, uncmpedsize);
-			}
-			else
-			{
-				if ((uncmpret = uncompress(outBuf + (compblksize * currBlock), &uncmpedsize, blockStart + EndianU32_LtoN(*(UInt32 *) (blockStart + 0x4 + (currBlock * 8))), EndianU32_LtoN(*(UInt32 *) (blockStart + 0x8 + (currBlock * 8))))) != Z_OK)
-				{
-					if (uncmpret == Z_BUF_ERROR)
-					{
-						fprintf(stderr, "%s: Decompression failed; uncompressed data block too large\n", inFile);
-						if (inBuf != NULL)
-							free(inBuf);
-						if (indecmpfsBuf != NULL)
-							free(indecmpfsBuf);
-						free(outBuf);
-						return;
-					}
-					else if (uncmpret == Z_DATA_ERROR)
-					{
-						fprintf(stderr, "%s: Decompression failed; compressed data block is corrupted\n", inFile);
-						if (inBuf != NULL)
-							free(inBuf);
-						if (indecmpfsBuf != NULL)
-							free(indecmpfsBuf);
-						free(outBuf);
-						return;
-					}
-					else if (uncmpret == Z_MEM_ERROR)
-					{
-						fprintf(stderr, "%s: Decompression failed; out of memory\n", inFile);
-						if (inBuf != NULL)
-							free(inBuf);
-						if (indecmpfsBuf != NULL)
-							free(indecmpfsBuf);
-						free(outBuf);
-						return;
-					}
-					else
-					{
-						fprintf(stderr, "%s: Decompression failed; an error occurred during decompression\n", inFile);
-						if (inBuf != NULL)
-							free(inBuf);
-						if (indecmpfsBuf != NULL)
-							free(indecmpfsBuf);
-						free(outBuf);
-						return;
-					}
-				}
-			}
-			if (uncmpedsize != ((filesize - (currBlock * compblksize) < compblksize) ? filesize - (currBlock * compblksize) : compblksize))
-			{
-				fprintf(stderr, "%s: Decompression failed; uncompressed data block too small\n", inFile);
-				if (inBuf != NULL)
-					free(inBuf);
-				if (indecmpfsBuf != NULL)
-					free(indecmpfsBuf);
-				free(outBuf);
-				return;
-			}
+			free(magic);
+			free(name);
+			return FALSE;
 		}
+		magic[i] = byte;
 	}
-	else if (EndianU32_LtoN(*(UInt32 *) (indecmpfsBuf + 4)) == 3)
+	signature->magic = magic;
+	signature->name = name;
+	return TRUE;
+}
+
+// Reads the start (and, if a signature needs it, the end) of an open file and returns the index of the first
+// signature that matches, or -1 if none does
+int sniffFileSignature(struct signature_table *table, int fd, long long int filesize)
+{
+	unsigned char head[4096], tail[4096];
+	ssize_t headLen = -1, tailLen = -1;
+	long int i, offset;
+	const unsigned char *buf;
+	
+	for (i = 0; i < table->numSignatures; i++)
 	{
-		if (indecmpfsLen == 0x10)
-		{
-			fprintf(stderr, "%s: Decompression failed; compression type 3 expects compressed data in extended attribute com.apple.decmpfs but none exists\n", inFile);
-			if (inBuf != NULL)
-				free(inBuf);
-			if (indecmpfsBuf != NULL)
-				free(indecmpfsBuf);
-			free(outBuf);
-			return;
-		}
-		uncmpedsize = filesize;
-		if ((*(unsigned char *) (indecmpfsBuf + 0x10)) == 0xFF)
+		offset = table->signatures[i].offset;
+		if (offset < 0 && -offset > filesize)
+			continue;
+		if (offset < 0)
 		{
-			uncmpedsize = indecmpfsLen - 0x11;
-			memcpy(outBuf, indecmpfsBuf + 0x11, uncmpedsize);
+			if (tailLen < 0)
+				tailLen = pread(fd, tail, (filesize < sizeof(tail)) ? filesize : sizeof(tail), (filesize < sizeof(tail)) ? 0 : filesize - sizeof(tail));
+			buf = tail;
+			offset += tailLen;
+			if (offset < 0 || offset + table->signatures[i].length > tailLen)
+				continue;
 		}
 		else
 		{
-			if ((uncmpret = uncompress(outBuf, &uncmpedsize, indecmpfsBuf + 0x10, indecmpfsLen - 0x10)) != Z_OK)
-			{
-				if (uncmpret == Z_BUF_ERROR)
-				{
-					fprintf(stderr, "%s: Decompression failed; uncompressed data too large\n", inFile);
-					if (inBuf != NULL)
-						free(inBuf);
-					if (indecmpfsBuf != NULL)
-						free(indecmpfsBuf);
-					free(outBuf);
-					return;
-				}
-				else if (uncmpret == Z_DATA_ERROR)
-				{
-					fprintf(stderr, "%s: Decompression failed; compressed data is corrupted\n", inFile);
-					if (inBuf != NULL)
-						free(inBuf);
-					if (indecmpfsBuf != NULL)
-						free(indecmpfsBuf);
-					free(outBuf);
-					return;
-				}
-				else if (uncmpret == Z_MEM_ERROR)
-				{
-					fprintf(stderr, "%s: Decompression failed; out of memory\n", inFile);
-					if (inBuf != NULL)
-						free(inBuf);
-					if (indecmpfsBuf != NULL)
-						free(indecmpfsBuf);
-					free(outBuf);
-					return;
-				}
-				else
-				{
-					fprintf(stderr, "%s: Decompression failed; an error occurred during decompression\n", inFile);
-					if (inBuf != NULL)
-						free(inBuf);
-					if (indecmpfsBuf != NULL)
-						free(indecmpfsBuf);
-					free(outBuf);
-					return;
-				}
-			}
+			// Most signatures sit in the first few bytes, so only read as much as the table needs
+			if (headLen < 0)
+				headLen = pread(fd, head, (filesize < 512) ? filesize : 512, 0);
+			if (offset + table->signatures[i].length > headLen && headLen == 512 && filesize > 512)
+				headLen = pread(fd, head, (filesize < sizeof(head)) ? filesize : sizeof(head), 0);
+			buf = head;
+			if (offset + table->signatures[i].length > headLen)
+				continue;
 		}
-		if (uncmpedsize != filesize)
+		if (memcmp(buf + offset, table->signatures[i].magic, table->signatures[i].length) == 0)
 		{
-			fprintf(stderr, "%s: Decompression failed; uncompressed data block too small\n", inFile);
-			if (inBuf != NULL)
-				free(inBuf);
-			if (indecmpfsBuf != NULL)
-				free(indecmpfsBuf);
-			free(outBuf);
-			return;
+			pthread_mutex_lock(&table->lock);
+			table->hits[i]++;
+			table->num_skipped++;
+			pthread_mutex_unlock(&table->lock);
+			return i;
 		}
 	}
-	else
-	{
-		fprintf(stderr, "%s: Decompression failed; unknown compression type %u\n", inFile, (unsigned int) EndianU32_LtoN(*(UInt32 *) (indecmpfsBuf + 4)));
-		if (inBuf != NULL)
-			free(inBuf);
-		if (indecmpfsBuf != NULL)
-			free(indecmpfsBuf);
-		free(outBuf);
-		return;
-	}
-	
-	if (chflags(inFile, (~UF_COMPRESSED) & inFileInfo->st_flags) < 0)
-	{
-		fprintf(stderr, "%s: chflags: %s\n", inFile, strerror(errno));
-		if (inBuf != NULL)
-			free(inBuf);
-		if (indecmpfsBuf != NULL)
-			free(indecmpfsBuf);
-		free(outBuf);
-		return;
-	}
+	return -1;
+}
+
+struct token_bucket
+{
+	double rate;
+	double tokens;
+	struct timeval last;
+};
+
+// Limits on how hard a run may press on the disk and CPUs, so it can be left running in the background on a busy machine
+struct throttle
+{
+	pthread_mutex_t lock;
+	struct token_bucket bytes;
+	struct token_bucket files;
+	double cpu_share;
+	const char *control_path;
+};
+
+volatile sig_atomic_t throttleReload = 0;
+
+// Set by the --watch handlers, and also stops any walk in progress
+volatile sig_atomic_t watchStopped = 0;
+
+void stopWatching(int sig)
+{
+	watchStopped = 1;
+}
+
+void reloadThrottle(int sig)
+{
+	throttleReload = 1;
+}
+
+// Reads settings of the form "max-read-rate 20M", "max-file-rate 50" or "cpu-share 25" (0 removes a limit); settings
+// that aren't in the file keep their current values
+bool loadThrottleFile(struct throttle *throttle, const char *path)
+{
+	FILE *in;
+	char name[64], value[64];
+	long long int size;
+	double number;
 	
-	in = fopen(inFile, "r+");
-	if (in == NULL)
+	if ((in = fopen(path, "r")) == NULL)
 	{
-		fprintf(stderr, "%s: %s\n", inFile, strerror(errno));
-		if (inBuf != NULL)
-			free(inBuf);
-		if (indecmpfsBuf != NULL)
-			free(indecmpfsBuf);
-		free(outBuf);
-		utimes(inFile, times);
-		return;
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return FALSE;
 	}
-	
-	if (fwrite(outBuf, filesize, 1, in) != 1)
+	while (fscanf(in, "%63s %63s", name, value) == 2)
 	{
-		fclose(in);
-		if (chflags(inFile, UF_COMPRESSED | inFileInfo->st_flags) < 0)
-		{
-			fprintf(stderr, "%s: chflags: %s\n", inFile, strerror(errno));
-		}
-		if (inBuf != NULL)
-			free(inBuf);
-		if (indecmpfsBuf != NULL)
-			free(indecmpfsBuf);
-		free(outBuf);
-		utimes(inFile, times);
-		fprintf(stderr, "%s: Error writing to file\n", inFile);
-		return;
+		if (strcmp(name, "max-read-rate") == 0 && parseSize(value, &size))
+			throttle->bytes.rate = size;
+		else if (strcmp(name, "max-file-rate") == 0 && sscanf(value, "%lf", &number) == 1 && number >= 0)
+			throttle->files.rate = number;
+		else if (strcmp(name, "cpu-share") == 0 && sscanf(value, "%lf", &number) == 1 && number >= 0 && number <= 100)
+			throttle->cpu_share = number / 100;
+		else
+			fprintf(stderr, "%s: invalid setting %s %s\n", path, name, value);
 	}
-	
 	fclose(in);
+	return TRUE;
+}
+
+void sleepFor(double seconds)
+{
+	struct timespec wait;
 	
-	if (removexattr(inFile, "com.apple.decmpfs", XATTR_NOFOLLOW | XATTR_SHOWCOMPRESSION) < 0)
+	wait.tv_sec = (time_t) seconds;
+	wait.tv_nsec = (long) ((seconds - wait.tv_sec) * 1000000000);
+	while (nanosleep(&wait, &wait) < 0 && errno == EINTR);
+}
+
+// Takes amount tokens from the bucket and waits until it is out of debt; a bucket holds at most a second's worth, and a
+// request larger than that is let through straight away with the threads that come after it waiting for it to be paid off
+void takeTokens(struct throttle *throttle, struct token_bucket *bucket, double amount)
+{
+	struct timeval now;
+	double wait = 0;
+	
+	pthread_mutex_lock(&throttle->lock);
+	if (throttleReload && throttle->control_path != NULL)
 	{
-		fprintf(stderr, "%s: removexattr: %s\n", inFile, strerror(errno));
+		throttleReload = 0;
+		loadThrottleFile(throttle, throttle->control_path);
 	}
-	if (EndianU32_LtoN(*(UInt32 *) (indecmpfsBuf + 4)) == 4 && 
-		removexattr(inFile, "com.apple.ResourceFork", XATTR_NOFOLLOW | XATTR_SHOWCOMPRESSION) < 0)
+	gettimeofday(&now, NULL);
+	if (bucket->rate > 0)
 	{
-		fprintf(stderr, "%s: removexattr: %s\n", inFile, strerror(errno));
+		bucket->tokens += ((now.tv_sec - bucket->last.tv_sec) + (now.tv_usec - bucket->last.tv_usec) / 1000000.0) * bucket->rate;
+		if (bucket->tokens > bucket->rate)
+			bucket->tokens = bucket->rate;
+		bucket->tokens -= amount;
+		if (bucket->tokens < 0)
+			wait = -bucket->tokens / bucket->rate;
 	}
-	
-	if (inBuf != NULL)
-		free(inBuf);
-	if (indecmpfsBuf != NULL)
-		free(indecmpfsBuf);
-	free(outBuf);
-	utimes(inFile, times);
+	else
+		bucket->tokens = 0;
+	bucket->last = now;
+	pthread_mutex_unlock(&throttle->lock);
+	if (wait > 0)
+		sleepFor(wait);
 }
 
-bool checkForHardLink(const char *filepath, const struct stat *fileInfo, const struct folder_info *folderinfo)
+// Rests after a stretch of compressing so that a compressor thread keeps its share of a CPU to about cpu_share
+void pauseForCPUShare(struct throttle *throttle, const struct timeval *start)
 {
-	static ino_t *hardLinks = NULL;
-	static char **paths = NULL, *list_item;
-	static long int currSize = 0, numLinks = 0;
-	long int right_pos, left_pos = 0, curr_pos = 1;
+	struct timeval now;
+	double share, busy;
+	
+	pthread_mutex_lock(&throttle->lock);
+	share = throttle->cpu_share;
+	pthread_mutex_unlock(&throttle->lock);
+	if (share <= 0 || share >= 1)
+		return;
+	gettimeofday(&now, NULL);
+	busy = (now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec) / 1000000.0;
+	if (busy > 0)
+		sleepFor(busy * (1 / share - 1));
+}
+
+struct throttle *createThrottle(long long int readRate, double fileRate, double cpuShare, const char *controlPath)
+{
+	struct throttle *throttle;
 	
-	if (fileInfo != NULL && fileInfo->st_nlink > 1)
+	throttle = (struct throttle *) calloc(1, sizeof(struct throttle));
+	if (throttle == NULL)
 	{
-		if (hardLinks == NULL)
-		{
-			currSize = 1;
-			hardLinks = (ino_t *) malloc(currSize * sizeof(ino_t));
-			if (hardLinks == NULL)
-			{
-				fprintf(stderr, "Malloc error allocating memory for list of file hard links, exiting...\n");
-				exit(-1);
-			}
-			paths = (char **) malloc(currSize * sizeof(char *));
-			if (paths == NULL)
-			{
-				fprintf(stderr, "Malloc error allocating memory for list of file hard links, exiting...\n");
-				exit(-1);
-			}
-		}
-		
-		if (numLinks > 0)
-		{
-			left_pos = 0;
-			right_pos = numLinks + 1;
-			
-			while (hardLinks[curr_pos-1] != fileInfo->st_ino)
-			{
-				curr_pos = (right_pos - left_pos) / 2;
-				if (curr_pos == 0) break;
-				curr_pos += left_pos;
-				if (hardLinks[curr_pos-1] > fileInfo->st_ino)
-					right_pos = curr_pos;
-				else if (hardLinks[curr_pos-1] < fileInfo->st_ino)
-					left_pos = curr_pos;
-			}
-			if (curr_pos != 0 && hardLinks[curr_pos-1] == fileInfo->st_ino)
-			{
-				if (strcmp(filepath, paths[curr_pos-1]) != 0 || strlen(filepath) != strlen(paths[curr_pos-1]))
-				{
-					if (folderinfo->print_info > 1)
-						printf("%s: skipping, hard link to this %s exists at %s\n", filepath, (fileInfo->st_mode & S_IFDIR) ? "folder" : "file", paths[curr_pos-1]);
-					return TRUE;
-				}
-				else
-					return FALSE;
-			}
+		fprintf(stderr, "Malloc error allocating throttle, exiting...\n");
+		exit(-1);
+	}
+	pthread_mutex_init(&throttle->lock, NULL);
+	throttle->bytes.rate = readRate;
+	throttle->files.rate = fileRate;
+	throttle->cpu_share = cpuShare;
+	throttle->control_path = controlPath;
+	if (controlPath != NULL)
+	{
+		loadThrottleFile(throttle, controlPath);
+		signal(SIGHUP, reloadThrottle);
+	}
+	gettimeofday(&throttle->bytes.last, NULL);
+	throttle->files.last = throttle->bytes.last;
+	// The buckets start full, so a run starts at its limits rather than ramping up to them
+	throttle->bytes.tokens = throttle->bytes.rate;
+	throttle->files.tokens = throttle->files.rate;
+	return throttle;
+}
+
+bool compressFileOpen(struct compress_job *job, struct folder_info *folderinfo, dev_t *checkedDev)
+{
+	struct statfs fsInfo;
+	unsigned int compblksize = 0x10000;
+	long long int filesize = job->fileinfo.st_size;
+	char xattrnamesBuf[1024], *xattrnames = xattrnamesBuf, *curr_attr;
+	ssize_t xattrnamesize;
+	const char *inFile = job->filepath;
+	
+	job->fd = -1;
+	job->times[0].tv_sec = job->fileinfo.st_atimespec.tv_sec;
+	job->times[0].tv_usec = job->fileinfo.st_atimespec.tv_nsec / 1000;
+	job->times[1].tv_sec = job->fileinfo.st_mtimespec.tv_sec;
+	job->times[1].tv_usec = job->fileinfo.st_mtimespec.tv_nsec / 1000;
+	
+	// The file system type only needs to be checked once per device
+	if (checkedDev == NULL || *checkedDev != job->fileinfo.st_dev)
+	{
+		if (statfs(inFile, &fsInfo) < 0)
+			return FALSE;
+		if (fsInfo.f_type != 17 && fsInfo.f_type != 23 && fsInfo.f_type != 24) {
+			jobMessage(job, stdout, "Expecting f_type of 17, 23 or 24. f_type is %i.\n", fsInfo.f_type);
+			return FALSE;
 		}
-		if (currSize < numLinks + 1)
+		if (checkedDev != NULL)
+			*checkedDev = job->fileinfo.st_dev;
+	}
+	if (!S_ISREG(job->fileinfo.st_mode))
+		return FALSE;
+	if ((job->fileinfo.st_flags & UF_COMPRESSED) != 0)
+		return FALSE;
+	if (filesize > folderinfo->maxSize && folderinfo->maxSize != 0)
+		return FALSE;
+	if (filesize == 0)
+		return FALSE;
+	// Even streamed, the block table has to fit in a resource fork with room for the blocks and the trailer
+	if (blockTableSize(filesize) + 50 > 2147483647)
+		return FALSE;
+	
+	if (folderinfo->throttle != NULL)
+		takeTokens(folderinfo->throttle, &folderinfo->throttle->files, 1);
+	job->fd = open(inFile, O_RDWR | O_NOFOLLOW);
+	if (job->fd < 0)
+	{
+		jobMessage(job, stderr, "%s: %s\n", inFile, strerror(errno));
+		return FALSE;
+	}
+	
+	if (fchflags(job->fd, UF_COMPRESSED | job->fileinfo.st_flags) < 0 || fchflags(job->fd, job->fileinfo.st_flags) < 0)
+	{
+		jobMessage(job, stderr, "%s: chflags: %s\n", inFile, strerror(errno));
+		close(job->fd);
+		job->fd = -1;
+		return FALSE;
+	}
+	
+	// Most files have few or no xattrs, so try a buffer on the stack before asking for the size
+	xattrnamesize = flistxattr(job->fd, xattrnames, sizeof(xattrnamesBuf), XATTR_SHOWCOMPRESSION);
+	if (xattrnamesize < 0 && errno == ERANGE)
+	{
+		xattrnamesize = flistxattr(job->fd, NULL, 0, XATTR_SHOWCOMPRESSION);
+		if (xattrnamesize > 0)
 		{
-			currSize *= 2;
-			hardLinks = realloc(hardLinks, currSize * sizeof(ino_t));
-			if (hardLinks == NULL)
-			{
-				fprintf(stderr, "Malloc error allocating memory for list of file hard links, exiting...\n");
-				exit(-1);
-			}
-			paths = realloc(paths, currSize * sizeof(char *));
-			if (paths == NULL)
+			xattrnames = (char *) malloc(xattrnamesize);
+			if (xattrnames == NULL)
 			{
-				fprintf(stderr, "Malloc error allocating memory for list of file hard links, exiting...\n");
-				exit(-1);
+				jobMessage(job, stderr, "%s: malloc error, unable to get file information\n", inFile);
+				close(job->fd);
+				job->fd = -1;
+				return FALSE;
 			}
+			xattrnamesize = flistxattr(job->fd, xattrnames, xattrnamesize, XATTR_SHOWCOMPRESSION);
 		}
-		if ((numLinks != 0) && ((numLinks - 1) >= left_pos))
-		{
-			memmove(&hardLinks[left_pos+1], &hardLinks[left_pos], (numLinks - left_pos) * sizeof(ino_t));
-			if (paths != NULL)
-				memmove(&paths[left_pos+1], &paths[left_pos], (numLinks - left_pos) * sizeof(char *));
-		}
-		hardLinks[left_pos] = fileInfo->st_ino;
-		list_item = (char *) malloc(strlen(filepath) + 1);
-		strcpy(list_item, filepath);
-		paths[left_pos] = list_item;
-		numLinks++;
 	}
-	else if (fileInfo == NULL && hardLinks != NULL)
+	if (xattrnamesize < 0)
+	{
+		jobMessage(job, stderr, "%s: listxattr: %s\n", inFile, strerror(errno));
+		if (xattrnames != xattrnamesBuf)
+			free(xattrnames);
+		close(job->fd);
+		job->fd = -1;
+		return FALSE;
+	}
+	for (curr_attr = xattrnames; curr_attr < xattrnames + xattrnamesize; curr_attr += strlen(curr_attr) + 1)
 	{
-		free(hardLinks);
-		hardLinks = NULL;
-		currSize = 0;
-		numLinks = 0;
-		if (paths != NULL)
+		if ((strcmp(curr_attr, "com.apple.ResourceFork") == 0 && strlen(curr_attr) == 22) ||
+			(strcmp(curr_attr, "com.apple.decmpfs") == 0 && strlen(curr_attr) == 17))
 		{
-			for (curr_pos = 0; curr_pos < numLinks; curr_pos++)
-				free(paths[curr_pos]);
-			free(paths);
+			if (xattrnames != xattrnamesBuf)
+				free(xattrnames);
+			close(job->fd);
+			job->fd = -1;
+			return FALSE;
 		}
 	}
-	return FALSE;
+	if (xattrnames != xattrnamesBuf)
+		free(xattrnames);
+	
+	if (folderinfo->signatures != NULL && sniffFileSignature(folderinfo->signatures, job->fd, filesize) >= 0)
+	{
+		job->already_compressed = TRUE;
+		close(job->fd);
+		job->fd = -1;
+		utimes(inFile, job->times);
+		return FALSE;
+	}
+	
+	job->numBlocks = (filesize + compblksize - 1) / compblksize;
+	if ((filesize + 0x13A + ((long long int) job->numBlocks * 9)) > 2147483647 ||
+		(folderinfo->max_memory != 0 && compressFileMemory(filesize, job->numBlocks, FALSE) > folderinfo->max_memory &&
+		 compressFileMemory(filesize, job->numBlocks, FALSE) > compressFileMemory(filesize, job->numBlocks, TRUE)))
+	{
+		// Too large to build the resource fork in memory (or within the memory limit), compressFileEncode streams it instead
+		close(job->fd);
+		job->fd = -1;
+		job->large = TRUE;
+	}
+	// The whole file is paid for before any of it is read, including a large file that is streamed later on
+	if (folderinfo->throttle != NULL)
+		takeTokens(folderinfo->throttle, &folderinfo->throttle->bytes, filesize);
+	return TRUE;
 }
 
-void printFileInfo(const char *filepath, struct stat *fileinfo, bool appliedcomp)
+bool compressFileLoad(struct compress_job *job)
 {
-	char *xattrnames, *curr_attr;
-	ssize_t xattrnamesize, xattrssize = 0, xattrsize, RFsize = 0, compattrsize = 0;
-	long long int filesize, filesize_rounded;
-	int numxattrs = 0, numhiddenattr = 0;
-	bool hasRF = FALSE;
-	
-	printf("%s:\n", filepath);
-	
-	xattrnamesize = listxattr(filepath, NULL, 0, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW);
+	long long int filesize = job->fileinfo.st_size, inBufPos = 0;
+	ssize_t readret;
+	const char *inFile = job->filepath;
 	
-	if (xattrnamesize > 0)
+	if (job->large)
+		return TRUE;
+	job->inBuf = malloc(filesize);
+	if (job->inBuf == NULL)
 	{
-		xattrnames = (char *) malloc(xattrnamesize);
-		if (xattrnames == NULL)
+		jobMessage(job, stderr, "%s: malloc error, unable to allocate input buffer\n", inFile);
+		close(job->fd);
+		job->fd = -1;
+		utimes(inFile, job->times);
+		return FALSE;
+	}
+	while (inBufPos < filesize)
+	{
+		readret = read(job->fd, job->inBuf + inBufPos, filesize - inBufPos);
+		if (readret <= 0)
 		{
-			fprintf(stderr, "malloc error, unable to get file information\n");
-			return;
+			jobMessage(job, stderr, "%s: Error reading file\n", inFile);
+			close(job->fd);
+			job->fd = -1;
+			utimes(inFile, job->times);
+			freeCompressJobBuffers(job);
+			return FALSE;
 		}
-		if ((xattrnamesize = listxattr(filepath, xattrnames, xattrnamesize, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW)) <= 0)
+		inBufPos += readret;
+	}
+	close(job->fd);
+	job->fd = -1;
+	return TRUE;
+}
+
+bool compressFileRead(struct compress_job *job, struct folder_info *folderinfo)
+{
+	return compressFileOpen(job, folderinfo, NULL) && compressFileLoad(job);
+}
+
+void compressFileReadBatch(struct compress_job **jobs, bool *batched, bool *loaded, int numJobs, struct compress_pipeline *pipeline, dev_t *checkedDev)
+{
+	int i;
+#ifdef F_RDADVISE
+	struct radvisory readAdvice;
+#endif
+	
+	// Open all of the files first and queue read-ahead for each of them, then collect the data
+	for (i = 0; i < numJobs; i++)
+	{
+		if (!batched[i])
+			continue;
+		loaded[i] = compressFileOpen(jobs[i], pipeline->folderinfo, checkedDev);
+		// Files that don't fit in the memory limit right now are left open, to be read on their own once they do
+		if (loaded[i] && pipeline->folderinfo->max_memory != 0 && !reserveJobMemory(pipeline, jobs[i], FALSE))
 		{
-			fprintf(stderr, "listxattr: %s\n", strerror(errno));
-			free(xattrnames);
-			return;
+			batched[i] = FALSE;
+			continue;
 		}
-		for (curr_attr = xattrnames; curr_attr < xattrnames + xattrnamesize; curr_attr += strlen(curr_attr) + 1)
+#ifdef F_RDADVISE
+		if (loaded[i] && !jobs[i]->large)
 		{
-			xattrsize = getxattr(filepath, curr_attr, NULL, 0, 0, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW);
-			if (xattrsize < 0)
-			{
-				fprintf(stderr, "getxattr: %s\n", strerror(errno));
-				free(xattrnames);
-				return;
-			}
-			numxattrs++;
-			if (strcmp(curr_attr, "com.apple.ResourceFork") == 0 && strlen(curr_attr) == 22)
-			{
-				RFsize += xattrsize;
-				hasRF = TRUE;
-				numhiddenattr++;
-			}
-			else if (strcmp(curr_attr, "com.apple.decmpfs") == 0 && strlen(curr_attr) == 17)
-			{
-				compattrsize += xattrsize;
-				numhiddenattr++;
-			}
-			else
-				xattrssize += xattrsize;
+			readAdvice.ra_offset = 0;
+			readAdvice.ra_count = (int) jobs[i]->fileinfo.st_size;
+			fcntl(jobs[i]->fd, F_RDADVISE, &readAdvice);
 		}
-		free(xattrnames);
+#endif
 	}
+	for (i = 0; i < numJobs; i++)
+	{
+		if (batched[i] && loaded[i])
+			loaded[i] = compressFileLoad(jobs[i]);
+	}
+}
+
+struct dedup_index *createDedupIndex(long long int maxPayloadSize)
+{
+	struct dedup_index *index;
 	
-	if ((fileinfo->st_flags & UF_COMPRESSED) == 0)
+	index = (struct dedup_index *) calloc(1, sizeof(struct dedup_index));
+	if (index == NULL)
 	{
-		if (appliedcomp)
-			printf("Unable to compress file.\n");
+		fprintf(stderr, "Malloc error allocating duplicate file index, exiting...\n");
+		exit(-1);
+	}
+	pthread_mutex_init(&index->lock, NULL);
+	index->maxPayloadSize = maxPayloadSize;
+	return index;
+}
+
+void freeDedupIndex(struct dedup_index *index)
+{
+	long int i;
+	
+	for (i = 0; i < index->numEntries; i++)
+	{
+		free(index->entries[i].decmpfs);
+		free(index->entries[i].resourceFork);
+	}
+	free(index->entries);
+	pthread_mutex_destroy(&index->lock);
+	free(index);
+}
+
+long int findDedupEntry(struct dedup_index *index, long long int filesize, const unsigned char *hash, bool *found)
+{
+	long int left = 0, right = index->numEntries, mid;
+	int cmp;
+	
+	while (left < right)
+	{
+		mid = (left + right) / 2;
+		if (index->entries[mid].filesize != filesize)
+			cmp = (index->entries[mid].filesize < filesize) ? -1 : 1;
 		else
-			printf("File is not HFS+ compressed.\n");
-		if (hasRF)
+			cmp = memcmp(index->entries[mid].hash, hash, CC_SHA256_DIGEST_LENGTH);
+		if (cmp == 0)
 		{
-			printf("File data fork size: %lld bytes\n", fileinfo->st_size);
-			printf("File resource fork size: %ld bytes\n", RFsize);
-			filesize_rounded = filesize = fileinfo->st_size;
-			filesize_rounded += (filesize_rounded % fileinfo->st_blksize) ? fileinfo->st_blksize - (filesize_rounded % fileinfo->st_blksize) : 0;
-			filesize += RFsize;
-			filesize_rounded += RFsize;
-			filesize_rounded += (filesize_rounded % fileinfo->st_blksize) ? fileinfo->st_blksize - (filesize_rounded % fileinfo->st_blksize) : 0;
-			printf("File size (data fork + resource fork; reported size by Mac OS X Finder): %s\n", getSizeStr(filesize, filesize_rounded));
+			*found = TRUE;
+			return mid;
 		}
+		if (cmp < 0)
+			left = mid + 1;
 		else
-		{
-			filesize_rounded = filesize = fileinfo->st_size;
-			filesize_rounded += (filesize % fileinfo->st_blksize) ? fileinfo->st_blksize - (filesize % fileinfo->st_blksize) : 0;
-			printf("File data fork size (reported size by Mac OS X Finder): %s\n", getSizeStr(filesize, filesize_rounded));
-		}
-		printf("Number of extended attributes: %d\n", numxattrs - numhiddenattr);
-		printf("Total size of extended attribute data: %ld bytes\n", xattrssize);
-		printf("Appoximate overhead of extended attributes: %ld bytes\n", ((ssize_t) numxattrs) * sizeof(HFSPlusAttrKey));
-		filesize = fileinfo->st_size;
-		filesize += (filesize % fileinfo->st_blksize) ? fileinfo->st_blksize - (filesize % fileinfo->st_blksize) : 0;
-		filesize += RFsize;
-		filesize += (filesize % fileinfo->st_blksize) ? fileinfo->st_blksize - (filesize % fileinfo->st_blksize) : 0;
-		filesize += compattrsize + xattrssize + (((ssize_t) numxattrs) * sizeof(HFSPlusAttrKey)) + sizeof(HFSPlusCatalogFile);
-		printf("Appoximate total file size (data fork + resource fork + EA + EA overhead + file overhead): %s\n", getSizeStr(filesize, filesize));
+			right = mid;
 	}
-	else
+	*found = FALSE;
+	return left;
+}
+
+// CC_SHA256 takes the length as a CC_LONG, so the data is hashed in pieces that fit in one
+void hashFileData(const void *data, long long int size, unsigned char *hash)
+{
+	CC_SHA256_CTX context;
+	long long int pos, len;
+	
+	CC_SHA256_Init(&context);
+	for (pos = 0; pos < size; pos += len)
 	{
-		if (!appliedcomp)
-			printf("File is HFS+ compressed.\n");
-		filesize = fileinfo->st_size;
-		printf("File size (uncompressed data fork; reported size by Mac OS 10.6+ Finder): %s\n", getSizeStr(filesize, filesize));
-		filesize_rounded = filesize = RFsize;
-		filesize_rounded += (filesize_rounded % fileinfo->st_blksize) ? fileinfo->st_blksize - (filesize_rounded % fileinfo->st_blksize) : 0;
-		printf("File size (compressed data fork - decmpfs xattr; reported size by Mac OS 10.0-10.5 Finder): %s\n", getSizeStr(filesize, filesize_rounded));
-		filesize_rounded = filesize = RFsize;
-		filesize_rounded += (filesize_rounded % fileinfo->st_blksize) ? fileinfo->st_blksize - (filesize_rounded % fileinfo->st_blksize) : 0;
-		filesize += compattrsize;
-		filesize_rounded += compattrsize;
-		printf("File size (compressed data fork): %s\n", getSizeStr(filesize, filesize_rounded));
-		printf("Compression savings: %0.1f%%\n", (1.0 - (((double) RFsize + compattrsize) / fileinfo->st_size)) * 100.0);
-		printf("Number of extended attributes: %d\n", numxattrs - numhiddenattr);
-		printf("Total size of extended attribute data: %ld bytes\n", xattrssize);
-		printf("Appoximate overhead of extended attributes: %ld bytes\n", ((ssize_t) numxattrs) * sizeof(HFSPlusAttrKey));
-		filesize = RFsize;
-		filesize += (filesize % fileinfo->st_blksize) ? fileinfo->st_blksize - (filesize % fileinfo->st_blksize) : 0;
-		filesize += compattrsize + xattrssize + (((ssize_t) numxattrs) * sizeof(HFSPlusAttrKey)) + sizeof(HFSPlusCatalogFile);
-		printf("Appoximate total file size (compressed data fork + EA + EA overhead + file overhead): %s\n", getSizeStr(filesize, filesize));
+		len = (size - pos > 0x40000000) ? 0x40000000 : size - pos;
+		CC_SHA256_Update(&context, data + pos, (CC_LONG) len);
 	}
+	CC_SHA256_Final(hash, &context);
 }
 
-void process_file(const char *filepath, struct stat *fileinfo, struct folder_info *folderinfo)
+// Returns 1 with the job's output buffers and level filled in if an identical file was compressed earlier in the run,
+// -1 if an identical file wasn't worth compressing and 0 if no identical file has been seen
+int lookupDedupEntry(struct dedup_index *index, struct compress_job *job, const unsigned char *hash)
 {
-	char *xattrnames, *curr_attr;
-	ssize_t xattrnamesize, xattrssize = 0, xattrsize, RFsize = 0, compattrsize = 0;
-	long long int filesize, filesize_rounded;
-	int numxattrs = 0, numhiddenattr = 0;
-	bool hasRF = FALSE;
+	struct dedup_entry entry;
+	bool found;
+	long int pos;
 	
-	xattrnamesize = listxattr(filepath, NULL, 0, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW);
+	pthread_mutex_lock(&index->lock);
+	pos = findDedupEntry(index, job->fileinfo.st_size, hash, &found);
+	if (found)
+	{
+		entry = index->entries[pos];
+		index->num_deduplicated++;
+	}
+	pthread_mutex_unlock(&index->lock);
+	if (!found)
+		return 0;
+	if (entry.decmpfs == NULL)
+		return -1;
 	
-	if (xattrnamesize > 0)
+	// Payloads stay in the index until the end of the run, so they can be copied without holding the lock
+	job->outdecmpfsBuf = malloc(entry.decmpfsSize);
+	if (entry.resourceForkSize != 0)
+		job->outBuf = malloc(entry.resourceForkSize);
+	if (job->outdecmpfsBuf == NULL || (entry.resourceForkSize != 0 && job->outBuf == NULL))
 	{
-		xattrnames = (char *) malloc(xattrnamesize);
-		if (xattrnames == NULL)
+		free(job->outdecmpfsBuf);
+		free(job->outBuf);
+		job->outdecmpfsBuf = job->outBuf = NULL;
+		return 0;
+	}
+	memcpy(job->outdecmpfsBuf, entry.decmpfs, entry.decmpfsSize);
+	job->outdecmpfsSize = entry.decmpfsSize;
+	job->level = entry.level;
+	if (entry.resourceForkSize != 0)
+		memcpy(job->outBuf, entry.resourceFork, entry.resourceForkSize);
+	job->outBufSize = entry.resourceForkSize;
+	return 1;
+}
+
+// Records the compressed payload of the job, or with compressed set to FALSE that the file wasn't worth compressing
+void insertDedupEntry(struct dedup_index *index, struct compress_job *job, const unsigned char *hash, bool compressed)
+{
+	struct dedup_entry entry;
+	long long int payloadSize = 0;
+	bool found;
+	long int pos;
+	
+	memset(&entry, 0, sizeof(entry));
+	entry.filesize = job->fileinfo.st_size;
+	memcpy(entry.hash, hash, CC_SHA256_DIGEST_LENGTH);
+	entry.level = job->level;
+	if (compressed)
+	{
+		payloadSize = job->outdecmpfsSize + job->outBufSize;
+		if (index->payloadSize + payloadSize > index->maxPayloadSize)
+			return;
+		entry.decmpfs = malloc(job->outdecmpfsSize);
+		entry.resourceFork = (job->outBufSize != 0) ? malloc(job->outBufSize) : NULL;
+		if (entry.decmpfs == NULL || (job->outBufSize != 0 && entry.resourceFork == NULL))
 		{
-			fprintf(stderr, "malloc error, unable to get file information\n");
+			free(entry.decmpfs);
+			free(entry.resourceFork);
 			return;
 		}
-		if ((xattrnamesize = listxattr(filepath, xattrnames, xattrnamesize, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW)) <= 0)
+		memcpy(entry.decmpfs, job->outdecmpfsBuf, job->outdecmpfsSize);
+		entry.decmpfsSize = job->outdecmpfsSize;
+		if (job->outBufSize != 0)
+			memcpy(entry.resourceFork, job->outBuf, job->outBufSize);
+		entry.resourceForkSize = job->outBufSize;
+	}
+	
+	pthread_mutex_lock(&index->lock);
+	pos = findDedupEntry(index, entry.filesize, hash, &found);
+	if (found || index->payloadSize + payloadSize > index->maxPayloadSize)
+	{
+		pthread_mutex_unlock(&index->lock);
+		free(entry.decmpfs);
+		free(entry.resourceFork);
+		return;
+	}
+	if (index->currSize < index->numEntries + 1)
+	{
+		index->currSize = (index->currSize > 0) ? index->currSize * 2 : 64;
+		index->entries = (struct dedup_entry *) realloc(index->entries, index->currSize * sizeof(struct dedup_entry));
+		if (index->entries == NULL)
 		{
-			fprintf(stderr, "listxattr: %s\n", strerror(errno));
-			free(xattrnames);
-			return;
+			fprintf(stderr, "Malloc error allocating duplicate file index, exiting...\n");
+			exit(-1);
 		}
-		for (curr_attr = xattrnames; curr_attr < xattrnames + xattrnamesize; curr_attr += strlen(curr_attr) + 1)
+	}
+	memmove(&index->entries[pos+1], &index->entries[pos], (index->numEntries - pos) * sizeof(struct dedup_entry));
+	index->entries[pos] = entry;
+	index->numEntries++;
+	index->payloadSize += payloadSize;
+	pthread_mutex_unlock(&index->lock);
+}
+
+// Trial-compresses up to four blocks spread over the data at increasingly strong levels, and returns the strongest
+// level that still compresses at least targetMBps megabytes per second and saves noticeably more than the level before
+int chooseCompressionLevel(const void *inBuf, long long int inSize, double targetMBps)
+{
+	const int candidates[] = {1, 2, 4, 6, 9};
+	unsigned int numBlocks = (inSize + 0xFFFF) / 0x10000, numSamples, i, j;
+	unsigned long int cmpedsize, sampleLen, sampleIn, sampleOut, prevSampleOut = 0;
+	long long int pos;
+	struct timeval start, end;
+	double seconds;
+	void *outBlock;
+	int level = candidates[0];
+	
+	outBlock = malloc(compressBound(0x10000));
+	if (outBlock == NULL)
+		return level;
+	numSamples = (numBlocks < 4) ? numBlocks : 4;
+	for (i = 0; i < sizeof(candidates) / sizeof(candidates[0]); i++)
+	{
+		sampleIn = sampleOut = 0;
+		gettimeofday(&start, NULL);
+		for (j = 0; j < numSamples; j++)
 		{
-			xattrsize = getxattr(filepath, curr_attr, NULL, 0, 0, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW);
-			if (xattrsize < 0)
+			pos = ((long long int) j * numBlocks / numSamples) * 0x10000;
+			sampleLen = ((inSize - pos) > 0x10000) ? 0x10000 : inSize - pos;
+			cmpedsize = compressBound(0x10000);
+			if (compress2(outBlock, &cmpedsize, inBuf + pos, sampleLen, candidates[i]) != Z_OK)
 			{
-				fprintf(stderr, "getxattr: %s\n", strerror(errno));
-				free(xattrnames);
-				return;
+				free(outBlock);
+				return level;
 			}
-			numxattrs++;
-			if (strcmp(curr_attr, "com.apple.ResourceFork") == 0 && strlen(curr_attr) == 22)
-			{
-				RFsize += xattrsize;
-				hasRF = TRUE;
-				numhiddenattr++;
+			sampleIn += sampleLen;
+			sampleOut += (cmpedsize < sampleLen) ? cmpedsize : sampleLen + 1;
+		}
+		gettimeofday(&end, NULL);
+		seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+		if (i > 0 && ((seconds > 0 && sampleIn / seconds / 1000000 < targetMBps) || sampleOut > prevSampleOut * 0.99))
+			break;
+		level = candidates[i];
+		prevSampleOut = sampleOut;
+	}
+	free(outBlock);
+	return level;
+}
+
+int chooseFileCompressionLevel(const char *inFile, long long int filesize, double targetMBps, int defaultLevel)
+{
+	unsigned int numBlocks = (filesize + 0xFFFF) / 0x10000, i;
+	void *samples;
+	int fd, level = defaultLevel;
+	
+	// Files too large to be read into memory are sampled straight from the disk
+	samples = malloc(4 * 0x10000);
+	fd = open(inFile, O_RDONLY | O_NOFOLLOW);
+	if (samples != NULL && fd >= 0)
+	{
+		for (i = 0; i < 4; i++)
+		{
+			if (pread(fd, samples + (i * 0x10000), 0x10000, ((long long int) i * numBlocks / 4) * 0x10000) != 0x10000)
+				break;
+		}
+		if (i == 4)
+			level = chooseCompressionLevel(samples, 4 * 0x10000, targetMBps);
+	}
+	if (fd >= 0)
+		close(fd);
+	free(samples);
+	return level;
+}
+
+bool compressFileEncode(struct compress_job *job, struct folder_info *folderinfo)
+{
+	unsigned int compblksize = 0x10000, numBlocks = job->numBlocks;
+	void *inBuf, *outBuf, *outBufBlock, *outdecmpfsBuf, *currBlock, *blockStart;
+	long long int inBufPos, filesize = job->fileinfo.st_size;
+	unsigned long int cmpedsize;
+	const char *inFile = job->filepath;
+	unsigned char hash[CC_SHA256_DIGEST_LENGTH];
+	struct block_memo memo;
+	enum afsc_result result;
+	
+	job->level = folderinfo->compressionlevel;
+	if (job->large)
+	{
+		if (folderinfo->target_mbps > 0)
+			job->level = chooseFileCompressionLevel(inFile, filesize, folderinfo->target_mbps, job->level);
+		compressLargeFile(inFile, &job->fileinfo, numBlocks, job->level, folderinfo->minSavings, folderinfo->check_files, job->times, job);
+		return FALSE;
+	}
+	
+	inBuf = job->inBuf;
+	if (folderinfo->dedup != NULL)
+	{
+		hashFileData(inBuf, filesize, hash);
+		switch (lookupDedupEntry(folderinfo->dedup, job, hash))
+		{
+			case 1:
+				return TRUE;
+			case -1:
+				job->level = 0;
+				utimes(inFile, job->times);
+				freeCompressJobBuffers(job);
+				return FALSE;
+		}
+	}
+	// Small files cost little at any level, so they aren't worth the trial runs
+	if (folderinfo->target_mbps > 0 && filesize >= 0x40000)
+		job->level = chooseCompressionLevel(inBuf, filesize, folderinfo->target_mbps);
+	outBuf = job->outBuf = malloc(filesize + 0x13A + ((long long int) numBlocks * 9));
+	if (outBuf == NULL)
+	{
+		jobMessage(job, stderr, "%s: malloc error, unable to allocate output buffer\n", inFile);
+		utimes(inFile, job->times);
+		freeCompressJobBuffers(job);
+		return FALSE;
+	}
+	outdecmpfsBuf = job->outdecmpfsBuf = malloc(AFSC_MAX_INLINE_SIZE);
+	if (outdecmpfsBuf == NULL)
+	{
+		jobMessage(job, stderr, "%s: malloc error, unable to allocate xattr buffer\n", inFile);
+		utimes(inFile, job->times);
+		freeCompressJobBuffers(job);
+		return FALSE;
+	}
+	outBufBlock = malloc(compressBound(compblksize));
+	if (outBufBlock == NULL)
+	{
+		jobMessage(job, stderr, "%s: malloc error, unable to allocate compression buffer\n", inFile);
+		utimes(inFile, job->times);
+		freeCompressJobBuffers(job);
+		return FALSE;
+	}
+	afsc_write_decmpfs_header(outdecmpfsBuf, 4, filesize);
+	job->outdecmpfsSize = 0x10;
+	blockStart = outBuf + 0x104;
+	currBlock = blockStart + 0x4 + ((long long int) numBlocks * 8);
+	memset(&memo, 0, sizeof(memo));
+	for (inBufPos = 0; inBufPos < filesize; inBufPos += compblksize, currBlock += cmpedsize)
+	{
+		// A single block goes in the decmpfs xattr if it fits, which saves the resource fork
+		if (numBlocks <= 1)
+		{
+			result = afsc_encode_inline(outdecmpfsBuf, &job->outdecmpfsSize, outBufBlock, &cmpedsize, inBuf, filesize, &job->level);
+			if (result == AFSC_OK)
+				break;
+		}
+		else
+			result = compressBlock(&memo, outBufBlock, &cmpedsize, inBuf + inBufPos, ((filesize - inBufPos) > compblksize) ? compblksize : filesize - inBufPos, job->level) ? AFSC_OK : AFSC_ERR_NOMEM;
+		if (result != AFSC_OK && result != AFSC_SKIPPED_TOO_LARGE)
+		{
+			utimes(inFile, job->times);
+			freeCompressJobBuffers(job);
+			free(outBufBlock);
+			freeBlockMemo(&memo);
+			return FALSE;
+		}
+		memcpy(currBlock, outBufBlock, cmpedsize);
+		*(UInt32 *) (blockStart + ((inBufPos / compblksize) * 8) + 0x4) = EndianU32_NtoL(currBlock - blockStart);
+		*(UInt32 *) (blockStart + ((inBufPos / compblksize) * 8) + 0x8) = EndianU32_NtoL(cmpedsize);
+	}
+	free(outBufBlock);
+	freeBlockMemo(&memo);
+	
+	job->outBufSize = 0;
+	if (EndianU32_LtoN(*(UInt32 *) (outdecmpfsBuf + 4)) == 4)
+	{
+		if ((((double) (currBlock - outBuf + 50) / filesize) >= (1.0 - folderinfo->minSavings / 100) && folderinfo->minSavings != 0.0) ||
+			currBlock - outBuf + 50 >= filesize)
+		{
+			if (folderinfo->dedup != NULL)
+				insertDedupEntry(folderinfo->dedup, job, hash, FALSE);
+			utimes(inFile, job->times);
+			freeCompressJobBuffers(job);
+			return FALSE;
+		}
+		afsc_write_resource_fork_header(outBuf, numBlocks, currBlock - outBuf);
+		afsc_write_resource_fork_trailer(currBlock);
+		job->outBufSize = currBlock - outBuf + 50;
+	}
+	if (folderinfo->dedup != NULL)
+		insertDedupEntry(folderinfo->dedup, job, hash, TRUE);
+	return TRUE;
+}
+
+void compressFileCommit(struct compress_job *job, struct folder_info *folderinfo)
+{
+	struct afsc_payload payload;
+	enum afsc_result result;
+	
+	payload.decmpfs = job->outdecmpfsBuf;
+	payload.decmpfs_size = job->outdecmpfsSize;
+	payload.resource_fork = (job->outBufSize != 0) ? job->outBuf : NULL;
+	payload.resource_fork_size = job->outBufSize;
+	result = afsc_commit_payload(job->filepath, &job->fileinfo, &payload, job->inBuf, folderinfo->check_files);
+	if (result == AFSC_ERR_VERIFY_FAILED)
+		jobMessage(job, stdout, "%s: Compressed file check failed, reverting file changes\n", job->filepath);
+	else if (result != AFSC_OK)
+		jobMessage(job, stderr, "%s: %s\n", job->filepath, strerror(errno));
+	utimes(job->filepath, job->times);
+	freeCompressJobBuffers(job);
+}
+
+// Returns the compression level used, or 0 if the file was never compressed
+int compressFile(const char *inFile, struct stat *inFileInfo, struct folder_info *folderinfo)
+{
+	struct compress_job job;
+	struct timeval start;
+	bool encoded;
+	
+	memset(&job, 0, sizeof(job));
+	job.filepath = (char *) inFile;
+	job.fileinfo = *inFileInfo;
+	if (!compressFileRead(&job, folderinfo))
+	{
+		if (job.already_compressed && folderinfo->print_info > 1)
+			printf("%s: skipping, content is already compressed\n", inFile);
+		return job.level;
+	}
+	gettimeofday(&start, NULL);
+	encoded = compressFileEncode(&job, folderinfo);
+	if (folderinfo->throttle != NULL)
+		pauseForCPUShare(folderinfo->throttle, &start);
+	if (encoded)
+		compressFileCommit(&job, folderinfo);
+	return job.level;
+}
+
+void decompressFile(const char *inFile, struct stat *inFileInfo)
+{
+	struct afsc_file_info info;
+	enum afsc_result result;
+	
+	if (!S_ISREG(inFileInfo->st_mode))
+		return;
+	if ((inFileInfo->st_flags & UF_COMPRESSED) == 0)
+		return;
+	
+	if ((result = afsc_decompress_file(inFile, 0, &info)) == AFSC_ERR_IO)
+		fprintf(stderr, "%s: %s\n", inFile, strerror(errno));
+	else if (result != AFSC_OK && result != AFSC_NOT_COMPRESSED && result != AFSC_SKIPPED_NOT_REGULAR)
+		fprintf(stderr, "%s: Decompression failed; %s\n", inFile, afsc_strerror(result));
+}
+
+unsigned int hashExtension(const char *ext, size_t len)
+{
+	unsigned int hash = 2166136261U;
+	size_t i;
+	
+	for (i = 0; i < len; i++)
+		hash = (hash ^ (unsigned char) tolower(ext[i])) * 16777619U;
+	return hash;
+}
+
+bool hasExtension(const struct extension_set *set, const char *name)
+{
+	const char *ext = strrchr(name, '.');
+	size_t len;
+	unsigned int slot;
+	
+	if (set->count == 0 || ext == NULL || ext == name)
+		return FALSE;
+	ext++;
+	len = strlen(ext);
+	for (slot = hashExtension(ext, len) & (set->size - 1); set->slots[slot] != NULL; slot = (slot + 1) & (set->size - 1))
+	{
+		if (strlen(set->slots[slot]) == len && strncasecmp(set->slots[slot], ext, len) == 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+void addExtension(struct extension_set *set, const char *ext, size_t len)
+{
+	char **oldSlots = set->slots;
+	unsigned int oldSize = set->size, slot, i;
+	
+	if (len == 0)
+		return;
+	// Keep the table at most half full so that probe sequences stay short
+	if ((set->count + 1) * 2 > set->size)
+	{
+		set->size = (set->size > 0) ? set->size * 2 : 64;
+		set->slots = (char **) calloc(set->size, sizeof(char *));
+		if (set->slots == NULL)
+		{
+			fprintf(stderr, "Malloc error allocating extension list, exiting...\n");
+			exit(-1);
+		}
+		for (i = 0; i < oldSize; i++)
+		{
+			if (oldSlots[i] == NULL)
+				continue;
+			for (slot = hashExtension(oldSlots[i], strlen(oldSlots[i])) & (set->size - 1); set->slots[slot] != NULL; slot = (slot + 1) & (set->size - 1));
+			set->slots[slot] = oldSlots[i];
+		}
+		free(oldSlots);
+	}
+	for (slot = hashExtension(ext, len) & (set->size - 1); set->slots[slot] != NULL; slot = (slot + 1) & (set->size - 1))
+	{
+		if (strlen(set->slots[slot]) == len && strncasecmp(set->slots[slot], ext, len) == 0)
+			return;
+	}
+	set->slots[slot] = strndup(ext, len);
+	if (set->slots[slot] == NULL)
+	{
+		fprintf(stderr, "Malloc error allocating extension list, exiting...\n");
+		exit(-1);
+	}
+	set->count++;
+}
+
+// Adds a comma separated list of extensions, with or without their leading dots
+void addExtensionList(struct extension_set *set, const char *list)
+{
+	const char *end;
+	
+	while (*list != '\0')
+	{
+		end = strchr(list, ',');
+		if (end == NULL)
+			end = list + strlen(list);
+		if (*list == '.')
+			list++;
+		if (end > list)
+			addExtension(set, list, end - list);
+		list = (*end == ',') ? end + 1 : end;
+	}
+}
+
+void addFilterGlob(struct extension_set *exts, char ***globs, int *numGlobs, const char *glob)
+{
+	// Globs of the form *.ext go into the extension set, so they don't need fnmatch
+	if (glob[0] == '*' && glob[1] == '.' && glob[2] != '\0' && strpbrk(glob + 2, "*?[]\\/.") == NULL)
+	{
+		addExtension(exts, glob + 2, strlen(glob + 2));
+		return;
+	}
+	*globs = (char **) realloc(*globs, (*numGlobs + 1) * sizeof(char *));
+	if (*globs == NULL)
+	{
+		fprintf(stderr, "Malloc error allocating filter list, exiting...\n");
+		exit(-1);
+	}
+	(*globs)[(*numGlobs)++] = (char *) glob;
+}
+
+bool matchFilterGlobs(char **globs, int numGlobs, const char *filepath, const char *name, const char *relpath)
+{
+	int i;
+	
+	// Globs with a slash in them are matched against the path (relative to the folder given, unless the glob
+	// starts with a slash), all others against the name
+	for (i = 0; i < numGlobs; i++)
+	{
+		if (fnmatch(globs[i], (strchr(globs[i], '/') == NULL) ? name : (globs[i][0] == '/') ? filepath : relpath, 0) == 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+// Decides from the path and file information alone whether a file or folder takes part in the run
+bool filterAllowsFile(const struct file_filter *filter, const char *filepath, const char *name, const char *relpath, const struct stat *fileinfo, bool isRoot)
+{
+	time_t age;
+	
+	if (!isRoot && (hasExtension(&filter->exclude_exts, name) ||
+					matchFilterGlobs(filter->exclude_globs, filter->num_exclude_globs, filepath, name, relpath)))
+		return FALSE;
+	if (S_ISDIR(fileinfo->st_mode))
+		return TRUE;
+	
+	if ((filter->include_exts.count > 0 || filter->num_include_globs > 0) &&
+		!hasExtension(&filter->include_exts, name) &&
+		!matchFilterGlobs(filter->include_globs, filter->num_include_globs, filepath, name, relpath))
+		return FALSE;
+	if (fileinfo->st_size < filter->min_size || (filter->max_size != 0 && fileinfo->st_size > filter->max_size))
+		return FALSE;
+	age = filter->now - fileinfo->st_mtimespec.tv_sec;
+	if ((filter->min_age != 0 && age < filter->min_age) || (filter->max_age != 0 && age > filter->max_age))
+		return FALSE;
+	if (filter->check_owner && fileinfo->st_uid != filter->owner)
+		return FALSE;
+	return TRUE;
+}
+
+// Excluded folders are not descended into
+bool filterAllowsEntry(const struct file_filter *filter, const FTSENT *entry)
+{
+	const FTSENT *root;
+	const char *relpath = entry->fts_path;
+	
+	if (entry->fts_level > 0)
+	{
+		for (root = entry; root->fts_level > 0; root = root->fts_parent);
+		relpath = entry->fts_path + root->fts_pathlen + ((entry->fts_path[root->fts_pathlen] == '/') ? 1 : 0);
+	}
+	return filterAllowsFile(filter, entry->fts_path, entry->fts_name, relpath, entry->fts_statp, entry->fts_level == 0);
+}
+
+// For a file found outside a walk: the folders between the root and the file are checked against the excludes as the
+// walk would have checked them before descending into them
+bool filterAllowsRelativePath(const struct file_filter *filter, const char *filepath, const char *relpath, const struct stat *fileinfo)
+{
+	char *ancestor, *component, *slash;
+	size_t rootlen = relpath - filepath;
+	bool allowed = TRUE;
+	
+	if ((ancestor = strdup(filepath)) == NULL)
+	{
+		fprintf(stderr, "Unable to allocate memory for path, exiting...\n");
+		exit(-1);
+	}
+	component = ancestor + rootlen;
+	while (allowed && (slash = strchr(component, '/')) != NULL)
+	{
+		*slash = '\0';
+		if (hasExtension(&filter->exclude_exts, component) ||
+			matchFilterGlobs(filter->exclude_globs, filter->num_exclude_globs, ancestor, component, ancestor + rootlen))
+			allowed = FALSE;
+		*slash = '/';
+		component = slash + 1;
+	}
+	free(ancestor);
+	return allowed && filterAllowsFile(filter, filepath, filepath + (component - ancestor), relpath, fileinfo, FALSE);
+}
+
+bool parseAge(const char *str, time_t *age)
+{
+	char *end;
+	double value;
+	
+	value = strtod(str, &end);
+	if (end == str || value < 0)
+		return FALSE;
+	switch (*end)
+	{
+		case 's':
+			break;
+		case 'm':
+			value *= 60;
+			break;
+		case 'h':
+			value *= 60 * 60;
+			break;
+		case '\0':
+		case 'd':
+			value *= 60 * 60 * 24;
+			break;
+		case 'w':
+			value *= 60 * 60 * 24 * 7;
+			break;
+		default:
+			return FALSE;
+	}
+	if (*end != '\0' && *(end + 1) != '\0')
+		return FALSE;
+	*age = (time_t) value;
+	return TRUE;
+}
+
+struct hard_link_table *createHardLinkTable()
+{
+	struct hard_link_table *table;
+	
+	table = (struct hard_link_table *) calloc(1, sizeof(struct hard_link_table));
+	if (table == NULL)
+	{
+		fprintf(stderr, "Malloc error allocating memory for list of file hard links, exiting...\n");
+		exit(-1);
+	}
+	return table;
+}
+
+// Forgets the links seen so far, so the next walk starts afresh
+void clearHardLinkTable(struct hard_link_table *table)
+{
+	long int i;
+	
+	for (i = 0; i < table->numLinks; i++)
+		free(table->paths[i]);
+	free(table->hardLinks);
+	free(table->paths);
+	table->hardLinks = NULL;
+	table->paths = NULL;
+	table->currSize = 0;
+	table->numLinks = 0;
+}
+
+int compareHardLinkID(const struct hard_link_id *id, const struct stat *fileInfo)
+{
+	if (id->dev != fileInfo->st_dev)
+		return (id->dev > fileInfo->st_dev) ? 1 : -1;
+	return (id->ino > fileInfo->st_ino) - (id->ino < fileInfo->st_ino);
+}
+
+bool checkForHardLink(const char *filepath, const struct stat *fileInfo, const struct folder_info *folderinfo)
+{
+	struct hard_link_table *table = folderinfo->hard_links;
+	char *list_item;
+	long int right_pos, left_pos = 0, curr_pos = 1;
+	
+	if (fileInfo->st_nlink > 1)
+	{
+		if (table->hardLinks == NULL)
+		{
+			table->currSize = 1;
+			table->hardLinks = (struct hard_link_id *) malloc(table->currSize * sizeof(struct hard_link_id));
+			if (table->hardLinks == NULL)
+			{
+				fprintf(stderr, "Malloc error allocating memory for list of file hard links, exiting...\n");
+				exit(-1);
+			}
+			table->paths = (char **) malloc(table->currSize * sizeof(char *));
+			if (table->paths == NULL)
+			{
+				fprintf(stderr, "Malloc error allocating memory for list of file hard links, exiting...\n");
+				exit(-1);
+			}
+		}
+		
+		if (table->numLinks > 0)
+		{
+			left_pos = 0;
+			right_pos = table->numLinks + 1;
+			
+			while (compareHardLinkID(&table->hardLinks[curr_pos-1], fileInfo) != 0)
+			{
+				curr_pos = (right_pos - left_pos) / 2;
+				if (curr_pos == 0) break;
+				curr_pos += left_pos;
+				if (compareHardLinkID(&table->hardLinks[curr_pos-1], fileInfo) > 0)
+					right_pos = curr_pos;
+				else if (compareHardLinkID(&table->hardLinks[curr_pos-1], fileInfo) < 0)
+					left_pos = curr_pos;
+			}
+			if (curr_pos != 0 && compareHardLinkID(&table->hardLinks[curr_pos-1], fileInfo) == 0)
+			{
+				if (strcmp(filepath, table->paths[curr_pos-1]) != 0 || strlen(filepath) != strlen(table->paths[curr_pos-1]))
+				{
+					if (folderinfo->print_info > 1)
+						printf("%s: skipping, hard link to this %s exists at %s\n", filepath, (fileInfo->st_mode & S_IFDIR) ? "folder" : "file", table->paths[curr_pos-1]);
+					return TRUE;
+				}
+				else
+					return FALSE;
+			}
+		}
+		if (table->currSize < table->numLinks + 1)
+		{
+			table->currSize *= 2;
+			table->hardLinks = realloc(table->hardLinks, table->currSize * sizeof(struct hard_link_id));
+			if (table->hardLinks == NULL)
+			{
+				fprintf(stderr, "Malloc error allocating memory for list of file hard links, exiting...\n");
+				exit(-1);
+			}
+			table->paths = realloc(table->paths, table->currSize * sizeof(char *));
+			if (table->paths == NULL)
+			{
+				fprintf(stderr, "Malloc error allocating memory for list of file hard links, exiting...\n");
+				exit(-1);
+			}
+		}
+		if ((table->numLinks != 0) && ((table->numLinks - 1) >= left_pos))
+		{
+			memmove(&table->hardLinks[left_pos+1], &table->hardLinks[left_pos], (table->numLinks - left_pos) * sizeof(struct hard_link_id));
+			memmove(&table->paths[left_pos+1], &table->paths[left_pos], (table->numLinks - left_pos) * sizeof(char *));
+		}
+		table->hardLinks[left_pos].dev = fileInfo->st_dev;
+		table->hardLinks[left_pos].ino = fileInfo->st_ino;
+		list_item = (char *) malloc(strlen(filepath) + 1);
+		strcpy(list_item, filepath);
+		table->paths[left_pos] = list_item;
+		table->numLinks++;
+	}
+	return FALSE;
+}
+
+void printFileInfo(const char *filepath, struct stat *fileinfo, bool appliedcomp)
+{
+	char *xattrnames, *curr_attr, sizeStr[90];
+	ssize_t xattrnamesize, xattrssize = 0, xattrsize, RFsize = 0, compattrsize = 0;
+	long long int filesize, filesize_rounded;
+	int numxattrs = 0, numhiddenattr = 0;
+	bool hasRF = FALSE;
+	
+	printf("%s:\n", filepath);
+	
+	xattrnamesize = listxattr(filepath, NULL, 0, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW);
+	
+	if (xattrnamesize > 0)
+	{
+		xattrnames = (char *) malloc(xattrnamesize);
+		if (xattrnames == NULL)
+		{
+			fprintf(stderr, "malloc error, unable to get file information\n");
+			return;
+		}
+		if ((xattrnamesize = listxattr(filepath, xattrnames, xattrnamesize, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW)) <= 0)
+		{
+			fprintf(stderr, "listxattr: %s\n", strerror(errno));
+			free(xattrnames);
+			return;
+		}
+		for (curr_attr = xattrnames; curr_attr < xattrnames + xattrnamesize; curr_attr += strlen(curr_attr) + 1)
+		{
+			xattrsize = getxattr(filepath, curr_attr, NULL, 0, 0, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW);
+			if (xattrsize < 0)
+			{
+				fprintf(stderr, "getxattr: %s\n", strerror(errno));
+				free(xattrnames);
+				return;
+			}
+			numxattrs++;
+			if (strcmp(curr_attr, "com.apple.ResourceFork") == 0 && strlen(curr_attr) == 22)
+			{
+				RFsize += xattrsize;
+				hasRF = TRUE;
+				numhiddenattr++;
+			}
+			else if (strcmp(curr_attr, "com.apple.decmpfs") == 0 && strlen(curr_attr) == 17)
+			{
+				compattrsize += xattrsize;
+				numhiddenattr++;
+			}
+			else
+				xattrssize += xattrsize;
+		}
+		free(xattrnames);
+	}
+	
+	if ((fileinfo->st_flags & UF_COMPRESSED) == 0)
+	{
+		if (appliedcomp)
+			printf("Unable to compress file.\n");
+		else
+			printf("File is not HFS+ compressed.\n");
+		if (hasRF)
+		{
+			printf("File data fork size: %lld bytes\n", fileinfo->st_size);
+			printf("File resource fork size: %ld bytes\n", RFsize);
+			filesize_rounded = filesize = fileinfo->st_size;
+			filesize_rounded += (filesize_rounded % fileinfo->st_blksize) ? fileinfo->st_blksize - (filesize_rounded % fileinfo->st_blksize) : 0;
+			filesize += RFsize;
+			filesize_rounded += RFsize;
+			filesize_rounded += (filesize_rounded % fileinfo->st_blksize) ? fileinfo->st_blksize - (filesize_rounded % fileinfo->st_blksize) : 0;
+			printf("File size (data fork + resource fork; reported size by Mac OS X Finder): %s\n", getSizeStr(filesize, filesize_rounded, sizeStr));
+		}
+		else
+		{
+			filesize_rounded = filesize = fileinfo->st_size;
+			filesize_rounded += (filesize % fileinfo->st_blksize) ? fileinfo->st_blksize - (filesize % fileinfo->st_blksize) : 0;
+			printf("File data fork size (reported size by Mac OS X Finder): %s\n", getSizeStr(filesize, filesize_rounded, sizeStr));
+		}
+		printf("Number of extended attributes: %d\n", numxattrs - numhiddenattr);
+		printf("Total size of extended attribute data: %ld bytes\n", xattrssize);
+		printf("Appoximate overhead of extended attributes: %ld bytes\n", ((ssize_t) numxattrs) * sizeof(HFSPlusAttrKey));
+		filesize = fileinfo->st_size;
+		filesize += (filesize % fileinfo->st_blksize) ? fileinfo->st_blksize - (filesize % fileinfo->st_blksize) : 0;
+		filesize += RFsize;
+		filesize += (filesize % fileinfo->st_blksize) ? fileinfo->st_blksize - (filesize % fileinfo->st_blksize) : 0;
+		filesize += compattrsize + xattrssize + (((ssize_t) numxattrs) * sizeof(HFSPlusAttrKey)) + sizeof(HFSPlusCatalogFile);
+		printf("Appoximate total file size (data fork + resource fork + EA + EA overhead + file overhead): %s\n", getSizeStr(filesize, filesize, sizeStr));
+	}
+	else
+	{
+		if (!appliedcomp)
+			printf("File is HFS+ compressed.\n");
+		filesize = fileinfo->st_size;
+		printf("File size (uncompressed data fork; reported size by Mac OS 10.6+ Finder): %s\n", getSizeStr(filesize, filesize, sizeStr));
+		filesize_rounded = filesize = RFsize;
+		filesize_rounded += (filesize_rounded % fileinfo->st_blksize) ? fileinfo->st_blksize - (filesize_rounded % fileinfo->st_blksize) : 0;
+		printf("File size (compressed data fork - decmpfs xattr; reported size by Mac OS 10.0-10.5 Finder): %s\n", getSizeStr(filesize, filesize_rounded, sizeStr));
+		filesize_rounded = filesize = RFsize;
+		filesize_rounded += (filesize_rounded % fileinfo->st_blksize) ? fileinfo->st_blksize - (filesize_rounded % fileinfo->st_blksize) : 0;
+		filesize += compattrsize;
+		filesize_rounded += compattrsize;
+		printf("File size (compressed data fork): %s\n", getSizeStr(filesize, filesize_rounded, sizeStr));
+		printf("Compression savings: %0.1f%%\n", (1.0 - (((double) RFsize + compattrsize) / fileinfo->st_size)) * 100.0);
+		printf("Number of extended attributes: %d\n", numxattrs - numhiddenattr);
+		printf("Total size of extended attribute data: %ld bytes\n", xattrssize);
+		printf("Appoximate overhead of extended attributes: %ld bytes\n", ((ssize_t) numxattrs) * sizeof(HFSPlusAttrKey));
+		filesize = RFsize;
+		filesize += (filesize % fileinfo->st_blksize) ? fileinfo->st_blksize - (filesize % fileinfo->st_blksize) : 0;
+		filesize += compattrsize + xattrssize + (((ssize_t) numxattrs) * sizeof(HFSPlusAttrKey)) + sizeof(HFSPlusCatalogFile);
+		printf("Appoximate total file size (compressed data fork + EA + EA overhead + file overhead): %s\n", getSizeStr(filesize, filesize, sizeStr));
+	}
+}
+
+bool getFileXattrInfo(const char *filepath, struct file_xattr_info *xattrinfo, struct compress_job *job)
+{
+	char *xattrnames, *curr_attr;
+	ssize_t xattrnamesize, xattrsize;
+	
+	memset(xattrinfo, 0, sizeof(struct file_xattr_info));
+	xattrnamesize = listxattr(filepath, NULL, 0, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW);
+	
+	if (xattrnamesize > 0)
+	{
+		xattrnames = (char *) malloc(xattrnamesize);
+		if (xattrnames == NULL)
+		{
+			jobMessage(job, stderr, "malloc error, unable to get file information\n");
+			return FALSE;
+		}
+		if ((xattrnamesize = listxattr(filepath, xattrnames, xattrnamesize, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW)) <= 0)
+		{
+			jobMessage(job, stderr, "listxattr: %s\n", strerror(errno));
+			free(xattrnames);
+			return FALSE;
+		}
+		for (curr_attr = xattrnames; curr_attr < xattrnames + xattrnamesize; curr_attr += strlen(curr_attr) + 1)
+		{
+			xattrsize = getxattr(filepath, curr_attr, NULL, 0, 0, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW);
+			if (xattrsize < 0)
+			{
+				jobMessage(job, stderr, "getxattr: %s\n", strerror(errno));
+				free(xattrnames);
+				return FALSE;
+			}
+			xattrinfo->numxattrs++;
+			if (strcmp(curr_attr, "com.apple.ResourceFork") == 0 && strlen(curr_attr) == 22)
+			{
+				xattrinfo->RFsize += xattrsize;
+				xattrinfo->hasRF = TRUE;
+				xattrinfo->numhiddenattr++;
+			}
+			else if (strcmp(curr_attr, "com.apple.decmpfs") == 0 && strlen(curr_attr) == 17)
+			{
+				xattrinfo->compattrsize += xattrsize;
+				xattrinfo->numhiddenattr++;
+			}
+			else
+				xattrinfo->xattrssize += xattrsize;
+		}
+		free(xattrnames);
+	}
+	return TRUE;
+}
+
+const char *fileExtension(const char *filepath)
+{
+	const char *name = strrchr(filepath, '/'), *ext;
+	
+	name = (name != NULL) ? name + 1 : filepath;
+	ext = strrchr(name, '.');
+	return (ext != NULL && ext != name) ? ext + 1 : "";
+}
+
+long int findRatioEntry(struct ratio_cache *cache, const char *ext, bool *found)
+{
+	long int left = 0, right = cache->numEntries, mid;
+	int cmp;
+	
+	while (left < right)
+	{
+		mid = (left + right) / 2;
+		cmp = strcasecmp(cache->entries[mid].ext, ext);
+		if (cmp == 0)
+		{
+			*found = TRUE;
+			return mid;
+		}
+		if (cmp < 0)
+			left = mid + 1;
+		else
+			right = mid;
+	}
+	*found = FALSE;
+	return left;
+}
+
+void addRatioSample(struct ratio_cache *cache, const char *ext, long long int logicalSize, long long int storedSize)
+{
+	bool found;
+	long int pos = findRatioEntry(cache, ext, &found);
+	
+	if (!found)
+	{
+		if (cache->currSize < cache->numEntries + 1)
+		{
+			cache->currSize = (cache->currSize > 0) ? cache->currSize * 2 : 64;
+			cache->entries = (struct ratio_entry *) realloc(cache->entries, cache->currSize * sizeof(struct ratio_entry));
+			if (cache->entries == NULL)
+			{
+				fprintf(stderr, "Malloc error allocating compression ratio cache, exiting...\n");
+				exit(-1);
+			}
+		}
+		memmove(&cache->entries[pos+1], &cache->entries[pos], (cache->numEntries - pos) * sizeof(struct ratio_entry));
+		cache->entries[pos].ext = strdup(ext);
+		if (cache->entries[pos].ext == NULL)
+		{
+			fprintf(stderr, "Malloc error allocating compression ratio cache, exiting...\n");
+			exit(-1);
+		}
+		cache->entries[pos].num_files = cache->entries[pos].logical_size = cache->entries[pos].stored_size = 0;
+		cache->numEntries++;
+	}
+	cache->entries[pos].num_files++;
+	cache->entries[pos].logical_size += logicalSize;
+	cache->entries[pos].stored_size += storedSize;
+}
+
+struct dir_report *createDirReport(int maxRanks)
+{
+	struct dir_report *report;
+	
+	report = (struct dir_report *) calloc(1, sizeof(struct dir_report));
+	if (report != NULL)
+	{
+		report->by_size.ranks = (struct dir_rank *) malloc(maxRanks * sizeof(struct dir_rank));
+		report->by_savings.ranks = (struct dir_rank *) malloc(maxRanks * sizeof(struct dir_rank));
+		report->by_files.ranks = (struct dir_rank *) malloc(maxRanks * sizeof(struct dir_rank));
+	}
+	if (report == NULL || report->by_size.ranks == NULL || report->by_savings.ranks == NULL || report->by_files.ranks == NULL)
+	{
+		fprintf(stderr, "Malloc error allocating folder report, exiting...\n");
+		exit(-1);
+	}
+	report->maxRanks = maxRanks;
+	return report;
+}
+
+// Keeps the maxRanks folders with the largest values in a min-heap, so the smallest of them is the one replaced
+void offerDirRank(struct dir_heap *heap, int maxRanks, const char *path, long long int value)
+{
+	struct dir_rank rank;
+	int pos, child;
+	
+	if (value <= 0 || (heap->count == maxRanks && value <= heap->ranks[0].value))
+		return;
+	rank.path = strdup(path);
+	rank.value = value;
+	if (rank.path == NULL)
+		return;
+	if (heap->count < maxRanks)
+	{
+		for (pos = heap->count++; pos > 0 && heap->ranks[(pos - 1) / 2].value > value; pos = (pos - 1) / 2)
+			heap->ranks[pos] = heap->ranks[(pos - 1) / 2];
+	}
+	else
+	{
+		free(heap->ranks[0].path);
+		for (pos = 0; (child = 2 * pos + 1) < heap->count; pos = child)
+		{
+			if (child + 1 < heap->count && heap->ranks[child + 1].value < heap->ranks[child].value)
+				child++;
+			if (heap->ranks[child].value >= value)
+				break;
+			heap->ranks[pos] = heap->ranks[child];
+		}
+	}
+	heap->ranks[pos] = rank;
+}
+
+// Starts a folder found by the walk; the walk holds one reference to it until the folder is finished
+void openDirNode(struct dir_report *report, const char *path, int level)
+{
+	struct dir_node *node;
+	
+	node = (struct dir_node *) calloc(1, sizeof(struct dir_node));
+	if (node == NULL || (node->path = strdup(path)) == NULL)
+	{
+		fprintf(stderr, "Malloc error allocating folder report, exiting...\n");
+		exit(-1);
+	}
+	node->level = level;
+	node->refs = 1;
+	node->parent = report->curr;
+	if (node->parent != NULL)
+		node->parent->refs++;
+	report->curr = node;
+}
+
+struct dir_node *retainDirNode(struct dir_report *report)
+{
+	if (report == NULL || report->curr == NULL)
+		return NULL;
+	report->curr->refs++;
+	return report->curr;
+}
+
+// Once nothing refers to a folder any more (its files are all counted and its subfolders finished), its totals are
+// final: they are ranked and added to its parent's
+void releaseDirNode(struct dir_report *report, struct dir_node *node)
+{
+	struct dir_node *parent;
+	
+	while (node != NULL && --node->refs == 0)
+	{
+		parent = node->parent;
+		if (parent != NULL)
+		{
+			parent->num_files += node->num_files;
+			parent->uncompressed_size += node->uncompressed_size;
+			parent->compressed_size += node->compressed_size;
+			parent->total_size += node->total_size;
+		}
+		// The roots themselves are already covered by the folder summary
+		if (node->level > FTS_ROOTLEVEL)
+		{
+			offerDirRank(&report->by_size, report->maxRanks, node->path, node->compressed_size);
+			offerDirRank(&report->by_savings, report->maxRanks, node->path, node->uncompressed_size - node->compressed_size);
+			offerDirRank(&report->by_files, report->maxRanks, node->path, node->num_files);
+		}
+		free(node->path);
+		free(node);
+		node = parent;
+	}
+}
+
+// Called when the walk leaves a folder; folders it skipped without opening are left alone
+void closeDirNode(struct dir_report *report, int level)
+{
+	struct dir_node *node = report->curr;
+	
+	if (node == NULL || node->level != level)
+		return;
+	report->curr = node->parent;
+	releaseDirNode(report, node);
+}
+
+int compareDirRanks(const void *a, const void *b)
+{
+	const struct dir_rank *rankA = a, *rankB = b;
+	
+	if (rankA->value != rankB->value)
+		return (rankA->value > rankB->value) ? -1 : 1;
+	return strcmp(rankA->path, rankB->path);
+}
+
+void printDirRanks(struct dir_heap *heap, const char *title, bool sizes)
+{
+	char sizeStr[90];
+	int i;
+	
+	if (heap->count == 0)
+		return;
+	qsort(heap->ranks, heap->count, sizeof(struct dir_rank), compareDirRanks);
+	printf("\n%s:\n", title);
+	for (i = 0; i < heap->count; i++)
+	{
+		if (sizes)
+			printf("%s: %s\n", heap->ranks[i].path, getSizeStr(heap->ranks[i].value, heap->ranks[i].value, sizeStr));
+		else
+			printf("%s: %lld files\n", heap->ranks[i].path, heap->ranks[i].value);
+		free(heap->ranks[i].path);
+	}
+	heap->count = 0;
+}
+
+void printDirReport(struct dir_report *report)
+{
+	printDirRanks(&report->by_size, "Folders with the largest compressed size", TRUE);
+	printDirRanks(&report->by_savings, "Folders with the largest compression savings", TRUE);
+	printDirRanks(&report->by_files, "Folders with the most files", FALSE);
+}
+
+void freeDirReport(struct dir_report *report)
+{
+	int i;
+	
+	for (i = 0; i < report->by_size.count; i++)
+		free(report->by_size.ranks[i].path);
+	for (i = 0; i < report->by_savings.count; i++)
+		free(report->by_savings.ranks[i].path);
+	for (i = 0; i < report->by_files.count; i++)
+		free(report->by_files.ranks[i].path);
+	free(report->by_size.ranks);
+	free(report->by_savings.ranks);
+	free(report->by_files.ranks);
+	free(report);
+}
+
+void addHistogramSample(struct file_histograms *histograms, const char *filepath, long long int logicalSize, long long int storedSize)
+{
+	long long int size;
+	int bucket = 0;
+	
+	addRatioSample(&histograms->by_ext, fileExtension(filepath), logicalSize, storedSize);
+	for (size = logicalSize; size > 0 && bucket < 63; size >>= 1)
+		bucket++;
+	histograms->by_size[bucket].num_files++;
+	histograms->by_size[bucket].logical_size += logicalSize;
+	histograms->by_size[bucket].stored_size += storedSize;
+}
+
+// Formats the size range of a bucket, e.g. "64 KiB - 128 KiB"
+void getBucketStr(char *str, int bucket)
+{
+	const char *units[] = {"bytes", "KiB", "MiB", "GiB", "TiB", "PiB", "EiB"};
+	
+	if (bucket == 0)
+		sprintf(str, "0 bytes");
+	else
+		sprintf(str, "%lld %s - %lld %s", 1LL << ((bucket - 1) % 10), units[(bucket - 1) / 10], 1LL << (bucket % 10), units[bucket / 10]);
+}
+
+void printHistogramRow(const char *label, long long int num_files, long long int logical_size, long long int stored_size)
+{
+	printf("%-24s %10lld %18lld %18lld %7.1f%%\n", label, num_files, logical_size, stored_size,
+		   (logical_size > 0) ? (1.0 - ((double) stored_size / logical_size)) * 100.0 : 0.0);
+}
+
+void printHistograms(struct file_histograms *histograms)
+{
+	char label[64];
+	long int i;
+	
+	printf("\n%-24s %10s %18s %18s %8s\n", "Extension", "Files", "Uncompressed", "Compressed", "Savings");
+	for (i = 0; i < histograms->by_ext.numEntries; i++)
+	{
+		printHistogramRow((histograms->by_ext.entries[i].ext[0] != '\0') ? histograms->by_ext.entries[i].ext : "(none)",
+						  histograms->by_ext.entries[i].num_files, histograms->by_ext.entries[i].logical_size, histograms->by_ext.entries[i].stored_size);
+	}
+	printf("\n%-24s %10s %18s %18s %8s\n", "File size", "Files", "Uncompressed", "Compressed", "Savings");
+	for (i = 0; i < 64; i++)
+	{
+		if (histograms->by_size[i].num_files == 0)
+			continue;
+		getBucketStr(label, i);
+		printHistogramRow(label, histograms->by_size[i].num_files, histograms->by_size[i].logical_size, histograms->by_size[i].stored_size);
+	}
+}
+
+void writeJSONString(FILE *out, const char *str)
+{
+	putc('"', out);
+	for (; *str != '\0'; str++)
+	{
+		if (*str == '"' || *str == '\\')
+			fprintf(out, "\\%c", *str);
+		else if ((unsigned char) *str < 0x20)
+			fprintf(out, "\\u%04x", (unsigned char) *str);
+		else
+			putc(*str, out);
+	}
+	putc('"', out);
+}
+
+// The ratio is the stored size over the uncompressed size, so smaller is better
+bool writeHistogramsJSON(struct file_histograms *histograms, const char *jsonpath)
+{
+	FILE *out;
+	struct ratio_entry *entry;
+	struct size_bucket *bucket;
+	bool first = TRUE;
+	long int i;
+	
+	out = (strcmp(jsonpath, "-") == 0) ? stdout : fopen(jsonpath, "w");
+	if (out == NULL)
+	{
+		fprintf(stderr, "%s: %s\n", jsonpath, strerror(errno));
+		return FALSE;
+	}
+	fprintf(out, "{\n  \"extensions\": [");
+	for (i = 0; i < histograms->by_ext.numEntries; i++)
+	{
+		entry = &histograms->by_ext.entries[i];
+		fprintf(out, "%s\n    {\"extension\": ", (i > 0) ? "," : "");
+		writeJSONString(out, entry->ext);
+		fprintf(out, ", \"files\": %lld, \"logical_bytes\": %lld, \"stored_bytes\": %lld, \"ratio\": %.4f}", entry->num_files,
+				entry->logical_size, entry->stored_size, (entry->logical_size > 0) ? (double) entry->stored_size / entry->logical_size : 1.0);
+	}
+	fprintf(out, "\n  ],\n  \"sizes\": [");
+	for (i = 0; i < 64; i++)
+	{
+		bucket = &histograms->by_size[i];
+		if (bucket->num_files == 0)
+			continue;
+		fprintf(out, "%s\n    {\"min_bytes\": %lld, \"max_bytes\": %lld, \"files\": %lld, \"logical_bytes\": %lld, \"stored_bytes\": %lld, \"ratio\": %.4f}",
+				first ? "" : ",", (i > 0) ? 1LL << (i - 1) : 0, (i < 63) ? (1LL << i) - 1 : 0x7FFFFFFFFFFFFFFFLL, bucket->num_files, bucket->logical_size,
+				bucket->stored_size, (bucket->logical_size > 0) ? (double) bucket->stored_size / bucket->logical_size : 1.0);
+		first = FALSE;
+	}
+	fprintf(out, "\n  ]\n}\n");
+	if (out != stdout && fclose(out) != 0)
+	{
+		fprintf(stderr, "%s: %s\n", jsonpath, strerror(errno));
+		return FALSE;
+	}
+	return TRUE;
+}
+
+void freeHistograms(struct file_histograms *histograms)
+{
+	long int i;
+	
+	for (i = 0; i < histograms->by_ext.numEntries; i++)
+		free(histograms->by_ext.entries[i].ext);
+	free(histograms->by_ext.entries);
+	free(histograms);
+}
+
+// Counters of the work done so far, updated with relaxed atomic adds as each file is counted and read by a thread that
+// redraws a status line on stderr (and rewrites the metrics file, if any) every second
+struct progress
+{
+	long long int num_files;
+	long long int bytes;
+	long long int bytes_saved;
+	long long int total_files;
+	long long int total_bytes;
+	bool print_line;
+	bool line_is_tty;
+	const char *metrics_path;
+	struct timeval start;
+	double rate;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	bool stop;
+};
+
+void progressAddFile(struct progress *progress, long long int bytes, long long int saved)
+{
+	__atomic_fetch_add(&progress->num_files, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&progress->bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&progress->bytes_saved, saved, __ATOMIC_RELAXED);
+}
+
+// Counts the files (and their sizes) that a run over the paths will look at, so the progress line can show an ETA
+void prescanProgress(struct progress *progress, char * const *paths, const struct file_filter *filter)
+{
+	FTS *currfolder;
+	FTSENT *currfile;
+	
+	if ((currfolder = fts_open(paths, FTS_PHYSICAL, NULL)) == NULL)
+		return;
+	while ((currfile = fts_read(currfolder)) != NULL)
+	{
+		if (filter != NULL && currfile->fts_info != FTS_DP && !filterAllowsEntry(filter, currfile))
+		{
+			if (currfile->fts_info == FTS_D)
+				fts_set(currfolder, currfile, FTS_SKIP);
+		}
+		else if (currfile->fts_info == FTS_F)
+		{
+			progress->total_files++;
+			progress->total_bytes += currfile->fts_statp->st_size;
+		}
+	}
+	fts_close(currfolder);
+}
+
+// Formats a size in the largest binary unit it fills, without sharing getSizeStr's buffer with the main thread
+char *formatProgressSize(long long int size, char *buf, size_t bufSize)
+{
+	int unit;
+	
+	if (size < sizeunit2[0])
+	{
+		snprintf(buf, bufSize, "%lld B", size);
+		return buf;
+	}
+	for (unit = 0; unit < 5 && size >= sizeunit2[unit + 1]; unit++);
+	snprintf(buf, bufSize, "%0.1f %s", (double) size / sizeunit2[unit], sizeunit2_short[unit]);
+	return buf;
+}
+
+void writeProgressMetrics(const struct progress *progress, long long int numFiles, long long int bytes, long long int saved, double eta)
+{
+	char *tmppath;
+	FILE *out;
+	
+	// Scrapers may read the file at any moment, so it is written alongside and renamed over the old one
+	tmppath = (char *) malloc(strlen(progress->metrics_path) + 5);
+	if (tmppath == NULL)
+		return;
+	sprintf(tmppath, "%s.tmp", progress->metrics_path);
+	if ((out = fopen(tmppath, "w")) == NULL)
+	{
+		free(tmppath);
+		return;
+	}
+	fprintf(out, "# HELP afsctool_files_processed_total Files counted so far.\n# TYPE afsctool_files_processed_total counter\n");
+	fprintf(out, "afsctool_files_processed_total %lld\n", numFiles);
+	fprintf(out, "# HELP afsctool_bytes_processed_total Uncompressed bytes of the files counted so far.\n# TYPE afsctool_bytes_processed_total counter\n");
+	fprintf(out, "afsctool_bytes_processed_total %lld\n", bytes);
+	fprintf(out, "# HELP afsctool_bytes_saved_total Bytes saved by compression in the files counted so far.\n# TYPE afsctool_bytes_saved_total counter\n");
+	fprintf(out, "afsctool_bytes_saved_total %lld\n", saved);
+	fprintf(out, "# HELP afsctool_throughput_bytes_per_second Recent rate of bytes processed.\n# TYPE afsctool_throughput_bytes_per_second gauge\n");
+	fprintf(out, "afsctool_throughput_bytes_per_second %0.0f\n", progress->rate);
+	if (progress->total_files > 0)
+	{
+		fprintf(out, "# HELP afsctool_files_total Files found by the scan before the run.\n# TYPE afsctool_files_total gauge\n");
+		fprintf(out, "afsctool_files_total %lld\n", progress->total_files);
+		fprintf(out, "# HELP afsctool_bytes_total Bytes found by the scan before the run.\n# TYPE afsctool_bytes_total gauge\n");
+		fprintf(out, "afsctool_bytes_total %lld\n", progress->total_bytes);
+		if (eta >= 0)
+		{
+			fprintf(out, "# HELP afsctool_eta_seconds Estimated seconds until the run is done.\n# TYPE afsctool_eta_seconds gauge\n");
+			fprintf(out, "afsctool_eta_seconds %0.0f\n", eta);
+		}
+	}
+	fclose(out);
+	if (rename(tmppath, progress->metrics_path) < 0)
+		unlink(tmppath);
+	free(tmppath);
+}
+
+void renderProgress(struct progress *progress, long long int *prevBytes, struct timeval *prevTime)
+{
+	long long int numFiles, bytes, saved;
+	struct timeval now;
+	double elapsed, interval, eta = -1;
+	char doneStr[32], totalStr[32], savedStr[32], rateStr[32];
+	
+	numFiles = __atomic_load_n(&progress->num_files, __ATOMIC_RELAXED);
+	bytes = __atomic_load_n(&progress->bytes, __ATOMIC_RELAXED);
+	saved = __atomic_load_n(&progress->bytes_saved, __ATOMIC_RELAXED);
+	gettimeofday(&now, NULL);
+	elapsed = (now.tv_sec - progress->start.tv_sec) + (now.tv_usec - progress->start.tv_usec) / 1000000.0;
+	interval = (now.tv_sec - prevTime->tv_sec) + (now.tv_usec - prevTime->tv_usec) / 1000000.0;
+	// The rate shown is smoothed over the last few seconds, while the ETA goes by the rate over the whole run
+	if (interval > 0)
+		progress->rate = (progress->rate == 0) ? (bytes - *prevBytes) / interval : progress->rate * 0.7 + 0.3 * (bytes - *prevBytes) / interval;
+	*prevBytes = bytes;
+	*prevTime = now;
+	if (progress->total_bytes > 0 && bytes > 0 && elapsed > 0)
+		eta = (progress->total_bytes > bytes) ? (progress->total_bytes - bytes) / (bytes / elapsed) : 0;
+	
+	if (progress->print_line)
+	{
+		if (progress->total_files > 0)
+			fprintf(stderr, "%lld/%lld files, %s of %s", numFiles, progress->total_files, formatProgressSize(bytes, doneStr, sizeof(doneStr)),
+					formatProgressSize(progress->total_bytes, totalStr, sizeof(totalStr)));
+		else
+			fprintf(stderr, "%lld files, %s", numFiles, formatProgressSize(bytes, doneStr, sizeof(doneStr)));
+		fprintf(stderr, ", %s saved, %s/s", formatProgressSize(saved, savedStr, sizeof(savedStr)), formatProgressSize(progress->rate, rateStr, sizeof(rateStr)));
+		if (eta >= 0)
+			fprintf(stderr, ", ETA %d:%02d:%02d", (int) eta / 3600, ((int) eta / 60) % 60, (int) eta % 60);
+		fprintf(stderr, progress->line_is_tty ? "\033[K\r" : "\n");
+	}
+	if (progress->metrics_path != NULL)
+		writeProgressMetrics(progress, numFiles, bytes, saved, eta);
+}
+
+void *progressThread(void *arg)
+{
+	struct progress *progress = arg;
+	struct timespec wakeTime;
+	struct timeval prevTime = progress->start, now;
+	long long int prevBytes = 0;
+	
+	pthread_mutex_lock(&progress->lock);
+	do
+	{
+		// A full second from now; time() can lag the clock the wait uses, which would make the wait end at once
+		gettimeofday(&now, NULL);
+		wakeTime.tv_sec = now.tv_sec + 1;
+		wakeTime.tv_nsec = now.tv_usec * 1000;
+		if (!progress->stop)
+			pthread_cond_timedwait(&progress->wake, &progress->lock, &wakeTime);
+		renderProgress(progress, &prevBytes, &prevTime);
+	} while (!progress->stop);
+	pthread_mutex_unlock(&progress->lock);
+	return NULL;
+}
+
+struct progress *startProgress(bool printLine, const char *metricsPath, char * const *prescanPaths, const struct file_filter *filter)
+{
+	struct progress *progress;
+	
+	progress = (struct progress *) calloc(1, sizeof(struct progress));
+	if (progress == NULL)
+	{
+		fprintf(stderr, "Malloc error allocating progress counters, exiting...\n");
+		exit(-1);
+	}
+	progress->print_line = printLine;
+	progress->line_is_tty = isatty(STDERR_FILENO);
+	progress->metrics_path = metricsPath;
+	if (prescanPaths != NULL)
+		prescanProgress(progress, prescanPaths, filter);
+	gettimeofday(&progress->start, NULL);
+	pthread_mutex_init(&progress->lock, NULL);
+	pthread_cond_init(&progress->wake, NULL);
+	if (pthread_create(&progress->thread, NULL, progressThread, progress) != 0)
+	{
+		fprintf(stderr, "Unable to start progress thread, exiting...\n");
+		exit(-1);
+	}
+	return progress;
+}
+
+// Stops the thread and draws the final state, leaving the line in place above whatever is printed next
+void stopProgress(struct progress *progress)
+{
+	pthread_mutex_lock(&progress->lock);
+	progress->stop = TRUE;
+	pthread_cond_signal(&progress->wake);
+	pthread_mutex_unlock(&progress->lock);
+	pthread_join(progress->thread, NULL);
+	if (progress->print_line && progress->line_is_tty)
+		fprintf(stderr, "\n");
+	pthread_mutex_destroy(&progress->lock);
+	pthread_cond_destroy(&progress->wake);
+	free(progress);
+}
+
+void process_file_info(const char *filepath, struct stat *fileinfo, const struct file_xattr_info *xattrinfo, struct folder_info *folderinfo)
+{
+	ssize_t xattrssize = xattrinfo->xattrssize, RFsize = xattrinfo->RFsize, compattrsize = xattrinfo->compattrsize;
+	long long int filesize, filesize_rounded;
+	long long int prev_uncompressed = folderinfo->uncompressed_size, prev_compressed = folderinfo->compressed_size + folderinfo->compattr_size, prev_total = folderinfo->total_size;
+	int numxattrs = xattrinfo->numxattrs, numhiddenattr = xattrinfo->numhiddenattr;
+	char sizeStr[90];
+	
+	folderinfo->num_files++;
+	if ((fileinfo->st_flags & UF_COMPRESSED) == 0)
+	{
+		filesize_rounded = filesize = fileinfo->st_size;
+		filesize_rounded += (filesize_rounded % fileinfo->st_blksize) ? fileinfo->st_blksize - (filesize_rounded % fileinfo->st_blksize) : 0;
+		filesize += RFsize;
+		filesize_rounded += RFsize;
+		filesize_rounded += (filesize_rounded % fileinfo->st_blksize) ? fileinfo->st_blksize - (filesize_rounded % fileinfo->st_blksize) : 0;
+		folderinfo->uncompressed_size += filesize;
+		folderinfo->uncompressed_size_rounded += filesize_rounded;
+		folderinfo->compressed_size += filesize;
+		folderinfo->compressed_size_rounded += filesize_rounded;
+		filesize = fileinfo->st_size;
+		filesize += (filesize % fileinfo->st_blksize) ? fileinfo->st_blksize - (filesize % fileinfo->st_blksize) : 0;
+		filesize += RFsize;
+		filesize += (filesize % fileinfo->st_blksize) ? fileinfo->st_blksize - (filesize % fileinfo->st_blksize) : 0;
+		filesize += compattrsize + xattrssize + (((ssize_t) numxattrs) * sizeof(HFSPlusAttrKey)) + sizeof(HFSPlusCatalogFile);
+		folderinfo->total_size += filesize;
+	}
+	else
+	{
+		if (folderinfo->print_files)
+		{
+			if (folderinfo->print_info > 1)
+			{
+				printf("%s:\n", filepath);
+				filesize = fileinfo->st_size;
+				printf("File size (uncompressed data fork; reported size by Mac OS 10.6+ Finder): %s\n", getSizeStr(filesize, filesize, sizeStr));
+				filesize_rounded = filesize = RFsize;
+				filesize_rounded += (filesize_rounded % fileinfo->st_blksize) ? fileinfo->st_blksize - (filesize_rounded % fileinfo->st_blksize) : 0;
+				printf("File size (compressed data fork - decmpfs xattr; reported size by Mac OS 10.0-10.5 Finder): %s\n", getSizeStr(filesize, filesize_rounded, sizeStr));
+				filesize_rounded = filesize = RFsize;
+				filesize_rounded += (filesize_rounded % fileinfo->st_blksize) ? fileinfo->st_blksize - (filesize_rounded % fileinfo->st_blksize) : 0;
+				filesize += compattrsize;
+				filesize_rounded += compattrsize;
+				printf("File size (compressed data fork): %s\n", getSizeStr(filesize, filesize_rounded, sizeStr));
+				printf("Compression savings: %0.1f%%\n", (1.0 - (((double) RFsize + compattrsize) / fileinfo->st_size)) * 100.0);
+				printf("Number of extended attributes: %d\n", numxattrs - numhiddenattr);
+				printf("Total size of extended attribute data: %ld bytes\n", xattrssize);
+				printf("Appoximate overhead of extended attributes: %ld bytes\n", ((ssize_t) numxattrs) * sizeof(HFSPlusAttrKey));
+				filesize = RFsize;
+				filesize += (filesize % fileinfo->st_blksize) ? fileinfo->st_blksize - (filesize % fileinfo->st_blksize) : 0;
+				filesize += compattrsize + xattrssize + (((ssize_t) numxattrs) * sizeof(HFSPlusAttrKey)) + sizeof(HFSPlusCatalogFile);
+				printf("Appoximate total file size (compressed data fork + EA + EA overhead + file overhead): %s\n", getSizeStr(filesize, filesize, sizeStr));
+			}
+			else if (!folderinfo->compress_files)
+			{
+				printf("%s\n", filepath);
+			}
+		}
+
+		filesize_rounded = filesize = fileinfo->st_size;
+		filesize_rounded += (filesize_rounded % fileinfo->st_blksize) ? fileinfo->st_blksize - (filesize_rounded % fileinfo->st_blksize) : 0;
+		folderinfo->uncompressed_size += filesize;
+		folderinfo->uncompressed_size_rounded += filesize_rounded;
+		filesize_rounded = filesize = RFsize;
+		filesize_rounded += (filesize_rounded % fileinfo->st_blksize) ? fileinfo->st_blksize - (filesize_rounded % fileinfo->st_blksize) : 0;
+		folderinfo->compressed_size += filesize;
+		folderinfo->compressed_size_rounded += filesize_rounded;
+		folderinfo->compattr_size += compattrsize;
+		filesize = RFsize;
+		filesize += (filesize % fileinfo->st_blksize) ? fileinfo->st_blksize - (filesize % fileinfo->st_blksize) : 0;
+		filesize += compattrsize + xattrssize + (((ssize_t) numxattrs) * sizeof(HFSPlusAttrKey)) + sizeof(HFSPlusCatalogFile);
+		folderinfo->total_size += filesize;
+		folderinfo->num_compressed++;
+	}
+	// The file is also counted in the folder it was found in
+	if (folderinfo->report != NULL && folderinfo->report->curr != NULL)
+	{
+		folderinfo->report->curr->num_files++;
+		folderinfo->report->curr->uncompressed_size += folderinfo->uncompressed_size - prev_uncompressed;
+		folderinfo->report->curr->compressed_size += folderinfo->compressed_size + folderinfo->compattr_size - prev_compressed;
+		folderinfo->report->curr->total_size += folderinfo->total_size - prev_total;
+	}
+	if (folderinfo->histograms != NULL)
+		addHistogramSample(folderinfo->histograms, filepath, folderinfo->uncompressed_size - prev_uncompressed,
+						   folderinfo->compressed_size + folderinfo->compattr_size - prev_compressed);
+	// Only regular files count towards progress, as only they are counted by the prescan
+	if (folderinfo->progress != NULL && S_ISREG(fileinfo->st_mode))
+		progressAddFile(folderinfo->progress, folderinfo->uncompressed_size - prev_uncompressed,
+						(folderinfo->uncompressed_size - prev_uncompressed) - (folderinfo->compressed_size + folderinfo->compattr_size - prev_compressed));
+}
+
+void process_file(const char *filepath, struct stat *fileinfo, struct folder_info *folderinfo)
+{
+	struct file_xattr_info xattrinfo;
+	
+	if (getFileXattrInfo(filepath, &xattrinfo, NULL))
+		process_file_info(filepath, fileinfo, &xattrinfo, folderinfo);
+}
+
+// The cache file holds one line per extension with the bytes compressed and the bytes they took up afterwards;
+// files without an extension are listed under "."
+struct ratio_cache *loadRatioCache(const char *cachepath)
+{
+	struct ratio_cache *cache;
+	FILE *in;
+	char ext[256];
+	long long int logicalSize, storedSize;
+	
+	cache = (struct ratio_cache *) calloc(1, sizeof(struct ratio_cache));
+	if (cache == NULL)
+	{
+		fprintf(stderr, "Malloc error allocating compression ratio cache, exiting...\n");
+		exit(-1);
+	}
+	in = fopen(cachepath, "r");
+	if (in == NULL)
+	{
+		if (errno != ENOENT)
+			fprintf(stderr, "%s: %s\n", cachepath, strerror(errno));
+		return cache;
+	}
+	while (fscanf(in, "%255s %lld %lld", ext, &logicalSize, &storedSize) == 3)
+		addRatioSample(cache, (strcmp(ext, ".") == 0) ? "" : ext, logicalSize, storedSize);
+	fclose(in);
+	return cache;
+}
+
+void saveRatioCache(struct ratio_cache *cache, const char *cachepath)
+{
+	FILE *out;
+	long int i;
+	
+	out = fopen(cachepath, "w");
+	if (out == NULL)
+	{
+		fprintf(stderr, "%s: %s\n", cachepath, strerror(errno));
+		return;
+	}
+	for (i = 0; i < cache->numEntries; i++)
+		fprintf(out, "%s %lld %lld\n", (cache->entries[i].ext[0] == '\0') ? "." : cache->entries[i].ext, cache->entries[i].logical_size, cache->entries[i].stored_size);
+	if (fclose(out) != 0)
+		fprintf(stderr, "%s: %s\n", cachepath, strerror(errno));
+}
+
+void recordCompressResult(const char *filepath, const struct stat *fileinfo, const struct file_xattr_info *xattrinfo, struct folder_info *folderinfo)
+{
+	if (folderinfo->ratios == NULL || fileinfo->st_size == 0 || (fileinfo->st_size > folderinfo->maxSize && folderinfo->maxSize != 0))
+		return;
+	if ((fileinfo->st_flags & UF_COMPRESSED) != 0)
+		addRatioSample(folderinfo->ratios, fileExtension(filepath), fileinfo->st_size, xattrinfo->RFsize + xattrinfo->compattrsize);
+	else
+		addRatioSample(folderinfo->ratios, fileExtension(filepath), fileinfo->st_size, fileinfo->st_size);
+}
+
+double predictRatio(const char *filepath, const struct stat *fileinfo, struct folder_info *folderinfo)
+{
+	const char *ext = fileExtension(filepath);
+	void *sample, *cmpedSample;
+	unsigned long int cmpedsize = compressBound(0x10000);
+	ssize_t sampleLen;
+	bool found;
+	long int pos;
+	int fd, i;
+	double ratio = 0.6;
+	
+	// Prefer what earlier runs saw for the extension, then the built-in guesses
+	if (folderinfo->ratios != NULL)
+	{
+		pos = findRatioEntry(folderinfo->ratios, ext, &found);
+		if (found && folderinfo->ratios->entries[pos].logical_size > 0)
+			return (double) folderinfo->ratios->entries[pos].stored_size / folderinfo->ratios->entries[pos].logical_size;
+	}
+	for (i = 0; i < sizeof(builtinRatios) / sizeof(builtinRatios[0]); i++)
+	{
+		if (strcasecmp(builtinRatios[i].ext, ext) == 0)
+			return builtinRatios[i].ratio;
+	}
+	
+	// Otherwise, compress a block from the middle of large files at the fastest level to get an idea
+	if (fileinfo->st_size < 0x100000)
+		return ratio;
+	sample = malloc(0x10000);
+	cmpedSample = malloc(cmpedsize);
+	fd = open(filepath, O_RDONLY | O_NOFOLLOW);
+	if (sample != NULL && cmpedSample != NULL && fd >= 0)
+	{
+		sampleLen = pread(fd, sample, 0x10000, (fileinfo->st_size / 2) & ~0xFFFFLL);
+		if (sampleLen > 0 && compress2(cmpedSample, &cmpedsize, sample, sampleLen, 1) == Z_OK)
+			ratio = (cmpedsize < sampleLen) ? (double) cmpedsize / sampleLen : 1.0;
+	}
+	if (fd >= 0)
+		close(fd);
+	free(sample);
+	free(cmpedSample);
+	return ratio;
+}
+
+void scheduleFile(struct file_schedule *schedule, const char *filepath, const struct stat *fileinfo, struct folder_info *folderinfo)
+{
+	struct scheduled_file *file;
+	
+	if (schedule->currSize < schedule->numFiles + 1)
+	{
+		schedule->currSize = (schedule->currSize > 0) ? schedule->currSize * 2 : 256;
+		schedule->files = (struct scheduled_file *) realloc(schedule->files, schedule->currSize * sizeof(struct scheduled_file));
+		if (schedule->files == NULL)
+		{
+			fprintf(stderr, "Malloc error allocating list of files to compress, exiting...\n");
+			exit(-1);
+		}
+	}
+	file = &schedule->files[schedule->numFiles++];
+	file->filepath = strdup(filepath);
+	if (file->filepath == NULL)
+	{
+		fprintf(stderr, "Malloc error allocating list of files to compress, exiting...\n");
+		exit(-1);
+	}
+	file->fileinfo = *fileinfo;
+	file->rootinfo = folderinfo;
+	file->dir = retainDirNode(folderinfo->report);
+	// Expected bytes saved per unit of work, where each file costs about as much as 64 KiB of data on top of its size
+	file->priority = fileinfo->st_size * (1.0 - predictRatio(filepath, fileinfo, folderinfo)) / (fileinfo->st_size + 0x10000);
+}
+
+int compareScheduledFiles(const void *a, const void *b)
+{
+	const struct scheduled_file *fileA = a, *fileB = b;
+	
+	if (fileA->priority != fileB->priority)
+		return (fileA->priority > fileB->priority) ? -1 : 1;
+	if (fileA->fileinfo.st_size != fileB->fileinfo.st_size)
+		return (fileA->fileinfo.st_size > fileB->fileinfo.st_size) ? -1 : 1;
+	return 0;
+}
+
+bool deadlinePassed(struct folder_info *folderinfo)
+{
+	if (folderinfo->deadline == 0 || time(NULL) < folderinfo->deadline)
+		return FALSE;
+	if (!folderinfo->deadline_reached)
+	{
+		fprintf(stderr, "Deadline reached, leaving the remaining files uncompressed\n");
+		folderinfo->deadline_reached = TRUE;
+	}
+	return TRUE;
+}
+
+void pushJob(struct compress_pipeline *pipeline, struct job_queue *queue, struct compress_job *job)
+{
+	pthread_mutex_lock(&pipeline->lock);
+	while (queue->max != 0 && queue->count >= queue->max)
+		pthread_cond_wait(&queue->changed, &pipeline->lock);
+	job->next = NULL;
+	if (queue->tail != NULL)
+		queue->tail->next = job;
+	else
+		queue->head = job;
+	queue->tail = job;
+	queue->count++;
+	pthread_cond_broadcast(&queue->changed);
+	pthread_mutex_unlock(&pipeline->lock);
+}
+
+struct compress_job *popJob(struct compress_pipeline *pipeline, struct job_queue *queue, bool wait)
+{
+	struct compress_job *job;
+	
+	pthread_mutex_lock(&pipeline->lock);
+	while (wait && queue->head == NULL && !queue->closed)
+		pthread_cond_wait(&queue->changed, &pipeline->lock);
+	job = queue->head;
+	if (job != NULL)
+	{
+		queue->head = job->next;
+		if (queue->head == NULL)
+			queue->tail = NULL;
+		queue->count--;
+		pthread_cond_broadcast(&queue->changed);
+	}
+	pthread_mutex_unlock(&pipeline->lock);
+	return job;
+}
+
+int popJobs(struct compress_pipeline *pipeline, struct job_queue *queue, struct compress_job **jobs, int maxJobs)
+{
+	int numJobs = 0;
+	
+	pthread_mutex_lock(&pipeline->lock);
+	while (queue->head == NULL && !queue->closed)
+		pthread_cond_wait(&queue->changed, &pipeline->lock);
+	while (queue->head != NULL && numJobs < maxJobs)
+	{
+		jobs[numJobs++] = queue->head;
+		queue->head = queue->head->next;
+		queue->count--;
+	}
+	if (queue->head == NULL)
+		queue->tail = NULL;
+	if (numJobs > 0)
+		pthread_cond_broadcast(&queue->changed);
+	pthread_mutex_unlock(&pipeline->lock);
+	return numJobs;
+}
+
+void closeJobQueue(struct compress_pipeline *pipeline, struct job_queue *queue)
+{
+	pthread_mutex_lock(&pipeline->lock);
+	queue->closed = TRUE;
+	pthread_cond_broadcast(&queue->changed);
+	pthread_mutex_unlock(&pipeline->lock);
+}
+
+void leavePipelineStage(struct compress_pipeline *pipeline, int *active, struct job_queue *next)
+{
+	pthread_mutex_lock(&pipeline->lock);
+	if (--(*active) == 0)
+	{
+		next->closed = TRUE;
+		pthread_cond_broadcast(&next->changed);
+	}
+	pthread_mutex_unlock(&pipeline->lock);
+}
+
+void finishCompressJob(struct compress_pipeline *pipeline, struct compress_job *job)
+{
+	freeCompressJobBuffers(job);
+	releaseJobMemory(pipeline, job);
+	lstat(job->filepath, &job->fileinfo);
+	job->xattrinfo_valid = getFileXattrInfo(job->filepath, &job->xattrinfo, job);
+	pushJob(pipeline, &pipeline->done_queue, job);
+}
+
+void *compressReaderThread(void *arg)
+{
+	struct compress_pipeline *pipeline = arg;
+	struct compress_job *jobs[256];
+	bool batched[256], loaded[256];
+	int numJobs, i;
+	dev_t checkedDev = (dev_t) -1;
+	
+	while ((numJobs = popJobs(pipeline, &pipeline->read_queue, jobs, pipeline->folderinfo->read_batch)) > 0)
+	{
+		// Small files are read as a batch; anything larger is read on its own right before it is handed on
+		for (i = 0; i < numJobs; i++)
+		{
+			batched[i] = (numJobs > 1 && jobs[i]->fileinfo.st_size <= 0x40000);
+			loaded[i] = FALSE;
+		}
+		compressFileReadBatch(jobs, batched, loaded, numJobs, pipeline, &checkedDev);
+		// The batch is handed on before any file waits for memory, so the reader never waits on memory it holds itself
+		for (i = 0; i < numJobs; i++)
+		{
+			if (!batched[i])
+				continue;
+			if (loaded[i])
+				pushJob(pipeline, &pipeline->compress_queue, jobs[i]);
+			else
+				finishCompressJob(pipeline, jobs[i]);
+		}
+		for (i = 0; i < numJobs; i++)
+		{
+			if (batched[i])
+				continue;
+			// A file the batch opened but had no memory for is already open, and its throttle tokens taken
+			loaded[i] = (loaded[i] || compressFileOpen(jobs[i], pipeline->folderinfo, &checkedDev)) &&
+				(pipeline->folderinfo->max_memory == 0 || reserveJobMemory(pipeline, jobs[i], TRUE)) &&
+				compressFileLoad(jobs[i]);
+			if (loaded[i])
+				pushJob(pipeline, &pipeline->compress_queue, jobs[i]);
+			else
+				finishCompressJob(pipeline, jobs[i]);
+		}
+	}
+	leavePipelineStage(pipeline, &pipeline->active_readers, &pipeline->compress_queue);
+	return NULL;
+}
+
+void *compressEncoderThread(void *arg)
+{
+	struct compress_pipeline *pipeline = arg;
+	struct compress_job *job;
+	struct timeval start;
+	bool encoded;
+	
+	while ((job = popJob(pipeline, &pipeline->compress_queue, TRUE)) != NULL)
+	{
+		gettimeofday(&start, NULL);
+		encoded = compressFileEncode(job, pipeline->folderinfo);
+		if (pipeline->folderinfo->throttle != NULL)
+			pauseForCPUShare(pipeline->folderinfo->throttle, &start);
+		if (encoded)
+			pushJob(pipeline, &pipeline->commit_queue, job);
+		else
+			finishCompressJob(pipeline, job);
+	}
+	leavePipelineStage(pipeline, &pipeline->active_compressors, &pipeline->commit_queue);
+	return NULL;
+}
+
+void *compressCommitterThread(void *arg)
+{
+	struct compress_pipeline *pipeline = arg;
+	struct compress_job *job;
+	
+	while ((job = popJob(pipeline, &pipeline->commit_queue, TRUE)) != NULL)
+	{
+		compressFileCommit(job, pipeline->folderinfo);
+		finishCompressJob(pipeline, job);
+	}
+	leavePipelineStage(pipeline, &pipeline->active_committers, &pipeline->done_queue);
+	return NULL;
+}
+
+void initJobQueue(struct job_queue *queue, int max)
+{
+	queue->head = queue->tail = NULL;
+	queue->count = 0;
+	queue->max = max;
+	queue->closed = FALSE;
+	pthread_cond_init(&queue->changed, NULL);
+}
+
+// Each reader keeps up to read_batch files open at once; the soft limit on open files is raised to fit them if it
+// can be, and the batches are made smaller if it can't
+void fitReadBatchToFileLimit(struct folder_info *folderinfo)
+{
+	struct rlimit fileLimit;
+	rlim_t headroom, needed;
+	
+	if (getrlimit(RLIMIT_NOFILE, &fileLimit) < 0 || fileLimit.rlim_cur == RLIM_INFINITY)
+		return;
+	// Files being compressed or committed, plus whatever else the process has open
+	headroom = 64 + folderinfo->compress_threads + 2 * folderinfo->commit_threads;
+	needed = (rlim_t) folderinfo->read_threads * folderinfo->read_batch + headroom;
+	if (fileLimit.rlim_cur >= needed)
+		return;
+	fileLimit.rlim_cur = (fileLimit.rlim_max != RLIM_INFINITY && fileLimit.rlim_max < needed) ? fileLimit.rlim_max : needed;
+#ifdef OPEN_MAX
+	if (fileLimit.rlim_cur > OPEN_MAX)
+		fileLimit.rlim_cur = OPEN_MAX;
+#endif
+	if (setrlimit(RLIMIT_NOFILE, &fileLimit) < 0)
+		getrlimit(RLIMIT_NOFILE, &fileLimit);
+	if (fileLimit.rlim_cur >= needed)
+		return;
+	folderinfo->read_batch = (fileLimit.rlim_cur > headroom + folderinfo->read_threads) ? (fileLimit.rlim_cur - headroom) / folderinfo->read_threads : 1;
+	if (folderinfo->read_batch > 256)
+		folderinfo->read_batch = 256;
+}
+
+struct compress_pipeline *startCompressPipeline(struct folder_info *folderinfo)
+{
+	struct compress_pipeline *pipeline;
+	int i;
+	
+	pipeline = (struct compress_pipeline *) malloc(sizeof(struct compress_pipeline));
+	if (pipeline != NULL)
+		pipeline->threads = (pthread_t *) malloc((folderinfo->read_threads + folderinfo->compress_threads + folderinfo->commit_threads) * sizeof(pthread_t));
+	if (pipeline == NULL || pipeline->threads == NULL)
+	{
+		fprintf(stderr, "Malloc error allocating compression pipeline, exiting...\n");
+		exit(-1);
+	}
+	pthread_mutex_init(&pipeline->lock, NULL);
+	fitReadBatchToFileLimit(folderinfo);
+	// Only paths wait for the readers; the later queues hold file data, so they are kept short
+	initJobQueue(&pipeline->read_queue, 64 * folderinfo->read_threads + folderinfo->read_batch);
+	initJobQueue(&pipeline->compress_queue, folderinfo->compress_threads);
+	initJobQueue(&pipeline->commit_queue, 2 * folderinfo->commit_threads);
+	initJobQueue(&pipeline->done_queue, 0);
+	pipeline->active_readers = folderinfo->read_threads;
+	pipeline->active_compressors = folderinfo->compress_threads;
+	pipeline->active_committers = folderinfo->commit_threads;
+	pipeline->memory_used = 0;
+	pthread_cond_init(&pipeline->memory_released, NULL);
+	memset(pipeline->reorder, 0, sizeof(pipeline->reorder));
+	pipeline->next_seq = 0;
+	pipeline->next_report = 0;
+	pipeline->folderinfo = folderinfo;
+	pipeline->num_threads = 0;
+	
+	for (i = 0; i < folderinfo->read_threads + folderinfo->compress_threads + folderinfo->commit_threads; i++)
+	{
+		if (pthread_create(&pipeline->threads[i], NULL,
+						   (i < folderinfo->read_threads) ? compressReaderThread :
+						   (i < folderinfo->read_threads + folderinfo->compress_threads) ? compressEncoderThread : compressCommitterThread,
+						   pipeline) != 0)
+		{
+			fprintf(stderr, "Unable to create compression threads, exiting...\n");
+			exit(-1);
+		}
+		pipeline->num_threads++;
+	}
+	return pipeline;
+}
+
+void reportCompressJob(struct compress_job *job)
+{
+	struct folder_info *folderinfo;
+	struct dir_node *walkDir = NULL;
+	
+	// Each file is counted in the totals of the root and folder it was found in
+	folderinfo = job->rootinfo;
+	if (folderinfo->report != NULL)
+	{
+		walkDir = folderinfo->report->curr;
+		folderinfo->report->curr = job->dir;
+	}
+	if (job->out_messages != NULL)
+		fputs(job->out_messages, stdout);
+	if (job->err_messages != NULL)
+		fputs(job->err_messages, stderr);
+	if (job->count_only)
+		process_file(job->filepath, &job->fileinfo, folderinfo);
+	else
+	{
+		if (job->already_compressed && folderinfo->print_info > 1)
+			printf("%s: skipping, content is already compressed\n", job->filepath);
+		if (((job->fileinfo.st_flags & UF_COMPRESSED) == 0) && folderinfo->print_files)
+		{
+			if (folderinfo->print_info > 0)
+				printf("Unable to compress: ");
+			printf("%s\n", job->filepath);
+		}
+		if ((job->fileinfo.st_flags & UF_COMPRESSED) != 0 && job->level > 0)
+			folderinfo->level_counts[job->level]++;
+		if (job->xattrinfo_valid)
+		{
+			recordCompressResult(job->filepath, &job->fileinfo, &job->xattrinfo, folderinfo);
+			process_file_info(job->filepath, &job->fileinfo, &job->xattrinfo, folderinfo);
+		}
+	}
+	if (folderinfo->report != NULL)
+	{
+		folderinfo->report->curr = walkDir;
+		releaseDirNode(folderinfo->report, job->dir);
+	}
+	free(job->out_messages);
+	free(job->err_messages);
+	free(job->filepath);
+	free(job);
+}
+
+// Finished files are reported in the order the walk found them, unless --unordered asked for them as they finish
+void collectCompressJob(struct compress_pipeline *pipeline, struct compress_job *job)
+{
+	if (!pipeline->folderinfo->ordered_output)
+	{
+		reportCompressJob(job);
+		return;
+	}
+	pipeline->reorder[job->seq % REORDER_WINDOW] = job;
+	while ((job = pipeline->reorder[pipeline->next_report % REORDER_WINDOW]) != NULL && job->seq == pipeline->next_report)
+	{
+		pipeline->reorder[pipeline->next_report % REORDER_WINDOW] = NULL;
+		pipeline->next_report++;
+		reportCompressJob(job);
+	}
+}
+
+void drainCompressPipeline(struct compress_pipeline *pipeline, bool wait)
+{
+	struct compress_job *job;
+	
+	while ((job = popJob(pipeline, &pipeline->done_queue, wait)) != NULL)
+		collectCompressJob(pipeline, job);
+}
+
+void finishCompressPipeline(struct compress_pipeline *pipeline)
+{
+	int i;
+	
+	closeJobQueue(pipeline, &pipeline->read_queue);
+	drainCompressPipeline(pipeline, TRUE);
+	for (i = 0; i < pipeline->num_threads; i++)
+		pthread_join(pipeline->threads[i], NULL);
+	pthread_cond_destroy(&pipeline->read_queue.changed);
+	pthread_cond_destroy(&pipeline->compress_queue.changed);
+	pthread_cond_destroy(&pipeline->commit_queue.changed);
+	pthread_cond_destroy(&pipeline->done_queue.changed);
+	pthread_cond_destroy(&pipeline->memory_released);
+	pthread_mutex_destroy(&pipeline->lock);
+	free(pipeline->threads);
+	free(pipeline);
+}
+
+struct compress_job *createCompressJob(struct compress_pipeline *pipeline, const char *filepath, const struct stat *fileinfo, struct folder_info *rootinfo)
+{
+	struct compress_job *job;
+	
+	// A file found more than the reorder window after the oldest unreported one waits for it, so a slow file can't
+	// leave an unbounded number of finished ones behind it
+	while (pipeline->folderinfo->ordered_output && pipeline->next_seq - pipeline->next_report >= REORDER_WINDOW)
+		collectCompressJob(pipeline, popJob(pipeline, &pipeline->done_queue, TRUE));
+	job = (struct compress_job *) calloc(1, sizeof(struct compress_job));
+	if (job == NULL || (job->filepath = strdup(filepath)) == NULL)
+	{
+		fprintf(stderr, "Malloc error allocating compression job, exiting...\n");
+		exit(-1);
+	}
+	job->fileinfo = *fileinfo;
+	job->queue_messages = TRUE;
+	job->seq = pipeline->next_seq++;
+	job->rootinfo = rootinfo;
+	job->dir = retainDirNode(rootinfo->report);
+	return job;
+}
+
+void queueCompressJob(struct compress_pipeline *pipeline, const char *filepath, const struct stat *fileinfo, struct folder_info *rootinfo)
+{
+	pushJob(pipeline, &pipeline->read_queue, createCompressJob(pipeline, filepath, fileinfo, rootinfo));
+}
+
+// Adds a file that compression was tried on (with the level used, or 0) to the totals
+void finishFolderFile(const char *filepath, struct stat *fileinfo, int level, struct folder_info *folderinfo)
+{
+	struct file_xattr_info xattrinfo;
+	
+	lstat(filepath, fileinfo);
+	if ((fileinfo->st_flags & UF_COMPRESSED) != 0 && level > 0)
+		folderinfo->level_counts[level]++;
+	if (((fileinfo->st_flags & UF_COMPRESSED) == 0) && folderinfo->print_files)
+	{
+		if (folderinfo->print_info > 0)
+			printf("Unable to compress: ");
+		printf("%s\n", filepath);
+	}
+	if (getFileXattrInfo(filepath, &xattrinfo, NULL))
+	{
+		recordCompressResult(filepath, fileinfo, &xattrinfo, folderinfo);
+		process_file_info(filepath, fileinfo, &xattrinfo, folderinfo);
+	}
+}
+
+void compressFolderFile(struct compress_pipeline *pipeline, const char *filepath, struct stat *fileinfo, struct folder_info *folderinfo)
+{
+	struct compress_job *job;
+	int level;
+	
+	// Once a stop is asked for, files still to be compressed are only counted, as after a deadline
+	if (!folderinfo->compress_files || !S_ISREG(fileinfo->st_mode) || watchStopped || deadlinePassed(folderinfo))
+	{
+		// Counted in turn behind the files still being compressed
+		if (pipeline != NULL && folderinfo->ordered_output)
+		{
+			job = createCompressJob(pipeline, filepath, fileinfo, folderinfo);
+			job->count_only = TRUE;
+			collectCompressJob(pipeline, job);
+		}
+		else
+			process_file(filepath, fileinfo, folderinfo);
+		return;
+	}
+	if (pipeline != NULL)
+	{
+		queueCompressJob(pipeline, filepath, fileinfo, folderinfo);
+		drainCompressPipeline(pipeline, FALSE);
+		return;
+	}
+	level = compressFile(filepath, fileinfo, folderinfo);
+	finishFolderFile(filepath, fileinfo, level, folderinfo);
+}
+
+// Adds a folder to the totals; returns FALSE if it is a hard link to a folder already counted, so its contents can be skipped
+bool process_directory(const char *folderpath, const struct stat *fileinfo, struct folder_info *folderinfo)
+{
+	char *xattrnames, *curr_attr;
+	ssize_t xattrnamesize, xattrssize, xattrsize;
+	int numxattrs;
+	
+	if (folderinfo->check_hard_links && checkForHardLink(folderpath, fileinfo, folderinfo))
+	{
+		folderinfo->num_hard_link_folders++;
+		folderinfo->num_folders++;
+		folderinfo->total_size += sizeof(HFSPlusCatalogFolder);
+		return FALSE;
+	}
+	
+	numxattrs = 0;
+	xattrssize = 0;
+	
+	xattrnamesize = listxattr(folderpath, NULL, 0, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW);
+	
+	if (xattrnamesize > 0)
+	{
+		xattrnames = (char *) malloc(xattrnamesize);
+		if (xattrnames == NULL)
+		{
+			fprintf(stderr, "malloc error, unable to get folder information\n");
+			return TRUE;
+		}
+		if ((xattrnamesize = listxattr(folderpath, xattrnames, xattrnamesize, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW)) <= 0)
+		{
+			fprintf(stderr, "listxattr: %s\n", strerror(errno));
+			free(xattrnames);
+			return TRUE;
+		}
+		for (curr_attr = xattrnames; curr_attr < xattrnames + xattrnamesize; curr_attr += strlen(curr_attr) + 1)
+		{
+			xattrsize = getxattr(folderpath, curr_attr, NULL, 0, 0, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW);
+			if (xattrsize < 0)
+			{
+				fprintf(stderr, "getxattr: %s\n", strerror(errno));
+				free(xattrnames);
+				return TRUE;
+			}
+			numxattrs++;
+			xattrssize += xattrsize;
+		}
+		free(xattrnames);
+	}
+	folderinfo->num_folders++;
+	folderinfo->total_size += xattrssize + (((ssize_t) numxattrs) * sizeof(HFSPlusAttrKey)) + sizeof(HFSPlusCatalogFolder);
+	return TRUE;
+}
+
+void process_folder_file(struct compress_pipeline *pipeline, struct file_schedule *schedule, const char *filepath, struct stat *fileinfo, struct folder_info *folderinfo)
+{
+	if (folderinfo->check_hard_links && checkForHardLink(filepath, fileinfo, folderinfo))
+	{
+		folderinfo->num_hard_link_files++;
+		
+		folderinfo->num_files++;
+		folderinfo->total_size += sizeof(HFSPlusCatalogFile);
+		if (folderinfo->progress != NULL && S_ISREG(fileinfo->st_mode))
+			progressAddFile(folderinfo->progress, fileinfo->st_size, 0);
+		return;
+	}
+	// In savings-first mode, files worth trying are only compressed once everything has been seen
+	if (folderinfo->savings_first && folderinfo->compress_files && S_ISREG(fileinfo->st_mode) &&
+		(fileinfo->st_flags & UF_COMPRESSED) == 0 && fileinfo->st_size > 0 &&
+		(fileinfo->st_size <= folderinfo->maxSize || folderinfo->maxSize == 0))
+		scheduleFile(schedule, filepath, fileinfo, folderinfo);
+	else
+		compressFolderFile(pipeline, filepath, fileinfo, folderinfo);
+}
+
+void runFileSchedule(struct compress_pipeline *pipeline, struct file_schedule *schedule)
+{
+	struct dir_report *report;
+	struct dir_node *walkDir;
+	long int i;
+	
+	if (schedule->numFiles > 0)
+	{
+		qsort(schedule->files, schedule->numFiles, sizeof(struct scheduled_file), compareScheduledFiles);
+		for (i = 0; i < schedule->numFiles; i++)
+		{
+			// Each file is compressed as if the walk were back in its folder
+			report = schedule->files[i].rootinfo->report;
+			if (report != NULL)
+			{
+				walkDir = report->curr;
+				report->curr = schedule->files[i].dir;
+			}
+			compressFolderFile(pipeline, schedule->files[i].filepath, &schedule->files[i].fileinfo, schedule->files[i].rootinfo);
+			if (report != NULL)
+			{
+				report->curr = walkDir;
+				releaseDirNode(report, schedule->files[i].dir);
+			}
+			free(schedule->files[i].filepath);
+		}
+	}
+	free(schedule->files);
+	schedule->files = NULL;
+	schedule->numFiles = schedule->currSize = 0;
+}
+
+// Walks every root opened in currfolder with one pipeline and one hard link tracker; the files under each root are
+// counted in its own entry of rootinfo, and the settings of the first entry are used for all of them
+void process_folder(FTS *currfolder, struct folder_info *rootinfo, int numRoots)
+{
+	FTSENT *currfile;
+	bool volume_search = FALSE;
+	struct folder_info *folderinfo = rootinfo;
+	struct compress_pipeline *pipeline = NULL;
+	struct file_schedule schedule;
+	int root = 0;
+	
+	currfile = fts_read(currfolder);
+	if (currfile == NULL)
+	{
+		fts_close(currfolder);
+		return;
+	}
+	if (rootinfo->compress_files && rootinfo->compress_threads > 0)
+		pipeline = startCompressPipeline(rootinfo);
+	memset(&schedule, 0, sizeof(schedule));
+	
+	do
+	{
+		// fts returns the roots in the order they were given
+		if (currfile->fts_level == FTS_ROOTLEVEL && currfile->fts_info != FTS_DP && root < numRoots)
+		{
+			if (root > 0)
+				rootinfo[root].deadline_reached = rootinfo[root-1].deadline_reached;
+			folderinfo = &rootinfo[root++];
+			volume_search = (strncasecmp("/Volumes/", currfile->fts_path, 9) == 0 && strlen(currfile->fts_path) >= 8);
+		}
+		if (folderinfo->filter != NULL && currfile->fts_info != FTS_DP && !filterAllowsEntry(folderinfo->filter, currfile))
+		{
+			if (currfile->fts_info == FTS_D)
+				fts_set(currfolder, currfile, FTS_SKIP);
+		}
+		else if ((volume_search || strncasecmp("/Volumes/", currfile->fts_path, 9) != 0 || strlen(currfile->fts_path) < 9) &&
+			(strncasecmp("/dev/", currfile->fts_path, 5) != 0 || strlen(currfile->fts_path) < 5))
+		{
+			if (S_ISDIR(currfile->fts_statp->st_mode) && currfile->fts_ino != 2)
+			{
+				if ((currfile->fts_info & FTS_D) && !process_directory(currfile->fts_path, currfile->fts_statp, folderinfo))
+					fts_set(currfolder, currfile, FTS_SKIP);
+				else if (currfile->fts_info == FTS_D && folderinfo->report != NULL)
+					openDirNode(folderinfo->report, currfile->fts_path, currfile->fts_level);
+				// A folder that can't be read comes back as FTS_DNR or FTS_ERR after FTS_D, and never as FTS_DP
+				else if ((currfile->fts_info == FTS_DP || currfile->fts_info == FTS_DNR || currfile->fts_info == FTS_ERR) && folderinfo->report != NULL)
+					closeDirNode(folderinfo->report, currfile->fts_level);
+			}
+			else if (S_ISREG(currfile->fts_statp->st_mode) || S_ISLNK(currfile->fts_statp->st_mode))
+			{
+				process_folder_file(pipeline, &schedule, currfile->fts_path, currfile->fts_statp, folderinfo);
+			}
+		}
+		else
+			fts_set(currfolder, currfile, FTS_SKIP);
+	} while (!watchStopped && (currfile = fts_read(currfolder)) != NULL);
+	// A stopped walk never leaves the folders it was in, so they are closed here
+	if (folderinfo->report != NULL)
+	{
+		while (folderinfo->report->curr != NULL)
+			closeDirNode(folderinfo->report, folderinfo->report->curr->level);
+	}
+	runFileSchedule(pipeline, &schedule);
+	if (pipeline != NULL)
+		finishCompressPipeline(pipeline);
+	if (rootinfo->hard_links != NULL)
+		clearHardLinkTable(rootinfo->hard_links);
+	fts_close(currfolder);
+}
+
+void decompress_folder(FTS *currfolder, struct folder_info *folderinfo)
+{
+	FTSENT *currfile;
+	
+	while ((currfile = fts_read(currfolder)) != NULL)
+	{
+		if (folderinfo->filter != NULL && currfile->fts_info != FTS_DP && !filterAllowsEntry(folderinfo->filter, currfile))
+		{
+			if (currfile->fts_info == FTS_D)
+				fts_set(currfolder, currfile, FTS_SKIP);
+		}
+		else if ((currfile->fts_statp->st_mode & S_IFDIR) == 0)
+		{
+			decompressFile(currfile->fts_path, currfile->fts_statp);
+			if (folderinfo->progress != NULL && currfile->fts_info == FTS_F)
+				progressAddFile(folderinfo->progress, currfile->fts_statp->st_size, 0);
+		}
+	}
+	fts_close(currfolder);
+}
+
+// Copies the extended attributes of srcpath to dstpath, except for the decmpfs and resource fork xattrs of
+// compressed files, which hold the file's data and are copied separately
+bool copyXattrs(const char *srcpath, const char *dstpath, bool compressed)
+{
+	char *xattrnames, *curr_attr;
+	ssize_t xattrnamesize, xattrsize, getxattrret, xattrPos;
+	void *attr_buf;
+	bool ok = TRUE;
+	
+	xattrnamesize = listxattr(srcpath, NULL, 0, XATTR_NOFOLLOW);
+	if (xattrnamesize <= 0)
+		return (xattrnamesize == 0);
+	xattrnames = (char *) malloc(xattrnamesize);
+	if (xattrnames == NULL)
+	{
+		fprintf(stderr, "%s: malloc error, unable to copy xattrs\n", srcpath);
+		return FALSE;
+	}
+	if ((xattrnamesize = listxattr(srcpath, xattrnames, xattrnamesize, XATTR_NOFOLLOW)) <= 0)
+	{
+		fprintf(stderr, "%s: listxattr: %s\n", srcpath, strerror(errno));
+		free(xattrnames);
+		return FALSE;
+	}
+	for (curr_attr = xattrnames; curr_attr < xattrnames + xattrnamesize; curr_attr += strlen(curr_attr) + 1)
+	{
+		if ((strcmp(curr_attr, "com.apple.decmpfs") == 0) || (compressed && strcmp(curr_attr, "com.apple.ResourceFork") == 0))
+			continue;
+		xattrsize = getxattr(srcpath, curr_attr, NULL, 0, 0, XATTR_NOFOLLOW);
+		attr_buf = (xattrsize >= 0) ? malloc(xattrsize + 1) : NULL;
+		if (attr_buf == NULL)
+		{
+			fprintf(stderr, "%s: unable to copy xattr %s\n", srcpath, curr_attr);
+			ok = FALSE;
+			continue;
+		}
+		// Only the resource fork can be larger than one read, so only it is read at increasing positions
+		xattrPos = 0;
+		do
+		{
+			getxattrret = getxattr(srcpath, curr_attr, attr_buf + xattrPos, xattrsize - xattrPos, xattrPos, XATTR_NOFOLLOW);
+			if (getxattrret > 0)
+				xattrPos += getxattrret;
+		} while (xattrPos < xattrsize && getxattrret > 0);
+		if (getxattrret < 0 || xattrPos < xattrsize)
+		{
+			fprintf(stderr, "%s: getxattr: %s\n", srcpath, strerror(errno));
+			ok = FALSE;
+		}
+		else if (setxattr(dstpath, curr_attr, attr_buf, xattrsize, 0, XATTR_NOFOLLOW) < 0)
+		{
+			fprintf(stderr, "%s: setxattr: %s\n", dstpath, strerror(errno));
+			ok = FALSE;
+		}
+		free(attr_buf);
+	}
+	free(xattrnames);
+	return ok;
+}
+
+// Copies the decmpfs xattr and resource fork of the compressed file srcpath verbatim to the empty file dstpath and
+// marks it compressed, so the data is neither decompressed nor compressed again; returns FALSE, with dstpath left
+// empty, if the destination can't hold them
+bool copyCompressedData(const char *srcpath, const char *dstpath)
+{
+	const char *names[2] = {"com.apple.ResourceFork", "com.apple.decmpfs"};
+	ssize_t xattrsize, getxattrret, xattrPos;
+	void *attr_buf;
+	bool ok = TRUE;
+	int i;
+	
+	attr_buf = malloc(0x100000);
+	if (attr_buf == NULL)
+	{
+		fprintf(stderr, "%s: malloc error, unable to allocate copy buffer\n", srcpath);
+		return FALSE;
+	}
+	// The resource fork goes first, so the file is never left with a decmpfs xattr pointing at missing data
+	for (i = 0; i < 2 && ok; i++)
+	{
+		xattrsize = getxattr(srcpath, names[i], NULL, 0, 0, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW);
+		if (xattrsize < 0 && i == 0 && errno == ENOATTR)
+			continue;
+		if (xattrsize < 0)
+		{
+			fprintf(stderr, "%s: getxattr: %s\n", srcpath, strerror(errno));
+			ok = FALSE;
+			break;
+		}
+		// Resource forks may be too large to hold at once, so they are moved a piece at a time
+		for (xattrPos = 0; xattrPos < xattrsize && ok; xattrPos += getxattrret)
+		{
+			getxattrret = getxattr(srcpath, names[i], attr_buf, ((xattrsize - xattrPos) > 0x100000) ? 0x100000 : xattrsize - xattrPos, xattrPos, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW);
+			if (getxattrret <= 0)
+			{
+				fprintf(stderr, "%s: getxattr: %s\n", srcpath, strerror(errno));
+				ok = FALSE;
+			}
+			else if (setxattr(dstpath, names[i], attr_buf, getxattrret, xattrPos, XATTR_NOFOLLOW | ((xattrPos == 0) ? XATTR_CREATE : 0)) < 0)
+			{
+				fprintf(stderr, "%s: setxattr: %s\n", dstpath, strerror(errno));
+				ok = FALSE;
+			}
+		}
+	}
+	free(attr_buf);
+	if (ok && chflags(dstpath, UF_COMPRESSED) < 0)
+	{
+		fprintf(stderr, "%s: chflags: %s\n", dstpath, strerror(errno));
+		ok = FALSE;
+	}
+	if (!ok)
+	{
+		removexattr(dstpath, "com.apple.decmpfs", XATTR_NOFOLLOW | XATTR_SHOWCOMPRESSION);
+		removexattr(dstpath, "com.apple.ResourceFork", XATTR_NOFOLLOW | XATTR_SHOWCOMPRESSION);
+	}
+	return ok;
+}
+
+// Writes size bytes to the empty file dstpath, taken from buf or, if buf is NULL, read from srcFd
+bool writeFileData(const char *dstpath, int srcFd, const void *buf, long long int size)
+{
+	long long int pos;
+	ssize_t ret = 0;
+	void *copyBuf = NULL;
+	int dstFd;
+	
+	dstFd = open(dstpath, O_WRONLY | O_TRUNC | O_NOFOLLOW);
+	if (dstFd < 0)
+	{
+		fprintf(stderr, "%s: %s\n", dstpath, strerror(errno));
+		return FALSE;
+	}
+	if (buf == NULL && (copyBuf = malloc(0x100000)) == NULL)
+	{
+		fprintf(stderr, "%s: malloc error, unable to allocate copy buffer\n", dstpath);
+		close(dstFd);
+		return FALSE;
+	}
+	for (pos = 0; pos < size; pos += ret)
+	{
+		if (buf != NULL)
+			ret = write(dstFd, buf + pos, size - pos);
+		else if ((ret = pread(srcFd, copyBuf, ((size - pos) > 0x100000) ? 0x100000 : size - pos, pos)) > 0)
+			ret = write(dstFd, copyBuf, ret);
+		if (ret <= 0)
+		{
+			fprintf(stderr, "%s: Error writing to file\n", dstpath);
+			free(copyBuf);
+			close(dstFd);
+			return FALSE;
+		}
+	}
+	free(copyBuf);
+	close(dstFd);
+	return TRUE;
+}
+
+// Copies the regular file srcpath to the new file dstpath, reading it once and, if compress is set, writing only the
+// compressed data; already compressed files are copied as they are stored if keepCompressed is set. Returns the
+// compression level used, 0 if no compression was done, or -1 if the copy failed
+// Flags such as UF_IMMUTABLE would stop the mode and times from being set, so they are copied last; only the flags an
+// owner may set are copied, and the copy keeps its own UF_COMPRESSED
+void copyUserFlags(const char *dstpath, const struct stat *srcinfo)
+{
+	struct stat dstinfo;
+	
+	if ((srcinfo->st_flags & UF_SETTABLE & ~UF_COMPRESSED) == 0 || lstat(dstpath, &dstinfo) < 0)
+		return;
+	if (chflags(dstpath, (dstinfo.st_flags & UF_COMPRESSED) | (srcinfo->st_flags & UF_SETTABLE & ~UF_COMPRESSED)) < 0)
+		fprintf(stderr, "%s: chflags: %s\n", dstpath, strerror(errno));
+}
+
+int copyFile(const char *srcpath, const struct stat *srcinfo, const char *dstpath, bool compress, bool keepCompressed, struct folder_info *folderinfo)
+{
+	struct compress_job job;
+	struct stat dstinfo;
+	long long int filesize = srcinfo->st_size, inBufPos;
+	ssize_t readret;
+	void *inBuf;
+	int srcFd, dstFd, level = 0;
+	bool copied = TRUE, encoded;
+	struct timeval start;
+	
+	if (folderinfo->throttle != NULL)
+	{
+		takeTokens(folderinfo->throttle, &folderinfo->throttle->files, 1);
+		takeTokens(folderinfo->throttle, &folderinfo->throttle->bytes, filesize);
+	}
+	srcFd = open(srcpath, O_RDONLY | O_NOFOLLOW);
+	if (srcFd < 0)
+	{
+		fprintf(stderr, "%s: %s\n", srcpath, strerror(errno));
+		return -1;
+	}
+	dstFd = open(dstpath, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, S_IRUSR | S_IWUSR);
+	if (dstFd < 0)
+	{
+		fprintf(stderr, "%s: %s\n", dstpath, strerror(errno));
+		close(srcFd);
+		return -1;
+	}
+	close(dstFd);
+	copyXattrs(srcpath, dstpath, (srcinfo->st_flags & UF_COMPRESSED) != 0);
+	
+	memset(&job, 0, sizeof(job));
+	job.filepath = (char *) dstpath;
+	job.fileinfo = *srcinfo;
+	// The copy starts out with no flags; the source's are applied once everything else is in place
+	job.fileinfo.st_flags = 0;
+	job.fd = -1;
+	job.keep_input = TRUE;
+	job.numBlocks = (filesize + 0xFFFF) / 0x10000;
+	job.times[0].tv_sec = srcinfo->st_atimespec.tv_sec;
+	job.times[0].tv_usec = srcinfo->st_atimespec.tv_nsec / 1000;
+	job.times[1].tv_sec = srcinfo->st_mtimespec.tv_sec;
+	job.times[1].tv_usec = srcinfo->st_mtimespec.tv_nsec / 1000;
+	
+	// The same files compressFileOpen passes over are copied as they are
+	if ((srcinfo->st_flags & UF_COMPRESSED) != 0 || filesize == 0 || (filesize > folderinfo->maxSize && folderinfo->maxSize != 0) ||
+		blockTableSize(filesize) + 50 > 2147483647 || getxattr(srcpath, "com.apple.ResourceFork", NULL, 0, 0, XATTR_NOFOLLOW) >= 0)
+		compress = FALSE;
+	if (compress && folderinfo->signatures != NULL && sniffFileSignature(folderinfo->signatures, srcFd, filesize) >= 0)
+	{
+		if (folderinfo->print_info > 1)
+			printf("%s: skipping, content is already compressed\n", srcpath);
+		compress = FALSE;
+	}
+	
+	if (keepCompressed && (srcinfo->st_flags & UF_COMPRESSED) != 0 && copyCompressedData(srcpath, dstpath))
+		copied = TRUE;
+	else if (!compress)
+		copied = writeFileData(dstpath, srcFd, NULL, filesize);
+	else if ((filesize + 0x13A + ((long long int) job.numBlocks * 9)) > 2147483647 ||
+			 (folderinfo->max_memory != 0 && compressFileMemory(filesize, job.numBlocks, FALSE) > folderinfo->max_memory))
+	{
+		// Too large to compress in memory, so the copy is compressed in place a block at a time
+		copied = writeFileData(dstpath, srcFd, NULL, filesize);
+		if (copied && lstat(dstpath, &dstinfo) >= 0)
+			level = compressFile(dstpath, &dstinfo, folderinfo);
+	}
+	else
+	{
+		inBuf = job.inBuf = malloc(filesize);
+		for (inBufPos = 0; inBuf != NULL && inBufPos < filesize; inBufPos += readret)
+		{
+			if ((readret = pread(srcFd, inBuf + inBufPos, filesize - inBufPos, inBufPos)) <= 0)
+				break;
+		}
+		if (inBuf == NULL || inBufPos < filesize)
+		{
+			fprintf(stderr, "%s: Error reading file\n", srcpath);
+			copied = FALSE;
+		}
+		else
+		{
+			gettimeofday(&start, NULL);
+			encoded = compressFileEncode(&job, folderinfo);
+			if (folderinfo->throttle != NULL)
+				pauseForCPUShare(folderinfo->throttle, &start);
+			if (encoded)
+			{
+				compressFileCommit(&job, folderinfo);
+				level = job.level;
+			}
+			freeCompressJobBuffers(&job);
+			// Whatever didn't end up compressed is written out as it was read
+			if (lstat(dstpath, &dstinfo) < 0 || ((dstinfo.st_flags & UF_COMPRESSED) == 0 && dstinfo.st_size != filesize))
+			{
+				removexattr(dstpath, "com.apple.ResourceFork", XATTR_NOFOLLOW | XATTR_SHOWCOMPRESSION);
+				copied = writeFileData(dstpath, -1, inBuf, filesize);
+			}
+		}
+		free(inBuf);
+	}
+	
+	if (chmod(dstpath, srcinfo->st_mode & 07777) < 0)
+		fprintf(stderr, "%s: chmod: %s\n", dstpath, strerror(errno));
+	utimes(dstpath, job.times);
+	copyUserFlags(dstpath, srcinfo);
+	close(srcFd);
+	return copied ? level : -1;
+}
+
+// Copies the file or folder srcpath to dstpath, which must not exist yet, compressing files on the way if
+// compression was asked for and keeping compressed files compressed; the copies are added to the totals
+void copy_folder(const char *srcpath, const char *dstpath, struct folder_info *folderinfo)
+{
+	FTS *currfolder;
+	FTSENT *currfile;
+	char *srcarray[2], *filepath, *parentpath, *slash, linkpath[PATH_MAX];
+	size_t srclen = strlen(srcpath);
+	struct stat dstinfo;
+	struct statfs fsInfo;
+	struct timeval times[2];
+	ssize_t linklen;
+	bool compress, compressedDst = FALSE;
+	int level;
+	
+	// Compressed data can only be written to HFS+ (or APFS) folders; elsewhere the files are copied decompressed
+	if ((parentpath = strdup(dstpath)) != NULL)
+	{
+		slash = strrchr(parentpath, '/');
+		if (slash != NULL)
+			slash[(slash == parentpath) ? 1 : 0] = '\0';
+		if (statfs(parentpath, &fsInfo) < 0)
+			fprintf(stderr, "%s: %s\n", parentpath, strerror(errno));
+		else if (fsInfo.f_type == 17 || fsInfo.f_type == 23 || fsInfo.f_type == 24)
+			compressedDst = TRUE;
+		else if (folderinfo->compress_files)
+			printf("Expecting f_type of 17, 23 or 24. f_type is %i.\n", fsInfo.f_type);
+		free(parentpath);
+	}
+	if (!compressedDst)
+		folderinfo->compress_files = FALSE;
+	
+	srcarray[0] = (char *) srcpath;
+	srcarray[1] = NULL;
+	if ((currfolder = fts_open(srcarray, FTS_PHYSICAL, NULL)) == NULL)
+	{
+		fprintf(stderr, "%s: %s\n", srcpath, strerror(errno));
+		return;
+	}
+	while ((currfile = fts_read(currfolder)) != NULL)
+	{
+		filepath = (char *) malloc(strlen(dstpath) + strlen(currfile->fts_path + srclen) + 1);
+		if (filepath == NULL)
+		{
+			fprintf(stderr, "Malloc error allocating copy path, exiting...\n");
+			exit(-1);
+		}
+		sprintf(filepath, "%s%s", dstpath, currfile->fts_path + srclen);
+		switch (currfile->fts_info)
+		{
+			case FTS_D:
+				if (mkdir(filepath, S_IRWXU) < 0)
+				{
+					fprintf(stderr, "%s: %s\n", filepath, strerror(errno));
+					// Skipped folders are still visited in post-order, where this marks them as not copied
+					currfile->fts_number = 1;
+					fts_set(currfolder, currfile, FTS_SKIP);
+				}
+				break;
+			case FTS_DP:
+				if (currfile->fts_number != 0)
+					break;
+				// Folders get their attributes once their contents are in place, so the times stay as they were
+				copyXattrs(currfile->fts_path, filepath, FALSE);
+				if (chmod(filepath, currfile->fts_statp->st_mode & 07777) < 0)
+					fprintf(stderr, "%s: chmod: %s\n", filepath, strerror(errno));
+				times[0].tv_sec = currfile->fts_statp->st_atimespec.tv_sec;
+				times[0].tv_usec = currfile->fts_statp->st_atimespec.tv_nsec / 1000;
+				times[1].tv_sec = currfile->fts_statp->st_mtimespec.tv_sec;
+				times[1].tv_usec = currfile->fts_statp->st_mtimespec.tv_nsec / 1000;
+				utimes(filepath, times);
+				copyUserFlags(filepath, currfile->fts_statp);
+				if (lstat(filepath, &dstinfo) >= 0)
+					process_directory(filepath, &dstinfo, folderinfo);
+				break;
+			case FTS_F:
+				compress = folderinfo->compress_files && !deadlinePassed(folderinfo) &&
+					(folderinfo->filter == NULL || filterAllowsEntry(folderinfo->filter, currfile));
+				level = copyFile(currfile->fts_path, currfile->fts_statp, filepath, compress, compressedDst, folderinfo);
+				if (level >= 0 && compress)
+					finishFolderFile(filepath, &dstinfo, level, folderinfo);
+				else if (level >= 0 && lstat(filepath, &dstinfo) >= 0)
+					process_file(filepath, &dstinfo, folderinfo);
+				break;
+			case FTS_SL:
+			case FTS_SLNONE:
+				linklen = readlink(currfile->fts_path, linkpath, sizeof(linkpath) - 1);
+				if (linklen >= 0)
+					linkpath[linklen] = '\0';
+				if (linklen < 0 || symlink(linkpath, filepath) < 0)
+					fprintf(stderr, "%s: %s\n", filepath, strerror(errno));
+				else if (lstat(filepath, &dstinfo) >= 0)
+					process_file(filepath, &dstinfo, folderinfo);
+				break;
+			case FTS_DNR:
+			case FTS_ERR:
+			case FTS_NS:
+				fprintf(stderr, "%s: %s\n", currfile->fts_path, strerror(currfile->fts_errno));
+				break;
+			default:
+				fprintf(stderr, "%s: Not copied; only files, folders and symbolic links are copied\n", currfile->fts_path);
+				break;
+		}
+		free(filepath);
+	}
+	fts_close(currfolder);
+}
+
+// Reads the next path from a list separated by delim, skipping empty entries; returns NULL at the end of the list
+char *readListPath(FILE *list, int delim, char **filepath, size_t *filepathSize)
+{
+	ssize_t len;
+	
+	while ((len = getdelim(filepath, filepathSize, delim, list)) > 0)
+	{
+		if ((*filepath)[len-1] == delim)
+			(*filepath)[--len] = '\0';
+		if (len > 0)
+			return *filepath;
+	}
+	return NULL;
+}
+
+// Processes every path in a list as if it were an item in one folder; folders in the list are counted but not
+// descended into, since their contents are expected to be listed as well (as find does)
+void process_file_list(FILE *list, int delim, struct folder_info *folderinfo)
+{
+	char *filepath = NULL;
+	const char *name;
+	size_t filepathSize = 0;
+	struct stat fileinfo;
+	struct compress_pipeline *pipeline = NULL;
+	struct file_schedule schedule;
+	
+	if (folderinfo->compress_files && folderinfo->compress_threads > 0)
+		pipeline = startCompressPipeline(folderinfo);
+	memset(&schedule, 0, sizeof(schedule));
+	
+	while (readListPath(list, delim, &filepath, &filepathSize) != NULL)
+	{
+		if (lstat(filepath, &fileinfo) < 0)
+		{
+			fprintf(stderr, "%s: %s\n", filepath, strerror(errno));
+			continue;
+		}
+		name = strrchr(filepath, '/');
+		name = (name != NULL && name[1] != '\0') ? name + 1 : filepath;
+		if (folderinfo->filter != NULL && !filterAllowsFile(folderinfo->filter, filepath, name, filepath, &fileinfo, FALSE))
+			continue;
+		if (S_ISDIR(fileinfo.st_mode))
+			process_directory(filepath, &fileinfo, folderinfo);
+		else if (S_ISREG(fileinfo.st_mode) || S_ISLNK(fileinfo.st_mode))
+			process_folder_file(pipeline, &schedule, filepath, &fileinfo, folderinfo);
+	}
+	if (ferror(list))
+		fprintf(stderr, "Error reading list of files: %s\n", strerror(errno));
+	free(filepath);
+	runFileSchedule(pipeline, &schedule);
+	if (pipeline != NULL)
+		finishCompressPipeline(pipeline);
+	if (folderinfo->hard_links != NULL)
+		clearHardLinkTable(folderinfo->hard_links);
+}
+
+// The dedup and signature counts cover the whole run, so they are left out of the summaries of single roots
+void printFolderInfo(struct folder_info *folderinfo, bool printRunTotals)
+{
+	long long int foldersize, foldersize_rounded;
+	char sizeStr[90];
+	int i;
+	
+	if (folderinfo->num_compressed == 0 && !folderinfo->compress_files)
+		printf("Folder contains no compressed files\n");
+	else if (folderinfo->num_compressed == 0 && folderinfo->compress_files)
+		printf("No compressable files in folder\n");
+	else
+		printf("Number of HFS+ compressed files: %lld\n", folderinfo->num_compressed);
+	if (folderinfo->print_info > 0)
+	{
+		printf("Total number of files: %lld\n", folderinfo->num_files);
+		if (folderinfo->check_hard_links)
+			printf("Total number of file hard links: %lld\n", folderinfo->num_hard_link_files);
+		printf("Total number of folders: %lld\n", folderinfo->num_folders);
+		if (folderinfo->check_hard_links)
+			printf("Total number of folder hard links: %lld\n", folderinfo->num_hard_link_folders);
+		printf("Total number of items (number of files + number of folders): %lld\n", folderinfo->num_files + folderinfo->num_folders);
+		if (folderinfo->dedup != NULL && printRunTotals)
+			printf("Number of files matching a file compressed earlier: %lld\n", folderinfo->dedup->num_deduplicated);
+		if (folderinfo->target_mbps > 0)
+		{
+			printf("Compression levels chosen:");
+			for (i = 1; i <= 9; i++)
+			{
+				if (folderinfo->level_counts[i] > 0)
+					printf(" %d (%lld files)", i, folderinfo->level_counts[i]);
+			}
+			printf("\n");
+		}
+		if (folderinfo->signatures != NULL && printRunTotals)
+		{
+			printf("Number of files skipped as already compressed: %lld\n", folderinfo->signatures->num_skipped);
+			for (i = 0; i < folderinfo->signatures->numSignatures; i++)
+			{
+				if (folderinfo->signatures->hits[i] > 0)
+					printf("  %s: %lld\n", folderinfo->signatures->signatures[i].name, folderinfo->signatures->hits[i]);
+			}
+		}
+		foldersize = folderinfo->uncompressed_size;
+		foldersize_rounded = folderinfo->uncompressed_size_rounded;
+		if ((folderinfo->num_hard_link_files == 0 && folderinfo->num_hard_link_folders == 0) || !folderinfo->check_hard_links)
+			printf("Folder size (uncompressed; reported size by Mac OS 10.6+ Finder): %s\n", getSizeStr(foldersize, foldersize_rounded, sizeStr));
+		else
+			printf("Folder size (uncompressed): %s\n", getSizeStr(foldersize, foldersize_rounded, sizeStr));
+		foldersize = folderinfo->compressed_size;
+		foldersize_rounded = folderinfo->compressed_size_rounded;
+		if ((folderinfo->num_hard_link_files == 0 && folderinfo->num_hard_link_folders == 0) || !folderinfo->check_hard_links)
+			printf("Folder size (compressed - decmpfs xattr; reported size by Mac OS 10.0-10.5 Finder): %s\n", getSizeStr(foldersize, foldersize_rounded, sizeStr));
+		else
+			printf("Folder size (compressed - decmpfs xattr): %s\n", getSizeStr(foldersize, foldersize_rounded, sizeStr));
+		foldersize = folderinfo->compressed_size + folderinfo->compattr_size;
+		foldersize_rounded = folderinfo->compressed_size_rounded + folderinfo->compattr_size;
+		printf("Folder size (compressed): %s\n", getSizeStr(foldersize, foldersize_rounded, sizeStr));
+		printf("Compression savings: %0.1f%%\n", (1.0 - ((float) (folderinfo->compressed_size + folderinfo->compattr_size) / folderinfo->uncompressed_size)) * 100.0);
+		foldersize = folderinfo->total_size;
+		printf("Appoximate total folder size (files + file overhead + folder overhead): %s\n", getSizeStr(foldersize, foldersize, sizeStr));
+	}
+}
+
+void addFolderInfo(struct folder_info *total, const struct folder_info *folderinfo)
+{
+	int i;
+	
+	total->uncompressed_size += folderinfo->uncompressed_size;
+	total->uncompressed_size_rounded += folderinfo->uncompressed_size_rounded;
+	total->compressed_size += folderinfo->compressed_size;
+	total->compressed_size_rounded += folderinfo->compressed_size_rounded;
+	total->compattr_size += folderinfo->compattr_size;
+	total->total_size += folderinfo->total_size;
+	total->num_compressed += folderinfo->num_compressed;
+	total->num_files += folderinfo->num_files;
+	total->num_hard_link_files += folderinfo->num_hard_link_files;
+	total->num_folders += folderinfo->num_folders;
+	total->num_hard_link_folders += folderinfo->num_hard_link_folders;
+	for (i = 0; i < 10; i++)
+		total->level_counts[i] += folderinfo->level_counts[i];
+}
+
+void resetFolderInfo(struct folder_info *folderinfo)
+{
+	folderinfo->uncompressed_size = 0;
+	folderinfo->uncompressed_size_rounded = 0;
+	folderinfo->compressed_size = 0;
+	folderinfo->compressed_size_rounded = 0;
+	folderinfo->compattr_size = 0;
+	folderinfo->total_size = 0;
+	folderinfo->num_compressed = 0;
+	folderinfo->num_files = 0;
+	folderinfo->num_hard_link_files = 0;
+	folderinfo->num_folders = 0;
+	folderinfo->num_hard_link_folders = 0;
+	memset(folderinfo->level_counts, 0, sizeof(folderinfo->level_counts));
+}
+
+// Called once the work is done, so the last progress line comes before the summaries
+void finishProgress(struct folder_info *folderinfo)
+{
+	if (folderinfo->progress != NULL)
+		stopProgress(folderinfo->progress);
+	folderinfo->progress = NULL;
+}
+
+void finishFolderInfo(struct folder_info *folderinfo, const char *ratioCachePath)
+{
+	finishProgress(folderinfo);
+	if (folderinfo->ratios != NULL)
+		saveRatioCache(folderinfo->ratios, ratioCachePath);
+	if (folderinfo->dedup != NULL)
+		freeDedupIndex(folderinfo->dedup);
+	if (folderinfo->hard_links != NULL)
+	{
+		clearHardLinkTable(folderinfo->hard_links);
+		free(folderinfo->hard_links);
+	}
+	if (folderinfo->report != NULL)
+		freeDirReport(folderinfo->report);
+	if (folderinfo->histograms != NULL)
+	{
+		if (folderinfo->histograms->print_table && folderinfo->histograms->by_ext.numEntries > 0)
+			printHistograms(folderinfo->histograms);
+		if (folderinfo->histograms->json_path != NULL)
+			writeHistogramsJSON(folderinfo->histograms, folderinfo->histograms->json_path);
+		freeHistograms(folderinfo->histograms);
+	}
+}
+
+struct watched_file
+{
+	char *filepath;
+	time_t changed;
+};
+
+// Files that changed since they were last looked at, sorted by path so repeated events for a file only move its time
+struct watch_queue
+{
+	struct watched_file *files;
+	long int numFiles;
+	long int currSize;
+	bool rescan;
+};
+
+
+void queueWatchedFile(struct watch_queue *queue, const char *filepath, time_t changed)
+{
+	long int left = 0, right = queue->numFiles, mid;
+	int cmp;
+	
+	while (left < right)
+	{
+		mid = (left + right) / 2;
+		cmp = strcmp(queue->files[mid].filepath, filepath);
+		if (cmp == 0)
+		{
+			queue->files[mid].changed = changed;
+			return;
+		}
+		if (cmp < 0)
+			left = mid + 1;
+		else
+			right = mid;
+	}
+	if (queue->currSize < queue->numFiles + 1)
+	{
+		queue->currSize = (queue->currSize > 0) ? queue->currSize * 2 : 256;
+		queue->files = (struct watched_file *) realloc(queue->files, queue->currSize * sizeof(struct watched_file));
+		if (queue->files == NULL)
+		{
+			fprintf(stderr, "Malloc error allocating list of changed files, exiting...\n");
+			exit(-1);
+		}
+	}
+	memmove(&queue->files[left+1], &queue->files[left], (queue->numFiles - left) * sizeof(struct watched_file));
+	queue->files[left].filepath = strdup(filepath);
+	if (queue->files[left].filepath == NULL)
+	{
+		fprintf(stderr, "Malloc error allocating list of changed files, exiting...\n");
+		exit(-1);
+	}
+	queue->files[left].changed = changed;
+	queue->numFiles++;
+}
+
+void watchCallback(ConstFSEventStreamRef stream, void *info, size_t numEvents, void *eventPaths, const FSEventStreamEventFlags eventFlags[], const FSEventStreamEventId eventIds[])
+{
+	struct watch_queue *queue = info;
+	char **paths = eventPaths;
+	size_t i;
+	
+	for (i = 0; i < numEvents; i++)
+	{
+		// Events were lost or coalesced, so only a scan of the whole folder can tell what changed
+		if (eventFlags[i] & (kFSEventStreamEventFlagMustScanSubDirs | kFSEventStreamEventFlagUserDropped | kFSEventStreamEventFlagKernelDropped))
+			queue->rescan = TRUE;
+		// Changes to xattrs alone are left out, since compressing a file makes them as well
+		else if ((eventFlags[i] & kFSEventStreamEventFlagItemIsFile) &&
+				 (eventFlags[i] & (kFSEventStreamEventFlagItemCreated | kFSEventStreamEventFlagItemModified | kFSEventStreamEventFlagItemRenamed)))
+			queueWatchedFile(queue, paths[i], time(NULL));
+	}
+}
+
+// Compresses the files that have been left alone for at least quietTime seconds, as many as tokens allows
+// (or all of them if tokens is NULL); the others stay queued
+void compressQuietFiles(struct watch_queue *queue, const char *folderpath, time_t quietTime, double *tokens, struct folder_info *folderinfo)
+{
+	struct stat fileinfo;
+	size_t folderlen = strlen(folderpath);
+	long int i, numKept = 0;
+	int level;
+	
+	for (i = 0; i < queue->numFiles; i++)
+	{
+		if (time(NULL) - queue->files[i].changed < quietTime || (tokens != NULL && *tokens < 1.0))
+		{
+			queue->files[numKept++] = queue->files[i];
+			continue;
+		}
+		// Files that were removed, renamed away or already compressed since the event are passed over
+		if (lstat(queue->files[i].filepath, &fileinfo) == 0 && S_ISREG(fileinfo.st_mode) && (fileinfo.st_flags & UF_COMPRESSED) == 0 &&
+			strncmp(queue->files[i].filepath, folderpath, folderlen) == 0 && queue->files[i].filepath[folderlen] == '/' &&
+			(folderinfo->filter == NULL || filterAllowsRelativePath(folderinfo->filter, queue->files[i].filepath, queue->files[i].filepath + folderlen + 1, &fileinfo)))
+		{
+			if (tokens != NULL)
+				*tokens -= 1.0;
+			level = compressFile(queue->files[i].filepath, &fileinfo, folderinfo);
+			finishFolderFile(queue->files[i].filepath, &fileinfo, level, folderinfo);
+			if (folderinfo->print_info > 1)
+				printf("%s: %s\n", queue->files[i].filepath, ((fileinfo.st_flags & UF_COMPRESSED) != 0) ? "compressed" : "left uncompressed");
+		}
+		free(queue->files[i].filepath);
+	}
+	queue->numFiles = numKept;
+}
+
+// Compresses everything in the folder that isn't yet, as a normal -c run would, to catch files whose events were missed
+void reconcileWatchedFolder(const char *folderpath, struct folder_info *folderinfo)
+{
+	struct folder_info scaninfo = *folderinfo;
+	char *folderarray[2];
+	FTS *currfolder;
+	
+	// Only the files compressed as they change go into the report and histograms, not everything each scan sees
+	resetFolderInfo(&scaninfo);
+	scaninfo.report = NULL;
+	scaninfo.histograms = NULL;
+	folderarray[0] = (char *) folderpath;
+	folderarray[1] = NULL;
+	if ((currfolder = fts_open(folderarray, FTS_PHYSICAL, NULL)) == NULL)
+	{
+		fprintf(stderr, "%s: %s\n", folderpath, strerror(errno));
+		return;
+	}
+	process_folder(currfolder, &scaninfo, 1);
+	scaninfo.num_folders--;
+	if (folderinfo->print_info > 0)
+	{
+		printf("Scan of %s:\n", folderpath);
+		printFolderInfo(&scaninfo, FALSE);
+		fflush(stdout);
+	}
+}
+
+// Watches the folder until interrupted, compressing files once they have not changed for quietTime seconds, at most
+// filesPerMinute of them a minute (if not 0), and scanning the whole folder every reconcileInterval seconds (if not 0)
+void watch_folder(const char *folderpath, time_t quietTime, double filesPerMinute, time_t reconcileInterval, struct folder_info *folderinfo)
+{
+	struct watch_queue queue;
+	FSEventStreamContext context;
+	FSEventStreamRef stream;
+	CFStringRef folderRef;
+	CFArrayRef paths;
+	char watchpath[PATH_MAX];
+	time_t lastTick, nextReconcile, now;
+	double tokens = 1.0;
+	
+	// FSEvents reports paths with symbolic links resolved
+	if (realpath(folderpath, watchpath) == NULL)
+	{
+		fprintf(stderr, "%s: %s\n", folderpath, strerror(errno));
+		return;
+	}
+	memset(&queue, 0, sizeof(queue));
+	memset(&context, 0, sizeof(context));
+	context.info = &queue;
+	folderRef = CFStringCreateWithCString(NULL, watchpath, kCFStringEncodingUTF8);
+	paths = CFArrayCreate(NULL, (const void **) &folderRef, 1, &kCFTypeArrayCallBacks);
+	stream = FSEventStreamCreate(NULL, watchCallback, &context, paths, kFSEventStreamEventIdSinceNow, 1.0,
+								 kFSEventStreamCreateFlagFileEvents | kFSEventStreamCreateFlagNoDefer);
+	if (stream == NULL)
+	{
+		fprintf(stderr, "%s: Unable to watch folder\n", watchpath);
+		CFRelease(paths);
+		CFRelease(folderRef);
+		return;
+	}
+	FSEventStreamScheduleWithRunLoop(stream, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+	FSEventStreamStart(stream);
+	signal(SIGINT, stopWatching);
+	signal(SIGTERM, stopWatching);
+	
+	lastTick = nextReconcile = time(NULL);
+	while (!watchStopped)
+	{
+		// Age limits are measured from the start of each pass, not from when the watch began
+		if (folderinfo->filter != NULL)
+			folderinfo->filter->now = time(NULL);
+		if ((reconcileInterval > 0 || queue.rescan) && time(NULL) >= nextReconcile)
+		{
+			queue.rescan = FALSE;
+			reconcileWatchedFolder(watchpath, folderinfo);
+			nextReconcile = time(NULL) + ((reconcileInterval > 0) ? reconcileInterval : 0);
+		}
+		CFRunLoopRunInMode(kCFRunLoopDefaultMode, 1.0, FALSE);
+		// The rate limit is a token bucket that fills at filesPerMinute and holds at most a second's worth (or one file)
+		now = time(NULL);
+		if (filesPerMinute > 0)
+		{
+			tokens += (now - lastTick) * filesPerMinute / 60.0;
+			if (tokens > ((filesPerMinute / 60.0 > 1.0) ? filesPerMinute / 60.0 : 1.0))
+				tokens = (filesPerMinute / 60.0 > 1.0) ? filesPerMinute / 60.0 : 1.0;
+		}
+		lastTick = now;
+		compressQuietFiles(&queue, watchpath, quietTime, (filesPerMinute > 0) ? &tokens : NULL, folderinfo);
+		fflush(stdout);
+	}
+	
+	FSEventStreamStop(stream);
+	FSEventStreamInvalidate(stream);
+	FSEventStreamRelease(stream);
+	CFRelease(paths);
+	CFRelease(folderRef);
+	while (queue.numFiles > 0)
+		free(queue.files[--queue.numFiles].filepath);
+	free(queue.files);
+}
+
+#define SCRUB_QUEUE_SIZE 256
+
+struct scrub_item
+{
+	char *filepath;
+	long long int seq;
+};
+
+struct scrub_result
+{
+	char *filepath;
+	long long int seq;
+	enum afsc_result result;
+	long int bad_block;
+};
+
+struct scrub_pool
+{
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	struct scrub_item items[SCRUB_QUEUE_SIZE];
+	int head;
+	int count;
+	bool closed;
+	struct scrub_result *damaged;
+	long int numDamaged;
+	long int damagedSize;
+	long long int num_files;
+	long long int num_checked;
+	long long int num_unreadable;
+	long long int uncompressed_size;
+	long long int compressed_size;
+	struct folder_info *folderinfo;
+};
+
+void printScrubResult(const struct scrub_result *damaged)
+{
+	if (damaged->bad_block >= 0)
+		printf("%s: damaged at block %ld; %s\n", damaged->filepath, damaged->bad_block, afsc_strerror(damaged->result));
+	else
+		printf("%s: damaged; %s\n", damaged->filepath, afsc_strerror(damaged->result));
+}
+
+int compareScrubResults(const void *a, const void *b)
+{
+	const struct scrub_result *resultA = a, *resultB = b;
+	
+	return (resultA->seq > resultB->seq) - (resultA->seq < resultB->seq);
+}
+
+void *scrubThread(void *arg)
+{
+	struct scrub_pool *pool = arg;
+	struct folder_info *folderinfo = pool->folderinfo;
+	struct scrub_item item;
+	struct scrub_result *damaged;
+	struct afsc_file_info info;
+	enum afsc_result result;
+	struct afsc_block_buffers buffers;
+	int savedErrno;
+	
+	if (afsc_alloc_block_buffers(&buffers) != AFSC_OK)
+	{
+		fprintf(stderr, "Malloc error allocating scrub buffer, exiting...\n");
+		exit(-1);
+	}
+	for (;;)
+	{
+		pthread_mutex_lock(&pool->lock);
+		while (pool->count == 0 && !pool->closed)
+			pthread_cond_wait(&pool->changed, &pool->lock);
+		if (pool->count == 0)
+		{
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		item = pool->items[pool->head];
+		pool->head = (pool->head + 1) % SCRUB_QUEUE_SIZE;
+		pool->count--;
+		pthread_cond_broadcast(&pool->changed);
+		pthread_mutex_unlock(&pool->lock);
+		
+		if (folderinfo->throttle != NULL)
+			takeTokens(folderinfo->throttle, &folderinfo->throttle->files, 1);
+		result = afsc_scrub_file(item.filepath, &buffers, &info);
+		savedErrno = errno;
+		if (folderinfo->throttle != NULL)
+			takeTokens(folderinfo->throttle, &folderinfo->throttle->bytes, info.decmpfs_size + info.resource_fork_size);
+		if (folderinfo->progress != NULL)
+			progressAddFile(folderinfo->progress, info.size, 0);
+		
+		pthread_mutex_lock(&pool->lock);
+		if (result == AFSC_ERR_IO || result == AFSC_ERR_NOMEM)
+		{
+			// The file couldn't be looked at, which says nothing about its data
+			fprintf(stderr, "%s: %s\n", item.filepath, (result == AFSC_ERR_IO) ? strerror(savedErrno) : afsc_strerror(result));
+			pool->num_unreadable++;
+		}
+		else if (result != AFSC_NOT_COMPRESSED && result != AFSC_SKIPPED_NOT_REGULAR)
+		{
+			pool->num_checked++;
+			pool->uncompressed_size += info.size;
+			pool->compressed_size += info.decmpfs_size + info.resource_fork_size;
+		}
+		if (result != AFSC_OK && result != AFSC_NOT_COMPRESSED && result != AFSC_SKIPPED_NOT_REGULAR &&
+			result != AFSC_ERR_IO && result != AFSC_ERR_NOMEM)
+		{
+			if (pool->numDamaged >= pool->damagedSize)
+			{
+				pool->damagedSize = (pool->damagedSize > 0) ? pool->damagedSize * 2 : 16;
+				pool->damaged = (struct scrub_result *) realloc(pool->damaged, pool->damagedSize * sizeof(struct scrub_result));
+				if (pool->damaged == NULL)
+				{
+					fprintf(stderr, "Malloc error allocating list of damaged files, exiting...\n");
+					exit(-1);
+				}
+			}
+			damaged = &pool->damaged[pool->numDamaged++];
+			damaged->filepath = item.filepath;
+			damaged->seq = item.seq;
+			damaged->result = result;
+			damaged->bad_block = info.bad_block;
+			// Without --unordered, damaged files are listed in the order they were found once the walk is done
+			if (!folderinfo->ordered_output)
+				printScrubResult(damaged);
+			item.filepath = NULL;
+		}
+		pthread_mutex_unlock(&pool->lock);
+		free(item.filepath);
+	}
+	afsc_free_block_buffers(&buffers);
+	return NULL;
+}
+
+// Checks that every compressed file under the paths still decodes, reading the xattrs on numThreads threads and never
+// writing anything; returns the number of damaged files found
+long int scrub_folder(char * const *paths, int numThreads, struct folder_info *folderinfo)
+{
+	struct scrub_pool pool;
+	pthread_t *threads;
+	FTS *currfolder;
+	FTSENT *currfile;
+	struct timeval start, end;
+	char sizeStr[90];
+	double seconds;
+	long long int seq = 0;
+	long int i;
+	int numStarted;
+	
+	// The threads open the paths while the walk goes on, so it must not change the working folder under them
+	if ((currfolder = fts_open(paths, FTS_PHYSICAL | FTS_NOCHDIR, NULL)) == NULL)
+	{
+		fprintf(stderr, "%s: %s\n", paths[0], strerror(errno));
+		exit(EACCES);
+	}
+	memset(&pool, 0, sizeof(pool));
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.changed, NULL);
+	pool.folderinfo = folderinfo;
+	threads = (pthread_t *) malloc(numThreads * sizeof(pthread_t));
+	if (threads == NULL)
+	{
+		fprintf(stderr, "Malloc error allocating scrub threads, exiting...\n");
+		exit(-1);
+	}
+	for (numStarted = 0; numStarted < numThreads; numStarted++)
+	{
+		if (pthread_create(&threads[numStarted], NULL, scrubThread, &pool) != 0)
+		{
+			fprintf(stderr, "Unable to create scrub threads, exiting...\n");
+			exit(-1);
+		}
+	}
+	
+	gettimeofday(&start, NULL);
+	while ((currfile = fts_read(currfolder)) != NULL)
+	{
+		if (folderinfo->filter != NULL && currfile->fts_info != FTS_DP && !filterAllowsEntry(folderinfo->filter, currfile))
+		{
+			if (currfile->fts_info == FTS_D)
+				fts_set(currfolder, currfile, FTS_SKIP);
+			continue;
+		}
+		if (currfile->fts_info != FTS_F)
+			continue;
+		pool.num_files++;
+		// Only compressed files are handed to the threads; the rest are done with here
+		if ((currfile->fts_statp->st_flags & UF_COMPRESSED) == 0)
+		{
+			if (folderinfo->progress != NULL)
+				progressAddFile(folderinfo->progress, currfile->fts_statp->st_size, 0);
+			continue;
+		}
+		pthread_mutex_lock(&pool.lock);
+		while (pool.count == SCRUB_QUEUE_SIZE)
+			pthread_cond_wait(&pool.changed, &pool.lock);
+		pool.items[(pool.head + pool.count) % SCRUB_QUEUE_SIZE].filepath = strdup(currfile->fts_path);
+		pool.items[(pool.head + pool.count) % SCRUB_QUEUE_SIZE].seq = seq++;
+		if (pool.items[(pool.head + pool.count) % SCRUB_QUEUE_SIZE].filepath == NULL)
+		{
+			fprintf(stderr, "Malloc error allocating scrub path, exiting...\n");
+			exit(-1);
+		}
+		pool.count++;
+		pthread_cond_broadcast(&pool.changed);
+		pthread_mutex_unlock(&pool.lock);
+	}
+	fts_close(currfolder);
+	
+	pthread_mutex_lock(&pool.lock);
+	pool.closed = TRUE;
+	pthread_cond_broadcast(&pool.changed);
+	pthread_mutex_unlock(&pool.lock);
+	for (i = 0; i < numStarted; i++)
+		pthread_join(threads[i], NULL);
+	gettimeofday(&end, NULL);
+	free(threads);
+	pthread_cond_destroy(&pool.changed);
+	pthread_mutex_destroy(&pool.lock);
+	finishProgress(folderinfo);
+	
+	if (folderinfo->ordered_output && pool.numDamaged > 0)
+	{
+		qsort(pool.damaged, pool.numDamaged, sizeof(struct scrub_result), compareScrubResults);
+		for (i = 0; i < pool.numDamaged; i++)
+			printScrubResult(&pool.damaged[i]);
+	}
+	for (i = 0; i < pool.numDamaged; i++)
+		free(pool.damaged[i].filepath);
+	free(pool.damaged);
+	
+	if (folderinfo->print_info > 0 || !folderinfo->print_files)
+	{
+		if (pool.numDamaged > 0) printf("\n");
+		printf("Number of HFS+ compressed files checked: %lld\n", pool.num_checked);
+		if (folderinfo->print_info > 0)
+		{
+			printf("Total number of files: %lld\n", pool.num_files);
+			printf("Uncompressed size of the files checked: %s\n", getSizeStr(pool.uncompressed_size, pool.uncompressed_size, sizeStr));
+			printf("Compressed size of the files checked: %s\n", getSizeStr(pool.compressed_size, pool.compressed_size, sizeStr));
+			seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+			if (seconds > 0)
+				printf("Checked at %0.1f MB/s of uncompressed data with %d thread%s\n", pool.uncompressed_size / seconds / 1000000.0, numThreads, (numThreads == 1) ? "" : "s");
+		}
+		if (pool.num_unreadable > 0)
+			printf("Number of files that could not be read: %lld\n", pool.num_unreadable);
+		printf("Number of damaged files: %ld\n", pool.numDamaged);
+	}
+	return pool.numDamaged;
+}
+
+void printUsage()
+{
+	printf("afsctool 1.2.3 (build 23)\n"
+		   "Report if file is HFS+ compressed:                        afsctool [-v] file\n"
+		   "Report if folder contains HFS+ compressed files:          afsctool [-fvv] folder\n"
+		   "List HFS+ compressed files in folder:                     afsctool -l[fvv] folder\n"
+		   "Decompress HFS+ compressed file or folder:                afsctool -d file/folder\n"
+		   "Create archive file with compressed data in data fork:    afsctool -a[d] src dst\n"
+		   "Extract HFS+ compression archive to file:                 afsctool -x[d] src dst\n"
+		   "Apply HFS+ compression to file or folder:                 afsctool -c[klfvv] [compressionlevel [maxFileSize [minPercentSavings]]] file/folder\n"
+		   "Process a list of files instead of a file or folder:      afsctool [-c|-d|-l] [options] --stdin0|--stdin|--files-from list\n"
+		   "Copy file or folder, keeping or applying compression:     afsctool [-c[klvv]] --copy [compressionlevel ...] src dst\n"
+		   "Keep compressing files in a folder as they change:        afsctool -c[lvv] --watch [options] [compressionlevel ...] folder\n"
+		   "Check that compressed files still decompress:             afsctool [-lv] --scrub [options] file/folder ...\n"
+		   "Process several files and folders at once:                afsctool [-c|-d|-l] [options] file/folder file/folder ...\n"
+		   "                                                          (reports each one, then all of them together)\n\n"
+		   "Options:\n"
+		   "-v Increase verbosity level\n"
+		   "-f Skip files if a hard link to them has already been processeed\n"
+		   "-l List files that are HFS+ compressed (or if the -c option is given, files which fail to compress)\n"
+		   "-k Verify file after compression, and revert file changes if file verification fails\n"
+		   "--stdin0              Read the files to process from standard input, separated by NUL characters (as find -print0 writes them)\n"
+		   "--stdin               Read the files to process from standard input, one per line\n"
+		   "--files-from list     Read the files to process from the file list, one per line\n"
+		   "                      Folders in the list are counted but not descended into; totals cover the whole list\n\n"
+		   "Folder compression options (given before the file/folder, enable pipelined compression):\n"
+		   "--read-threads n      Number of threads reading files (default 1)\n"
+		   "--compress-threads n  Number of threads compressing file data (default: number of CPUs)\n"
+		   "--commit-threads n    Number of threads writing the compressed data to the files (default 1)\n"
+		   "--read-batch n        Number of small files each reader opens and reads ahead at once (default 64, 1 reads files one at a time)\n"
+		   "--unordered           List files as they finish instead of in the order they were found\n"
+		   "--max-memory size     Limit on the memory held by files being compressed, e.g. 512M or 2G; files that need a large\n"
+		   "                      share of it are compressed a block at a time instead (default: no limit)\n"
+		   "--copy                Copy src to dst (which must not exist yet), keeping modes, times and xattrs; compressed files\n"
+		   "                      are copied as they are stored, without decompressing them; with -c the other files are\n"
+		   "                      compressed as they are copied, and files filtered out are copied uncompressed\n"
+		   "--dedup               Reuse the compressed data of identical files found earlier in the same run\n"
+		   "--savings-first       Look through the whole folder first, then compress the files expected to save the most first\n"
+		   "--ratio-cache file    File of compression ratios by extension, used to predict savings and updated after the run\n"
+		   "--deadline time       Stop compressing once time has passed, e.g. 30m or 2h (default unit days)\n"
+		   "--target-mbps n       Pick the level for each file of 256 KiB or more from trial runs on samples of it: the strongest\n"
+		   "                      level that compresses at least n MB/s per thread (overrides compressionlevel for those files)\n"
+		   "--top-dirs n          After the summary, list the n subfolders with the largest compressed size, the largest\n"
+		   "                      savings and the most files, counting everything below each of them\n"
+		   "--watch               Keep running (until interrupted) and compress files in the folder once they stop changing\n"
+		   "--quiet-time n        With --watch, seconds a file must go unchanged before it is compressed (default 30)\n"
+		   "--watch-rate n        With --watch, compress at most n files a minute\n"
+		   "--reconcile time      With --watch, also compress anything missed by scanning the whole folder at the start\n"
+		   "                      and then every time, e.g. 6h (default unit days)\n"
+		   "--scrub               Read every compressed file a run of blocks at a time and decompress each block, listing the\n"
+		   "                      files that are damaged and the first bad block; nothing is written (--compress-threads sets\n"
+		   "                      the threads, each of which holds about 1 MiB plus the block table of its current file)\n"
+		   "--max-read-rate size  Read at most size bytes a second from the files being compressed, e.g. 20M\n"
+		   "--max-file-rate n     Open at most n files a second for compression\n"
+		   "--cpu-share percent   Have each compressor thread rest so it compresses at most this share of the time\n"
+		   "--throttle-file file  Read max-read-rate, max-file-rate and cpu-share settings (one \"name value\" a line, 0 for\n"
+		   "                      no limit) from file at the start, and again whenever afsctool is sent SIGHUP\n"
+		   "--nice n              Lower the priority of afsctool by n, as nice(1) does\n"
+		   "--io-policy policy    Disk I/O policy: important, standard, utility, throttle or passive (see setiopolicy_np(3))\n"
+		   "--progress            Show files and bytes done, bytes saved and the current rate on stderr, updated every second\n"
+		   "--prescan             Count the files to process first, so --progress can show how far along the run is and an ETA\n"
+		   "--metrics-file file   Also write the progress counters to file every second, in the Prometheus text format\n"
+		   "--histogram           At the end, list the files counted by extension and by size (in powers of two), with\n"
+		   "                      their sizes before and after compression\n"
+		   "--histogram-json file Write the same counts to file as JSON (- for standard output)\n"
+		   "--sniff               Skip files whose first bytes show an already compressed format (gzip, xz, zstd, zip, PNG, JPEG, MP4, ...)\n"
+		   "--sniff-signature name:offset:hexbytes\n"
+		   "                      Add a format to skip, e.g. myformat:0:4d5a; a negative offset counts back from the end of the file\n\n"
+		   "Folder filters (given before the folder; files and folders left out are neither processed nor counted):\n"
+		   "--include glob        Only process files whose name matches; globs with a / in them match the path inside the folder\n"
+		   "                      (or the full path, if they start with /); may be repeated\n"
+		   "--exclude glob        Skip files and folders whose name (or path) matches; may be repeated\n"
+		   "--include-ext list    Only process files with one of these comma separated extensions, e.g. txt,log\n"
+		   "--exclude-ext list    Skip files with one of these extensions, e.g. jpg,mp4,zip\n"
+		   "--min-size size       Skip files smaller than size, e.g. 4K\n"
+		   "--max-size size       Skip files larger than size, e.g. 1G\n"
+		   "--min-age age         Skip files modified less than age ago, e.g. 30m, 12h, 7d or 2w (default unit days)\n"
+		   "--max-age age         Skip files modified more than age ago\n"
+		   "--owner user          Only process files owned by user (name or uid)\n");
+}
+
+int main (int argc, const char * argv[])
+{
+	int i, j;
+	struct stat fileinfo, dstfileinfo;
+	struct folder_info folderinfo;
+	FTS *currfolder;
+	char *folderarray[2], *fullpath = NULL, *fullpathdst = NULL, *cwd, **roots;
+	struct folder_info *rootinfo;
+	int numRoots, k;
+	long int numDamaged;
+	int printVerbose = 0, compressionlevel = 5, readThreads = 0, compressThreads = 0, commitThreads = 0, numThreads, readBatch = 64;
+	double minSavings = 25.0;
+	long long int foldersize, foldersize_rounded, maxSize = 20971520, maxMemory = 0;
+	struct file_filter filter;
+	struct passwd *owner;
+	bool useFilter = FALSE;
+	struct signature_table *signatures = NULL;
+	struct file_signature signature;
+	const char *ratioCachePath = NULL;
+	bool savingsFirst = FALSE, orderedOutput = TRUE;
+	time_t deadline = 0, quietTime = 30, reconcileInterval = 0;
+	double targetMBps = 0, watchRate = 0, fileRate = 0, cpuShare = 0;
+	long long int readRate = 0;
+	const char *throttlePath = NULL, *metricsPath = NULL;
+	char *prescanPaths[2];
+	bool showProgress = FALSE, prescan = FALSE;
+	int niceLevel = 0, ioPolicy = -1;
+	const char *fileList = NULL, *histogramJSONPath = NULL, *listName;
+	int fileListDelim = '\n', numPaths, topDirs = 0;
+	size_t listPathSize = 0;
+	FILE *list;
+	bool dedup = FALSE, copyMode = FALSE, watchMode = FALSE, scrubMode = FALSE, histogramTable = FALSE, printDir = FALSE, decomp = FALSE, createfile = FALSE, extractfile = FALSE, applycomp = FALSE, fileCheck = FALSE, argIsFile, hardLinkCheck = FALSE, dstIsFile, free_src = FALSE, free_dst = FALSE;
+	FILE *afscFile, *outFile;
+	char *xattrnames, *curr_attr, header[4];
+	ssize_t xattrnamesize, xattrsize, getxattrret, xattrPos;
+	mode_t outFileMode;
+	void *attr_buf;
+	UInt16 big16;
+	UInt64 big64;
+	
+	if (argc < 2)
+	{
+		printUsage();
+		exit(EINVAL);
+	}
+	
+	memset(&filter, 0, sizeof(filter));
+	
+	for (i = 1; i < argc && argv[i][0] == '-'; i++)
+	{
+		if (argv[i][1] == '-')
+		{
+			if (strcmp(argv[i], "--read-threads") == 0 || strcmp(argv[i], "--compress-threads") == 0 || strcmp(argv[i], "--commit-threads") == 0)
+			{
+				if (i + 1 == argc || sscanf(argv[i+1], "%d", &numThreads) != 1 || numThreads < 1 || numThreads > 256)
+				{
+					fprintf(stderr, "Invalid number of threads for %s; must be a number from 1 to 256\n", argv[i]);
+					return -1;
+				}
+				if (argv[i][2] == 'r')
+					readThreads = numThreads;
+				else if (argv[i][4] == 'm' && argv[i][5] == 'p')
+					compressThreads = numThreads;
+				else
+					commitThreads = numThreads;
+				i++;
+			}
+			else if (strcmp(argv[i], "--unordered") == 0)
+			{
+				orderedOutput = FALSE;
+			}
+			else if (strcmp(argv[i], "--read-batch") == 0)
+			{
+				if (i + 1 == argc || sscanf(argv[i+1], "%d", &readBatch) != 1 || readBatch < 1 || readBatch > 256)
+				{
+					fprintf(stderr, "Invalid read batch size; must be a number from 1 to 256\n");
+					return -1;
+				}
+				i++;
+			}
+			else if (strcmp(argv[i], "--include") == 0 || strcmp(argv[i], "--exclude") == 0 ||
+					 strcmp(argv[i], "--include-ext") == 0 || strcmp(argv[i], "--exclude-ext") == 0)
+			{
+				if (i + 1 == argc)
+				{
+					printUsage();
+					exit(EINVAL);
+				}
+				if (strcmp(argv[i], "--include") == 0)
+					addFilterGlob(&filter.include_exts, &filter.include_globs, &filter.num_include_globs, argv[i+1]);
+				else if (strcmp(argv[i], "--exclude") == 0)
+					addFilterGlob(&filter.exclude_exts, &filter.exclude_globs, &filter.num_exclude_globs, argv[i+1]);
+				else
+					addExtensionList((argv[i][2] == 'i') ? &filter.include_exts : &filter.exclude_exts, argv[i+1]);
+				useFilter = TRUE;
+				i++;
+			}
+			else if (strcmp(argv[i], "--min-size") == 0 || strcmp(argv[i], "--max-size") == 0)
+			{
+				if (i + 1 == argc || !parseSize(argv[i+1], (argv[i][3] == 'i') ? &filter.min_size : &filter.max_size))
+				{
+					fprintf(stderr, "Invalid size for %s; must be a size such as 4K or 1G\n", argv[i]);
+					return -1;
+				}
+				useFilter = TRUE;
+				i++;
+			}
+			else if (strcmp(argv[i], "--min-age") == 0 || strcmp(argv[i], "--max-age") == 0)
+			{
+				if (i + 1 == argc || !parseAge(argv[i+1], (argv[i][3] == 'i') ? &filter.min_age : &filter.max_age))
+				{
+					fprintf(stderr, "Invalid age for %s; must be a time such as 30m, 12h, 7d or 2w\n", argv[i]);
+					return -1;
+				}
+				useFilter = TRUE;
+				i++;
+			}
+			else if (strcmp(argv[i], "--owner") == 0)
+			{
+				if (i + 1 == argc)
+				{
+					printUsage();
+					exit(EINVAL);
+				}
+				if ((owner = getpwnam(argv[i+1])) != NULL)
+					filter.owner = owner->pw_uid;
+				else if (sscanf(argv[i+1], "%u", &filter.owner) != 1)
+				{
+					fprintf(stderr, "%s: no such user\n", argv[i+1]);
+					return -1;
+				}
+				filter.check_owner = TRUE;
+				useFilter = TRUE;
+				i++;
+			}
+			else if (strcmp(argv[i], "--sniff") == 0 || strcmp(argv[i], "--sniff-signature") == 0)
+			{
+				if (signatures == NULL)
+					signatures = createSignatureTable();
+				if (argv[i][7] == '-')
+				{
+					if (i + 1 == argc || !parseSignature(argv[i+1], &signature))
+					{
+						fprintf(stderr, "Invalid signature; must be given as name:offset:hexbytes\n");
+						return -1;
+					}
+					addSignature(signatures, &signature);
+					i++;
+				}
+			}
+			else if (strcmp(argv[i], "--savings-first") == 0)
+			{
+				savingsFirst = TRUE;
+			}
+			else if (strcmp(argv[i], "--ratio-cache") == 0)
+			{
+				if (i + 1 == argc)
+				{
+					printUsage();
+					exit(EINVAL);
+				}
+				ratioCachePath = argv[++i];
+			}
+			else if (strcmp(argv[i], "--deadline") == 0)
+			{
+				if (i + 1 == argc || !parseAge(argv[i+1], &deadline) || deadline == 0)
+				{
+					fprintf(stderr, "Invalid deadline; must be a time such as 30m or 2h\n");
+					return -1;
+				}
+				i++;
+			}
+			else if (strcmp(argv[i], "--target-mbps") == 0)
+			{
+				if (i + 1 == argc || sscanf(argv[i+1], "%lf", &targetMBps) != 1 || targetMBps <= 0)
+				{
+					fprintf(stderr, "Invalid throughput target; must be a number of megabytes per second\n");
+					return -1;
+				}
+				i++;
+			}
+			else if (strcmp(argv[i], "--stdin0") == 0 || strcmp(argv[i], "--stdin") == 0)
+			{
+				fileList = "-";
+				fileListDelim = (argv[i][7] == '0') ? '\0' : '\n';
+			}
+			else if (strcmp(argv[i], "--files-from") == 0)
+			{
+				if (i + 1 == argc)
+				{
+					printUsage();
+					exit(EINVAL);
+				}
+				fileList = argv[++i];
+				fileListDelim = '\n';
+			}
+			else if (strcmp(argv[i], "--dedup") == 0)
+			{
+				dedup = TRUE;
+			}
+			else if (strcmp(argv[i], "--copy") == 0)
+			{
+				copyMode = TRUE;
+			}
+			else if (strcmp(argv[i], "--watch") == 0)
+			{
+				watchMode = TRUE;
+			}
+			else if (strcmp(argv[i], "--scrub") == 0)
+			{
+				scrubMode = TRUE;
+			}
+			else if (strcmp(argv[i], "--quiet-time") == 0)
+			{
+				if (i + 1 == argc || sscanf(argv[i+1], "%ld", &quietTime) != 1 || quietTime < 0)
+				{
+					fprintf(stderr, "Invalid quiet time; must be a number of seconds\n");
+					return -1;
+				}
+				i++;
+			}
+			else if (strcmp(argv[i], "--watch-rate") == 0)
+			{
+				if (i + 1 == argc || sscanf(argv[i+1], "%lf", &watchRate) != 1 || watchRate <= 0)
+				{
+					fprintf(stderr, "Invalid rate; must be a number of files per minute\n");
+					return -1;
+				}
+				i++;
+			}
+			else if (strcmp(argv[i], "--reconcile") == 0)
+			{
+				if (i + 1 == argc || !parseAge(argv[i+1], &reconcileInterval) || reconcileInterval == 0)
+				{
+					fprintf(stderr, "Invalid time for --reconcile; must be a time such as 30m, 12h or 1d\n");
+					return -1;
+				}
+				i++;
+			}
+			else if (strcmp(argv[i], "--max-read-rate") == 0)
+			{
+				if (i + 1 == argc || !parseSize(argv[i+1], &readRate) || readRate == 0)
+				{
+					fprintf(stderr, "Invalid read rate; must be a size such as 20M\n");
+					return -1;
+				}
+				i++;
+			}
+			else if (strcmp(argv[i], "--max-file-rate") == 0)
+			{
+				if (i + 1 == argc || sscanf(argv[i+1], "%lf", &fileRate) != 1 || fileRate <= 0)
+				{
+					fprintf(stderr, "Invalid rate; must be a number of files per second\n");
+					return -1;
+				}
+				i++;
+			}
+			else if (strcmp(argv[i], "--cpu-share") == 0)
+			{
+				if (i + 1 == argc || sscanf(argv[i+1], "%lf", &cpuShare) != 1 || cpuShare <= 0 || cpuShare > 100)
+				{
+					fprintf(stderr, "Invalid CPU share; must be a percentage above 0 and up to 100\n");
+					return -1;
+				}
+				cpuShare /= 100;
+				i++;
+			}
+			else if (strcmp(argv[i], "--throttle-file") == 0)
+			{
+				if (i + 1 == argc)
+				{
+					printUsage();
+					exit(EINVAL);
+				}
+				throttlePath = argv[i+1];
+				i++;
+			}
+			else if (strcmp(argv[i], "--nice") == 0)
+			{
+				if (i + 1 == argc || sscanf(argv[i+1], "%d", &niceLevel) != 1 || niceLevel < 0 || niceLevel > 20)
+				{
+					fprintf(stderr, "Invalid nice level; must be a number from 0 to 20\n");
+					return -1;
+				}
+				i++;
+			}
+			else if (strcmp(argv[i], "--io-policy") == 0)
+			{
+				if (i + 1 == argc)
+				{
+					printUsage();
+					exit(EINVAL);
+				}
+				if (strcmp(argv[i+1], "important") == 0)
+					ioPolicy = IOPOL_IMPORTANT;
+				else if (strcmp(argv[i+1], "standard") == 0)
+					ioPolicy = IOPOL_STANDARD;
+				else if (strcmp(argv[i+1], "utility") == 0)
+					ioPolicy = IOPOL_UTILITY;
+				else if (strcmp(argv[i+1], "throttle") == 0)
+					ioPolicy = IOPOL_THROTTLE;
+				else if (strcmp(argv[i+1], "passive") == 0)
+					ioPolicy = IOPOL_PASSIVE;
+				else
+				{
+					fprintf(stderr, "Invalid I/O policy; must be important, standard, utility, throttle or passive\n");
+					return -1;
+				}
+				i++;
+			}
+			else if (strcmp(argv[i], "--progress") == 0)
+			{
+				showProgress = TRUE;
 			}
-			else if (strcmp(curr_attr, "com.apple.decmpfs") == 0 && strlen(curr_attr) == 17)
+			else if (strcmp(argv[i], "--prescan") == 0)
 			{
-				compattrsize += xattrsize;
-				numhiddenattr++;
+				prescan = TRUE;
 			}
-			else
-				xattrssize += xattrsize;
-		}
-		free(xattrnames);
-	}
-	
-	folderinfo->num_files++;
-	if ((fileinfo->st_flags & UF_COMPRESSED) == 0)
-	{
-		filesize_rounded = filesize = fileinfo->st_size;
-		filesize_rounded += (filesize_rounded % fileinfo->st_blksize) ? fileinfo->st_blksize - (filesize_rounded % fileinfo->st_blksize) : 0;
-		filesize += RFsize;
-		filesize_rounded += RFsize;
-		filesize_rounded += (filesize_rounded % fileinfo->st_blksize) ? fileinfo->st_blksize - (filesize_rounded % fileinfo->st_blksize) : 0;
-		folderinfo->uncompressed_size += filesize;
-		folderinfo->uncompressed_size_rounded += filesize_rounded;
-		folderinfo->compressed_size += filesize;
-		folderinfo->compressed_size_rounded += filesize_rounded;
-		filesize = fileinfo->st_size;
-		filesize += (filesize % fileinfo->st_blksize) ? fileinfo->st_blksize - (filesize % fileinfo->st_blksize) : 0;
-		filesize += RFsize;
-		filesize += (filesize % fileinfo->st_blksize) ? fileinfo->st_blksize - (filesize % fileinfo->st_blksize) : 0;
-		filesize += compattrsize + xattrssize + (((ssize_t) numxattrs) * sizeof(HFSPlusAttrKey)) + sizeof(HFSPlusCatalogFile);
-		folderinfo->total_size += filesize;
-	}
-	else
-	{
-		if (folderinfo->print_files)
-		{
-			if (folderinfo->print_info > 1)
+			else if (strcmp(argv[i], "--metrics-file") == 0)
 			{
-				printf("%s:\n", filepath);
-				filesize = fileinfo->st_size;
-				printf("File size (uncompressed data fork; reported size by Mac OS 10.6+ Finder): %s\n", getSizeStr(filesize, filesize));
-				filesize_rounded = filesize = RFsize;
-				filesize_rounded += (filesize_rounded % fileinfo->st_blksize) ? fileinfo->st_blksize - (filesize_rounded % fileinfo->st_blksize) : 0;
-				printf("File size (compressed data fork - decmpfs xattr; reported size by Mac OS 10.0-10.5 Finder): %s\n", getSizeStr(filesize, filesize_rounded));
-				filesize_rounded = filesize = RFsize;
-				filesize_rounded += (filesize_rounded % fileinfo->st_blksize) ? fileinfo->st_blksize - (filesize_rounded % fileinfo->st_blksize) : 0;
-				filesize += compattrsize;
-				filesize_rounded += compattrsize;
-				printf("File size (compressed data fork): %s\n", getSizeStr(filesize, filesize_rounded));
-				printf("Compression savings: %0.1f%%\n", (1.0 - (((double) RFsize + compattrsize) / fileinfo->st_size)) * 100.0);
-				printf("Number of extended attributes: %d\n", numxattrs - numhiddenattr);
-				printf("Total size of extended attribute data: %ld bytes\n", xattrssize);
-				printf("Appoximate overhead of extended attributes: %ld bytes\n", ((ssize_t) numxattrs) * sizeof(HFSPlusAttrKey));
-				filesize = RFsize;
-				filesize += (filesize % fileinfo->st_blksize) ? fileinfo->st_blksize - (filesize % fileinfo->st_blksize) : 0;
-				filesize += compattrsize + xattrssize + (((ssize_t) numxattrs) * sizeof(HFSPlusAttrKey)) + sizeof(HFSPlusCatalogFile);
-				printf("Appoximate total file size (compressed data fork + EA + EA overhead + file overhead): %s\n", getSizeStr(filesize, filesize));
+				if (i + 1 == argc)
+				{
+					printUsage();
+					exit(EINVAL);
+				}
+				metricsPath = argv[i+1];
+				i++;
 			}
-			else if (!folderinfo->compress_files)
+			else if (strcmp(argv[i], "--histogram") == 0)
 			{
-				printf("%s\n", filepath);
+				histogramTable = TRUE;
 			}
-		}
-
-		filesize_rounded = filesize = fileinfo->st_size;
-		filesize_rounded += (filesize_rounded % fileinfo->st_blksize) ? fileinfo->st_blksize - (filesize_rounded % fileinfo->st_blksize) : 0;
-		folderinfo->uncompressed_size += filesize;
-		folderinfo->uncompressed_size_rounded += filesize_rounded;
-		filesize_rounded = filesize = RFsize;
-		filesize_rounded += (filesize_rounded % fileinfo->st_blksize) ? fileinfo->st_blksize - (filesize_rounded % fileinfo->st_blksize) : 0;
-		folderinfo->compressed_size += filesize;
-		folderinfo->compressed_size_rounded += filesize_rounded;
-		folderinfo->compattr_size += compattrsize;
-		filesize = RFsize;
-		filesize += (filesize % fileinfo->st_blksize) ? fileinfo->st_blksize - (filesize % fileinfo->st_blksize) : 0;
-		filesize += compattrsize + xattrssize + (((ssize_t) numxattrs) * sizeof(HFSPlusAttrKey)) + sizeof(HFSPlusCatalogFile);
-		folderinfo->total_size += filesize;
-		folderinfo->num_compressed++;
-	}
-}
-
-void process_folder(FTS *currfolder, struct folder_info *folderinfo)
-{
-	FTSENT *currfile;
-	char *xattrnames, *curr_attr;
-	ssize_t xattrnamesize, xattrssize, xattrsize;
-	int numxattrs;
-	bool volume_search;
-	
-	currfile = fts_read(currfolder);
-	if (currfile == NULL)
-	{
-		fts_close(currfolder);
-		return;
-	}
-	volume_search = (strncasecmp("/Volumes/", currfile->fts_path, 9) == 0 && strlen(currfile->fts_path) >= 8);
-	
-	do
-	{
-		if ((volume_search || strncasecmp("/Volumes/", currfile->fts_path, 9) != 0 || strlen(currfile->fts_path) < 9) &&
-			(strncasecmp("/dev/", currfile->fts_path, 5) != 0 || strlen(currfile->fts_path) < 5))
-		{
-			if (S_ISDIR(currfile->fts_statp->st_mode) && currfile->fts_ino != 2)
+			else if (strcmp(argv[i], "--histogram-json") == 0)
 			{
-				if (currfile->fts_info & FTS_D)
+				if (i + 1 == argc)
 				{
-					if (!folderinfo->check_hard_links || !checkForHardLink(currfile->fts_path, currfile->fts_statp, folderinfo))
-					{
-						numxattrs = 0;
-						xattrssize = 0;
-						
-						xattrnamesize = listxattr(currfile->fts_path, NULL, 0, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW);
-						
-						if (xattrnamesize > 0)
-						{
-							xattrnames = (char *) malloc(xattrnamesize);
-							if (xattrnames == NULL)
-							{
-								fprintf(stderr, "malloc error, unable to get folder information\n");
-								continue;
-							}
-							if ((xattrnamesize = listxattr(currfile->fts_path, xattrnames, xattrnamesize, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW)) <= 0)
-							{
-								fprintf(stderr, "listxattr: %s\n", strerror(errno));
-								free(xattrnames);
-								continue;
-							}
-							for (curr_attr = xattrnames; curr_attr < xattrnames + xattrnamesize; curr_attr += strlen(curr_attr) + 1)
-							{
-								xattrsize = getxattr(currfile->fts_path, curr_attr, NULL, 0, 0, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW);
-								if (xattrsize < 0)
-								{
-									fprintf(stderr, "getxattr: %s\n", strerror(errno));
-									free(xattrnames);
-									continue;
-								}
-								numxattrs++;
-								xattrssize += xattrsize;
-							}
-							free(xattrnames);
-						}
-						folderinfo->num_folders++;
-						folderinfo->total_size += xattrssize + (((ssize_t) numxattrs) * sizeof(HFSPlusAttrKey)) + sizeof(HFSPlusCatalogFolder);
-					}
-					else
-					{
-						folderinfo->num_hard_link_folders++;
-						fts_set(currfolder, currfile, FTS_SKIP);
-						
-						folderinfo->num_folders++;
-						folderinfo->total_size += sizeof(HFSPlusCatalogFolder);
-					}
+					printUsage();
+					exit(EINVAL);
 				}
+				histogramJSONPath = argv[i+1];
+				i++;
 			}
-			else if (S_ISREG(currfile->fts_statp->st_mode) || S_ISLNK(currfile->fts_statp->st_mode))
+			else if (strcmp(argv[i], "--top-dirs") == 0)
 			{
-				if (!folderinfo->check_hard_links || !checkForHardLink(currfile->fts_path, currfile->fts_statp, folderinfo))
+				if (i + 1 == argc || sscanf(argv[i+1], "%d", &topDirs) != 1 || topDirs < 1 || topDirs > 10000)
 				{
-					if (folderinfo->compress_files && S_ISREG(currfile->fts_statp->st_mode))
-					{
-						compressFile(currfile->fts_path, currfile->fts_statp, folderinfo->maxSize, folderinfo->compressionlevel, folderinfo->minSavings, folderinfo->check_files);
-						lstat(currfile->fts_path, currfile->fts_statp);
-						if (((currfile->fts_statp->st_flags & UF_COMPRESSED) == 0) && folderinfo->print_files)
-						{
-							if (folderinfo->print_info > 0)
-								printf("Unable to compress: ");
-							printf("%s\n", currfile->fts_path);
-						}
-					}
-					process_file(currfile->fts_path, currfile->fts_statp, folderinfo);
+					fprintf(stderr, "Invalid number of folders for --top-dirs; must be a number from 1 to 10000\n");
+					return -1;
 				}
-				else
+				i++;
+			}
+			else if (strcmp(argv[i], "--max-memory") == 0)
+			{
+				if (i + 1 == argc || !parseSize(argv[i+1], &maxMemory) || maxMemory == 0)
 				{
-					folderinfo->num_hard_link_files++;
-					
-					folderinfo->num_files++;
-					folderinfo->total_size += sizeof(HFSPlusCatalogFile);
+					fprintf(stderr, "Invalid memory limit; must be a size such as 512M or 2G\n");
+					return -1;
 				}
+				i++;
 			}
+			else
+			{
+				printUsage();
+				exit(EINVAL);
+			}
+			continue;
 		}
-		else
-			fts_set(currfolder, currfile, FTS_SKIP);
-	} while ((currfile = fts_read(currfolder)) != NULL);
-	checkForHardLink(NULL, NULL, NULL);
-	fts_close(currfolder);
-}
-
-void printUsage()
-{
-	printf("afsctool 1.2.3 (build 23)\n"
-		   "Report if file is HFS+ compressed:                        afsctool [-v] file\n"
-		   "Report if folder contains HFS+ compressed files:          afsctool [-fvv] folder\n"
-		   "List HFS+ compressed files in folder:                     afsctool -l[fvv] folder\n"
-		   "Decompress HFS+ compressed file or folder:                afsctool -d file/folder\n"
-		   "Create archive file with compressed data in data fork:    afsctool -a[d] src dst\n"
-		   "Extract HFS+ compression archive to file:                 afsctool -x[d] src dst\n"
-		   "Apply HFS+ compression to file or folder:                 afsctool -c[klfvv] [compressionlevel [maxFileSize [minPercentSavings]]] file/folder\n\n"
-		   "Options:\n"
-		   "-v Increase verbosity level\n"
-		   "-f Skip files if a hard link to them has already been processeed\n"
-		   "-l List files that are HFS+ compressed (or if the -c option is given, files which fail to compress)\n"
-		   "-k Verify file after compression, and revert file changes if file verification fails\n");
-}
-
-int main (int argc, const char * argv[])
-{
-	int i, j;
-	struct stat fileinfo, dstfileinfo;
-	struct folder_info folderinfo;
-	FTS *currfolder;
-	FTSENT *currfile;
-	char *folderarray[2], *fullpath = NULL, *fullpathdst = NULL, *cwd;
-	int printVerbose = 0, compressionlevel = 5;
-	double minSavings = 25.0;
-	long long int foldersize, foldersize_rounded, maxSize = 20971520;
-	bool printDir = FALSE, decomp = FALSE, createfile = FALSE, extractfile = FALSE, applycomp = FALSE, fileCheck = FALSE, argIsFile, hardLinkCheck = FALSE, dstIsFile, free_src = FALSE, free_dst = FALSE;
-	FILE *afscFile, *outFile;
-	char *xattrnames, *curr_attr, header[4];
-	ssize_t xattrnamesize, xattrsize, getxattrret, xattrPos;
-	mode_t outFileMode;
-	void *attr_buf;
-	UInt16 big16;
-	UInt64 big64;
-	
-	if (argc < 2)
-	{
-		printUsage();
-		exit(EINVAL);
-	}
-	
-	for (i = 1; i < argc && argv[i][0] == '-'; i++)
-	{
 		for (j = 1; j < strlen(argv[i]); j++)
 		{
 			switch (argv[i][j])
@@ -1372,7 +5256,18 @@ int main (int argc, const char * argv[])
 		}
 	}
 	
-	if (applycomp && (argc - i > 1))
+	if ((copyMode || watchMode) && (createfile || extractfile || decomp || fileList != NULL || (copyMode && watchMode)))
+	{
+		printUsage();
+		exit(EINVAL);
+	}
+	if (scrubMode && (copyMode || watchMode || createfile || extractfile || decomp || applycomp || fileList != NULL))
+	{
+		printUsage();
+		exit(EINVAL);
+	}
+	numPaths = (fileList != NULL) ? 0 : (copyMode ? 2 : 1);
+	if (applycomp && (argc - i > numPaths) && isNumberArg(argv[i]))
 	{
 		sscanf(argv[i], "%d", &compressionlevel);
 		if (compressionlevel > 9 || compressionlevel < 1)
@@ -1383,13 +5278,13 @@ int main (int argc, const char * argv[])
 		i++;
 	}
 	
-	if (applycomp && (argc - i > 1))
+	if (applycomp && (argc - i > numPaths) && isNumberArg(argv[i]))
 	{
 		sscanf(argv[i], "%lld", &maxSize);
 		i++;
 	}
 	
-	if (applycomp && (argc - i > 1))
+	if (applycomp && (argc - i > numPaths) && isNumberArg(argv[i]))
 	{
 		sscanf(argv[i], "%lf", &minSavings);
 		if (minSavings > 99 || minSavings < 0)
@@ -1400,12 +5295,226 @@ int main (int argc, const char * argv[])
 		i++;
 	}
 	
-	if (i == argc || ((createfile || extractfile) && (argc - i < 2)))
+	folderinfo.uncompressed_size = 0;
+	folderinfo.uncompressed_size_rounded = 0;
+	folderinfo.compressed_size = 0;
+	folderinfo.compressed_size_rounded = 0;
+	folderinfo.compattr_size = 0;
+	folderinfo.total_size = 0;
+	folderinfo.num_compressed = 0;
+	folderinfo.num_files = 0;
+	folderinfo.num_hard_link_files = 0;
+	folderinfo.num_folders = 0;
+	folderinfo.num_hard_link_folders = 0;
+	folderinfo.print_info = printVerbose;
+	folderinfo.print_files = printDir;
+	folderinfo.compress_files = applycomp;
+	folderinfo.check_files = fileCheck;
+	folderinfo.compressionlevel = compressionlevel;
+	folderinfo.minSavings = minSavings;
+	folderinfo.maxSize = maxSize;
+	folderinfo.check_hard_links = hardLinkCheck;
+	folderinfo.hard_links = hardLinkCheck ? createHardLinkTable() : NULL;
+	folderinfo.read_threads = 0;
+	folderinfo.read_batch = readBatch;
+	folderinfo.compress_threads = 0;
+	folderinfo.commit_threads = 0;
+	folderinfo.ordered_output = orderedOutput;
+	folderinfo.max_memory = maxMemory;
+	folderinfo.dedup = (applycomp && dedup) ? createDedupIndex(268435456) : NULL;
+	filter.now = time(NULL);
+	folderinfo.filter = useFilter ? &filter : NULL;
+	folderinfo.signatures = applycomp ? signatures : NULL;
+	folderinfo.ratios = (applycomp && ratioCachePath != NULL) ? loadRatioCache(ratioCachePath) : NULL;
+	folderinfo.savings_first = savingsFirst;
+	folderinfo.deadline = (deadline != 0) ? time(NULL) + deadline : 0;
+	folderinfo.deadline_reached = FALSE;
+	folderinfo.target_mbps = targetMBps;
+	memset(folderinfo.level_counts, 0, sizeof(folderinfo.level_counts));
+	folderinfo.report = (topDirs > 0) ? createDirReport(topDirs) : NULL;
+	folderinfo.histograms = NULL;
+	folderinfo.throttle = (readRate > 0 || fileRate > 0 || cpuShare > 0 || throttlePath != NULL) ? createThrottle(readRate, fileRate, cpuShare, throttlePath) : NULL;
+	if (niceLevel > 0 && setpriority(PRIO_PROCESS, 0, niceLevel) < 0)
+		fprintf(stderr, "setpriority: %s\n", strerror(errno));
+	if (ioPolicy >= 0 && setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_PROCESS, ioPolicy) < 0)
+		fprintf(stderr, "setiopolicy_np: %s\n", strerror(errno));
+	if (histogramTable || histogramJSONPath != NULL)
+	{
+		folderinfo.histograms = (struct file_histograms *) calloc(1, sizeof(struct file_histograms));
+		if (folderinfo.histograms == NULL)
+		{
+			fprintf(stderr, "Malloc error allocating histograms, exiting...\n");
+			exit(-1);
+		}
+		folderinfo.histograms->print_table = histogramTable;
+		folderinfo.histograms->json_path = histogramJSONPath;
+	}
+	if (readThreads > 0 || compressThreads > 0 || commitThreads > 0)
+	{
+		folderinfo.read_threads = (readThreads > 0) ? readThreads : 1;
+		folderinfo.compress_threads = (compressThreads > 0) ? compressThreads : sysconf(_SC_NPROCESSORS_ONLN);
+		if (folderinfo.compress_threads < 1)
+			folderinfo.compress_threads = 1;
+		folderinfo.commit_threads = (commitThreads > 0) ? commitThreads : 1;
+	}
+	folderinfo.progress = NULL;
+	if (showProgress || metricsPath != NULL)
+	{
+		// Only a run over files and folders given on the command line has a fixed set of files to count first
+		prescan = prescan && fileList == NULL && i < argc && !watchMode && !createfile && !extractfile;
+		prescanPaths[0] = (char *) argv[i];
+		prescanPaths[1] = NULL;
+		folderinfo.progress = startProgress(showProgress, metricsPath, prescan ? (copyMode ? prescanPaths : (char * const *) &argv[i]) : NULL, folderinfo.filter);
+	}
+	
+	if (scrubMode)
+	{
+		if (i == argc)
+		{
+			printUsage();
+			exit(EINVAL);
+		}
+		numThreads = (compressThreads > 0) ? compressThreads : sysconf(_SC_NPROCESSORS_ONLN);
+		numDamaged = scrub_folder((char * const *) &argv[i], (numThreads > 0) ? numThreads : 1, &folderinfo);
+		finishFolderInfo(&folderinfo, NULL);
+		return (numDamaged > 0) ? EIO : 0;
+	}
+	
+	if (fileList != NULL)
+	{
+		if (i != argc || createfile || extractfile)
+		{
+			printUsage();
+			exit(EINVAL);
+		}
+		if (strcmp(fileList, "-") == 0)
+			list = stdin;
+		else if ((list = fopen(fileList, "r")) == NULL)
+		{
+			fprintf(stderr, "%s: %s\n", fileList, strerror(errno));
+			return -1;
+		}
+		if (decomp)
+		{
+			while (readListPath(list, fileListDelim, &fullpath, &listPathSize) != NULL)
+			{
+				if (lstat(fullpath, &fileinfo) < 0)
+				{
+					fprintf(stderr, "%s: %s\n", fullpath, strerror(errno));
+					continue;
+				}
+				listName = strrchr(fullpath, '/');
+				listName = (listName != NULL && listName[1] != '\0') ? listName + 1 : fullpath;
+				if (S_ISREG(fileinfo.st_mode) &&
+					(folderinfo.filter == NULL || filterAllowsFile(folderinfo.filter, fullpath, listName, fullpath, &fileinfo, FALSE)))
+				{
+					decompressFile(fullpath, &fileinfo);
+					if (folderinfo.progress != NULL)
+						progressAddFile(folderinfo.progress, fileinfo.st_size, 0);
+				}
+			}
+			free(fullpath);
+		}
+		else
+		{
+			process_file_list(list, fileListDelim, &folderinfo);
+			finishProgress(&folderinfo);
+			if (printVerbose > 0 || !printDir)
+			{
+				if (printDir) printf("\n");
+				printf("%s:\n", (list == stdin) ? "Files listed on standard input" : fileList);
+				printFolderInfo(&folderinfo, TRUE);
+			}
+		}
+		if (list != stdin)
+			fclose(list);
+		finishFolderInfo(&folderinfo, ratioCachePath);
+		return 0;
+	}
+	
+	// Several files and folders are walked together, with a summary for each and one for all of them
+	numRoots = argc - i;
+	if (numRoots > 1 && !createfile && !extractfile && !copyMode && !watchMode)
+	{
+		roots = (char **) malloc((numRoots + 1) * sizeof(char *));
+		rootinfo = (struct folder_info *) malloc(numRoots * sizeof(struct folder_info));
+		cwd = getcwd(NULL, 0);
+		if (roots == NULL || rootinfo == NULL || cwd == NULL)
+		{
+			fprintf(stderr, "Unable to set up list of files and folders, exiting...\n");
+			exit(-1);
+		}
+		for (numRoots = 0; i < argc; i++)
+		{
+			fullpath = (char *) malloc(strlen(cwd) + strlen(argv[i]) + 2);
+			if (fullpath == NULL)
+			{
+				fprintf(stderr, "Malloc error allocating list of files and folders, exiting...\n");
+				exit(-1);
+			}
+			if (argv[i][0] != '/')
+				sprintf(fullpath, "%s/%s", cwd, argv[i]);
+			else
+				strcpy(fullpath, argv[i]);
+			if (lstat(fullpath, &fileinfo) < 0)
+			{
+				fprintf(stderr, "%s: %s\n", fullpath, strerror(errno));
+				free(fullpath);
+				continue;
+			}
+			roots[numRoots++] = fullpath;
+		}
+		roots[numRoots] = NULL;
+		free(cwd);
+		if (numRoots == 0)
+			return -1;
+		if ((currfolder = fts_open(roots, FTS_PHYSICAL, NULL)) == NULL)
+		{
+			fprintf(stderr, "%s: %s\n", roots[0], strerror(errno));
+			exit(EACCES);
+		}
+		if (decomp)
+			decompress_folder(currfolder, &folderinfo);
+		else
+		{
+			for (k = 0; k < numRoots; k++)
+				rootinfo[k] = folderinfo;
+			process_folder(currfolder, rootinfo, numRoots);
+			finishProgress(&folderinfo);
+			for (k = 0; k < numRoots; k++)
+			{
+				if (lstat(roots[k], &fileinfo) >= 0 && S_ISDIR(fileinfo.st_mode))
+					rootinfo[k].num_folders--;
+				addFolderInfo(&folderinfo, &rootinfo[k]);
+				if (printVerbose > 0 || !printDir)
+				{
+					if (printDir || k > 0) printf("\n");
+					printf("%s:\n", roots[k]);
+					printFolderInfo(&rootinfo[k], FALSE);
+				}
+			}
+			if (printVerbose > 0 || !printDir)
+			{
+				printf("\nAll %d files and folders:\n", numRoots);
+				printFolderInfo(&folderinfo, TRUE);
+			}
+			if (folderinfo.report != NULL)
+				printDirReport(folderinfo.report);
+		}
+		for (k = 0; k < numRoots; k++)
+			free(roots[k]);
+		free(roots);
+		free(rootinfo);
+		finishFolderInfo(&folderinfo, ratioCachePath);
+		return 0;
+	}
+	
+	if (i == argc || ((createfile || extractfile || copyMode) && (argc - i < 2)))
 	{
 		printUsage();
 		exit(EINVAL);
 	}
-	else if (createfile || extractfile)
+	else if (createfile || extractfile || copyMode)
 	{
 		if (argv[i+1][0] != '/')
 		{
@@ -1454,16 +5563,66 @@ int main (int argc, const char * argv[])
 		folderarray[1] = NULL;
 	}
 	
-	if ((createfile || extractfile) && lstat(fullpathdst, &dstfileinfo) >= 0)
+	if ((createfile || extractfile || copyMode) && lstat(fullpathdst, &dstfileinfo) >= 0)
 	{
 		dstIsFile = ((dstfileinfo.st_mode & S_IFDIR) == 0);
-		fprintf(stderr, "%s: %s already exists at this path\n", fullpath, dstIsFile ? "File" : "Folder");
+		fprintf(stderr, "%s: %s already exists at this path\n", fullpathdst, dstIsFile ? "File" : "Folder");
 		return -1;
 	}
 	
+	if (copyMode)
+	{
+		// Each copied path is built from the source path, so neither may end in a slash
+		while (strlen(fullpath) > 1 && fullpath[strlen(fullpath) - 1] == '/')
+			fullpath[strlen(fullpath) - 1] = '\0';
+		while (strlen(fullpathdst) > 1 && fullpathdst[strlen(fullpathdst) - 1] == '/')
+			fullpathdst[strlen(fullpathdst) - 1] = '\0';
+		// Hard links are copied as separate files, so none of them may be skipped
+		folderinfo.check_hard_links = FALSE;
+		copy_folder(fullpath, fullpathdst, &folderinfo);
+		finishProgress(&folderinfo);
+		if (!argIsFile)
+			folderinfo.num_folders--;
+		if (printVerbose > 0 || !printDir)
+		{
+			if (printDir) printf("\n");
+			printf("%s:\n", fullpathdst);
+			printFolderInfo(&folderinfo, TRUE);
+		}
+		finishFolderInfo(&folderinfo, ratioCachePath);
+		if (free_src)
+			free(fullpath);
+		if (free_dst)
+			free(fullpathdst);
+		return 0;
+	}
+	
+	if (watchMode)
+	{
+		if (!applycomp || argIsFile || argc - i != 1)
+		{
+			printUsage();
+			exit(EINVAL);
+		}
+		watch_folder(fullpath, quietTime, watchRate, reconcileInterval, &folderinfo);
+		finishProgress(&folderinfo);
+		if (printVerbose > 0 || !printDir)
+		{
+			if (printDir) printf("\n");
+			printf("Files compressed while watching %s:\n", fullpath);
+			printFolderInfo(&folderinfo, TRUE);
+		}
+		if (folderinfo.report != NULL)
+			printDirReport(folderinfo.report);
+		finishFolderInfo(&folderinfo, ratioCachePath);
+		if (free_src)
+			free(fullpath);
+		return 0;
+	}
+	
 	if (applycomp && argIsFile)
 	{
-		compressFile(fullpath, &fileinfo, maxSize, compressionlevel, minSavings, fileCheck);
+		compressFile(fullpath, &fileinfo, &folderinfo);
 		lstat(fullpath, &fileinfo);
 	}
 	
@@ -1674,10 +5833,7 @@ int main (int argc, const char * argv[])
 			fprintf(stderr, "%s: %s\n", fullpath, strerror(errno));
 			exit(EACCES);
 		}
-		while ((currfile = fts_read(currfolder)) != NULL)
-			if ((currfile->fts_statp->st_mode & S_IFDIR) == 0)
-				decompressFile(currfile->fts_path, currfile->fts_statp);
-		fts_close(currfolder);
+		decompress_folder(currfolder, &folderinfo);
 	}
 	else if (argIsFile && printVerbose == 0)
 	{
@@ -1705,68 +5861,20 @@ int main (int argc, const char * argv[])
 			fprintf(stderr, "%s: %s\n", fullpath, strerror(errno));
 			exit(EACCES);
 		}
-		folderinfo.uncompressed_size = 0;
-		folderinfo.uncompressed_size_rounded = 0;
-		folderinfo.compressed_size = 0;
-		folderinfo.compressed_size_rounded = 0;
-		folderinfo.compattr_size = 0;
-		folderinfo.total_size = 0;
-		folderinfo.num_compressed = 0;
-		folderinfo.num_files = 0;
-		folderinfo.num_hard_link_files = 0;
-		folderinfo.num_folders = 0;
-		folderinfo.num_hard_link_folders = 0;
-		folderinfo.print_info = printVerbose;
-		folderinfo.print_files = printDir;
-		folderinfo.compress_files = applycomp;
-		folderinfo.check_files = fileCheck;
-		folderinfo.compressionlevel = compressionlevel;
-		folderinfo.minSavings = minSavings;
-		folderinfo.maxSize = maxSize;
-		folderinfo.check_hard_links = hardLinkCheck;
-		process_folder(currfolder, &folderinfo);
+		process_folder(currfolder, &folderinfo, 1);
+		finishProgress(&folderinfo);
 		folderinfo.num_folders--;
 		if (printVerbose > 0 || !printDir)
 		{
 			if (printDir) printf("\n");
 			printf("%s:\n", fullpath);
-			if (folderinfo.num_compressed == 0 && !applycomp)
-				printf("Folder contains no compressed files\n");
-			else if (folderinfo.num_compressed == 0 && applycomp)
-				printf("No compressable files in folder\n");
-			else
-				printf("Number of HFS+ compressed files: %lld\n", folderinfo.num_compressed);
-			if (printVerbose > 0)
-			{
-				printf("Total number of files: %lld\n", folderinfo.num_files);
-				if (hardLinkCheck)
-					printf("Total number of file hard links: %lld\n", folderinfo.num_hard_link_files);
-				printf("Total number of folders: %lld\n", folderinfo.num_folders);
-				if (hardLinkCheck)
-					printf("Total number of folder hard links: %lld\n", folderinfo.num_hard_link_folders);
-				printf("Total number of items (number of files + number of folders): %lld\n", folderinfo.num_files + folderinfo.num_folders);
-				foldersize = folderinfo.uncompressed_size;
-				foldersize_rounded = folderinfo.uncompressed_size_rounded;
-				if ((folderinfo.num_hard_link_files == 0 && folderinfo.num_hard_link_folders == 0) || !hardLinkCheck)
-					printf("Folder size (uncompressed; reported size by Mac OS 10.6+ Finder): %s\n", getSizeStr(foldersize, foldersize_rounded));
-				else
-					printf("Folder size (uncompressed): %s\n", getSizeStr(foldersize, foldersize_rounded));
-				foldersize = folderinfo.compressed_size;
-				foldersize_rounded = folderinfo.compressed_size_rounded;
-				if ((folderinfo.num_hard_link_files == 0 && folderinfo.num_hard_link_folders == 0) || !hardLinkCheck)
-					printf("Folder size (compressed - decmpfs xattr; reported size by Mac OS 10.0-10.5 Finder): %s\n", getSizeStr(foldersize, foldersize_rounded));
-				else
-					printf("Folder size (compressed - decmpfs xattr): %s\n", getSizeStr(foldersize, foldersize_rounded));
-				foldersize = folderinfo.compressed_size + folderinfo.compattr_size;
-				foldersize_rounded = folderinfo.compressed_size_rounded + folderinfo.compattr_size;
-				printf("Folder size (compressed): %s\n", getSizeStr(foldersize, foldersize_rounded));
-				printf("Compression savings: %0.1f%%\n", (1.0 - ((float) (folderinfo.compressed_size + folderinfo.compattr_size) / folderinfo.uncompressed_size)) * 100.0);
-				foldersize = folderinfo.total_size;
-				printf("Appoximate total folder size (files + file overhead + folder overhead): %s\n", getSizeStr(foldersize, foldersize));
-			}
+			printFolderInfo(&folderinfo, TRUE);
 		}
+		if (folderinfo.report != NULL)
+			printDirReport(folderinfo.report);
 	}
 	
+	finishFolderInfo(&folderinfo, ratioCachePath);
 	if (free_src)
 		free(fullpath);
 	if (free_dst)
@@ -0,0 +1,1110 @@
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/param.h>
+#include <sys/mount.h>
+#include <fts.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include <CoreServices/CoreServices.h>
+
+#include "libafsc.h"
+
+const char *afsc_strerror(enum afsc_result result)
+{
+	switch (result)
+	{
+		case AFSC_OK:
+			return "success";
+		case AFSC_SKIPPED_NOT_REGULAR:
+			return "not a regular file";
+		case AFSC_SKIPPED_COMPRESSED:
+			return "file is already compressed";
+		case AFSC_SKIPPED_EMPTY:
+			return "file is empty";
+		case AFSC_SKIPPED_TOO_LARGE:
+			return "file is too large to compress";
+		case AFSC_SKIPPED_HAS_RESOURCE_FORK:
+			return "file already has a resource fork";
+		case AFSC_SKIPPED_NO_SAVINGS:
+			return "compression would not save enough space";
+		case AFSC_NOT_COMPRESSED:
+			return "file is not HFS+ compressed";
+		case AFSC_ERR_UNSUPPORTED_FS:
+			return "file system does not support HFS+ compression";
+		case AFSC_ERR_IO:
+			return "system call failed";
+		case AFSC_ERR_NOMEM:
+			return "out of memory";
+		case AFSC_ERR_MISSING_DECMPFS:
+			return "file flags indicate file is compressed but it does not have a com.apple.decmpfs extended attribute";
+		case AFSC_ERR_MISSING_RESOURCE_FORK:
+			return "resource fork required for compression type 4 but none exists";
+		case AFSC_ERR_BAD_HEADER:
+			return "com.apple.decmpfs header is invalid";
+		case AFSC_ERR_UNKNOWN_TYPE:
+			return "unknown compression type";
+		case AFSC_ERR_TRUNCATED:
+			return "compressed data is incomplete";
+		case AFSC_ERR_BLOCK_TOO_LARGE:
+			return "uncompressed data block too large";
+		case AFSC_ERR_BLOCK_TOO_SMALL:
+			return "uncompressed data block too small";
+		case AFSC_ERR_BLOCK_CORRUPT:
+			return "compressed data block is corrupted";
+		case AFSC_ERR_VERIFY_FAILED:
+			return "compressed file check failed";
+		case AFSC_ERR_BAD_LEVEL:
+			return "compression level must be from 1 to 9";
+	}
+	return "unknown error";
+}
+
+// Compresses one block, storing it raw behind a 0xFF byte if it doesn't shrink
+enum afsc_result afsc_encode_block(void *out, unsigned long int *outSize, const void *in, unsigned long int inSize, int level)
+{
+	int cmpret;
+
+	if (level < 1 || level > 9)
+		return AFSC_ERR_BAD_LEVEL;
+	*outSize = compressBound(AFSC_BLOCK_SIZE);
+	if ((cmpret = compress2(out, outSize, in, inSize, level)) != Z_OK)
+	{
+		if (cmpret == Z_MEM_ERROR)
+			return AFSC_ERR_NOMEM;
+		// out only holds the bound for a block, so anything else means in was more than one
+		return AFSC_ERR_BLOCK_TOO_LARGE;
+	}
+	if (*outSize > inSize)
+	{
+		*(unsigned char *) out = 0xFF;
+		memcpy(out + 1, in, inSize);
+		*outSize = inSize + 1;
+	}
+	return AFSC_OK;
+}
+
+enum afsc_result afsc_decode_block(void *out, unsigned long int outSize, const void *in, unsigned long int inSize)
+{
+	unsigned long int uncmpedsize = outSize;
+	int uncmpret;
+
+	if (inSize > 0 && *(const unsigned char *) in == 0xFF)
+	{
+		if (inSize - 1 > outSize)
+			return AFSC_ERR_BLOCK_TOO_LARGE;
+		uncmpedsize = inSize - 1;
+		memcpy(out, in + 1, uncmpedsize);
+	}
+	else if ((uncmpret = uncompress(out, &uncmpedsize, in, inSize)) != Z_OK)
+	{
+		if (uncmpret == Z_BUF_ERROR)
+			return AFSC_ERR_BLOCK_TOO_LARGE;
+		if (uncmpret == Z_MEM_ERROR)
+			return AFSC_ERR_NOMEM;
+		return AFSC_ERR_BLOCK_CORRUPT;
+	}
+	if (uncmpedsize != outSize)
+		return AFSC_ERR_BLOCK_TOO_SMALL;
+	return AFSC_OK;
+}
+
+void afsc_write_decmpfs_header(void *decmpfs, unsigned int type, long long int size)
+{
+	*(UInt32 *) decmpfs = EndianU32_NtoL(0x636D7066);
+	*(UInt32 *) (decmpfs + 4) = EndianU32_NtoL(type);
+	*(UInt64 *) (decmpfs + 8) = EndianU64_NtoL(size);
+}
+
+void afsc_write_resource_fork_header(void *resourceFork, unsigned int numBlocks, unsigned long int dataEnd)
+{
+	*(UInt32 *) resourceFork = EndianU32_NtoB(0x100);
+	*(UInt32 *) (resourceFork + 4) = EndianU32_NtoB(dataEnd);
+	*(UInt32 *) (resourceFork + 8) = EndianU32_NtoB(dataEnd - 0x100);
+	*(UInt32 *) (resourceFork + 12) = EndianU32_NtoB(0x32);
+	memset(resourceFork + 16, 0, 0xF0);
+	*(UInt32 *) (resourceFork + 0x100) = EndianU32_NtoB(dataEnd - AFSC_BLOCK_TABLE_OFFSET);
+	*(UInt32 *) (resourceFork + AFSC_BLOCK_TABLE_OFFSET) = EndianU32_NtoL(numBlocks);
+}
+
+void afsc_write_resource_fork_trailer(void *trailer)
+{
+	memset(trailer, 0, 24);
+	*(UInt16 *) (trailer + 24) = EndianU16_NtoB(0x1C);
+	*(UInt16 *) (trailer + 26) = EndianU16_NtoB(0x32);
+	*(UInt16 *) (trailer + 28) = 0;
+	*(UInt32 *) (trailer + 30) = EndianU32_NtoB(0x636D7066);
+	*(UInt32 *) (trailer + 34) = EndianU32_NtoB(0xA);
+	*(UInt64 *) (trailer + 38) = EndianU64_NtoL(0xFFFF0100);
+	*(UInt32 *) (trailer + 46) = 0;
+}
+
+void afsc_free_payload(struct afsc_payload *payload)
+{
+	free(payload->decmpfs);
+	free(payload->resource_fork);
+	memset(payload, 0, sizeof(struct afsc_payload));
+}
+
+enum afsc_result afsc_encode_inline(void *decmpfs, size_t *decmpfsSize, void *out, unsigned long int *outSize, const void *data, size_t size, int *level)
+{
+	enum afsc_result result;
+
+	if (*level < 1 || *level > 9)
+		return AFSC_ERR_BAD_LEVEL;
+	if (size > AFSC_BLOCK_SIZE)
+		return AFSC_SKIPPED_TOO_LARGE;
+	if ((result = afsc_encode_block(out, outSize, data, size, *level)) != AFSC_OK)
+		return result;
+	// A block that just misses the inline limit may fit at the strongest level, which saves the resource fork
+	if (*level < 9 && *outSize + AFSC_DECMPFS_HEADER_SIZE > AFSC_MAX_INLINE_SIZE &&
+		*outSize + AFSC_DECMPFS_HEADER_SIZE <= AFSC_MAX_INLINE_SIZE * 3 / 2)
+	{
+		if ((result = afsc_encode_block(out, outSize, data, size, 9)) != AFSC_OK)
+			return result;
+		*level = 9;
+	}
+	if (*outSize + AFSC_DECMPFS_HEADER_SIZE > AFSC_MAX_INLINE_SIZE)
+		return AFSC_SKIPPED_TOO_LARGE;
+	afsc_write_decmpfs_header(decmpfs, 3, size);
+	memcpy(decmpfs + AFSC_DECMPFS_HEADER_SIZE, out, *outSize);
+	*decmpfsSize = AFSC_DECMPFS_HEADER_SIZE + *outSize;
+	return AFSC_OK;
+}
+
+// Data that compresses into the decmpfs xattr is stored inline (type 3); anything else goes in the resource fork (type 4)
+enum afsc_result afsc_encode(const void *data, size_t size, int level, struct afsc_payload *payload)
+{
+	unsigned int numBlocks = (size + AFSC_BLOCK_SIZE - 1) / AFSC_BLOCK_SIZE, currBlock;
+	unsigned long int cmpedsize, blockSize, RFpos;
+	void *outBlock;
+	int inlineLevel;
+	enum afsc_result result;
+
+	memset(payload, 0, sizeof(struct afsc_payload));
+	if (level < 1 || level > 9)
+		return AFSC_ERR_BAD_LEVEL;
+	if (size == 0)
+		return AFSC_SKIPPED_EMPTY;
+	if (size + 0x13A + ((long long int) numBlocks * 9) > 2147483647)
+		return AFSC_SKIPPED_TOO_LARGE;
+	payload->decmpfs = malloc(AFSC_MAX_INLINE_SIZE);
+	outBlock = malloc(compressBound(AFSC_BLOCK_SIZE));
+	if (payload->decmpfs == NULL || outBlock == NULL)
+	{
+		free(outBlock);
+		afsc_free_payload(payload);
+		return AFSC_ERR_NOMEM;
+	}
+	if (numBlocks == 1)
+	{
+		inlineLevel = level;
+		result = afsc_encode_inline(payload->decmpfs, &payload->decmpfs_size, outBlock, &cmpedsize, data, size, &inlineLevel);
+		if (result != AFSC_SKIPPED_TOO_LARGE)
+		{
+			free(outBlock);
+			if (result != AFSC_OK)
+				afsc_free_payload(payload);
+			return result;
+		}
+	}
+
+	payload->resource_fork = malloc(size + 0x13A + (numBlocks * 9));
+	if (payload->resource_fork == NULL)
+	{
+		free(outBlock);
+		afsc_free_payload(payload);
+		return AFSC_ERR_NOMEM;
+	}
+	afsc_write_decmpfs_header(payload->decmpfs, 4, size);
+	payload->decmpfs_size = AFSC_DECMPFS_HEADER_SIZE;
+	RFpos = AFSC_BLOCK_TABLE_OFFSET + 0x4 + (numBlocks * 8);
+	for (currBlock = 0; currBlock < numBlocks; currBlock++)
+	{
+		blockSize = (size - ((size_t) currBlock * AFSC_BLOCK_SIZE) > AFSC_BLOCK_SIZE) ? AFSC_BLOCK_SIZE : size - ((size_t) currBlock * AFSC_BLOCK_SIZE);
+		if ((result = afsc_encode_block(outBlock, &cmpedsize, data + ((size_t) currBlock * AFSC_BLOCK_SIZE), blockSize, level)) != AFSC_OK)
+		{
+			free(outBlock);
+			afsc_free_payload(payload);
+			return result;
+		}
+		memcpy(payload->resource_fork + RFpos, outBlock, cmpedsize);
+		*(UInt32 *) (payload->resource_fork + AFSC_BLOCK_TABLE_OFFSET + 0x4 + (currBlock * 8)) = EndianU32_NtoL(RFpos - AFSC_BLOCK_TABLE_OFFSET);
+		*(UInt32 *) (payload->resource_fork + AFSC_BLOCK_TABLE_OFFSET + 0x8 + (currBlock * 8)) = EndianU32_NtoL(cmpedsize);
+		RFpos += cmpedsize;
+	}
+	free(outBlock);
+	afsc_write_resource_fork_header(payload->resource_fork, numBlocks, RFpos);
+	afsc_write_resource_fork_trailer(payload->resource_fork + RFpos);
+	payload->resource_fork_size = RFpos + AFSC_RESOURCE_FORK_TRAILER_SIZE;
+	return AFSC_OK;
+}
+
+// Checks the decmpfs header, and for type 3 that data follows it; a type 4 file's resource fork is checked apart
+static enum afsc_result afsc_check_decmpfs(const void *decmpfs, size_t decmpfsSize, struct afsc_file_info *info)
+{
+	if (decmpfsSize < AFSC_DECMPFS_HEADER_SIZE || EndianU32_LtoN(*(UInt32 *) decmpfs) != 0x636D7066)
+		return AFSC_ERR_BAD_HEADER;
+	info->compressed = TRUE;
+	info->type = EndianU32_LtoN(*(UInt32 *) (decmpfs + 4));
+	info->size = EndianU64_LtoN(*(UInt64 *) (decmpfs + 8));
+	info->decmpfs_size = decmpfsSize;
+	if (info->size <= 0)
+		return AFSC_ERR_BAD_HEADER;
+
+	if (info->type == 3)
+	{
+		info->num_blocks = 1;
+		if (decmpfsSize == AFSC_DECMPFS_HEADER_SIZE)
+			return AFSC_ERR_TRUNCATED;
+		return AFSC_OK;
+	}
+	if (info->type != 4)
+		return AFSC_ERR_UNKNOWN_TYPE;
+	return AFSC_OK;
+}
+
+// The first word of a resource fork is the offset of its data, where a length and then the block table follow
+static enum afsc_result afsc_check_resource_fork_header(UInt32 dataOffset, long long int resourceForkSize)
+{
+	if (resourceForkSize < 0x13A || resourceForkSize < (long long int) dataOffset + 0x8)
+		return AFSC_ERR_TRUNCATED;
+	return AFSC_OK;
+}
+
+// Checks the block count against the uncompressed size, and that every block lies inside the resource fork
+static enum afsc_result afsc_check_block_table(const void *blockTable, UInt32 blockStartPos, long long int resourceForkSize, struct afsc_file_info *info)
+{
+	UInt32 blockPos, blockSize;
+	unsigned int currBlock;
+
+	info->num_blocks = EndianU32_LtoN(*(UInt32 *) blockTable);
+	if (resourceForkSize < (long long int) blockStartPos + 0x36 + ((long long int) info->num_blocks * 8))
+		return AFSC_ERR_TRUNCATED;
+	if (info->num_blocks == 0 || (long long int) AFSC_BLOCK_SIZE * (info->num_blocks - 1) >= info->size ||
+		(long long int) AFSC_BLOCK_SIZE * info->num_blocks < info->size)
+		return AFSC_ERR_BAD_HEADER;
+	for (currBlock = 0; currBlock < info->num_blocks; currBlock++)
+	{
+		blockPos = EndianU32_LtoN(*(UInt32 *) (blockTable + 0x4 + (currBlock * 8)));
+		blockSize = EndianU32_LtoN(*(UInt32 *) (blockTable + 0x8 + (currBlock * 8)));
+		if ((long long int) blockStartPos + blockPos + blockSize > resourceForkSize)
+		{
+			info->bad_block = currBlock;
+			return AFSC_ERR_TRUNCATED;
+		}
+	}
+	return AFSC_OK;
+}
+
+enum afsc_result afsc_check_payload(const struct afsc_payload *payload, struct afsc_file_info *info)
+{
+	UInt32 blockStartPos;
+	enum afsc_result result;
+
+	memset(info, 0, sizeof(struct afsc_file_info));
+	info->bad_block = -1;
+	if (payload->decmpfs == NULL)
+		return AFSC_ERR_MISSING_DECMPFS;
+	info->resource_fork_size = (payload->resource_fork != NULL) ? payload->resource_fork_size : 0;
+	if ((result = afsc_check_decmpfs(payload->decmpfs, payload->decmpfs_size, info)) != AFSC_OK || info->type == 3)
+		return result;
+	if (payload->resource_fork == NULL || payload->resource_fork_size == 0)
+		return AFSC_ERR_MISSING_RESOURCE_FORK;
+	if (payload->resource_fork_size < 0x13A ||
+		(result = afsc_check_resource_fork_header(EndianU32_BtoN(*(UInt32 *) payload->resource_fork), payload->resource_fork_size)) != AFSC_OK)
+		return AFSC_ERR_TRUNCATED;
+	blockStartPos = EndianU32_BtoN(*(UInt32 *) payload->resource_fork) + 0x4;
+	return afsc_check_block_table(payload->resource_fork + blockStartPos, blockStartPos, payload->resource_fork_size, info);
+}
+
+// Decodes the payload into data, which must hold the uncompressed size from the header; info may be NULL
+enum afsc_result afsc_decode(const struct afsc_payload *payload, void *data, size_t size, struct afsc_file_info *info)
+{
+	struct afsc_file_info localInfo;
+	UInt32 blockStartPos, blockPos, blockSize;
+	unsigned int currBlock;
+	unsigned long int uncmpedsize;
+	enum afsc_result result;
+
+	if (info == NULL)
+		info = &localInfo;
+	if ((result = afsc_check_payload(payload, info)) != AFSC_OK)
+		return result;
+	if (size < info->size)
+		return AFSC_ERR_BLOCK_TOO_LARGE;
+	if (info->type == 3)
+		return afsc_decode_block(data, info->size, payload->decmpfs + AFSC_DECMPFS_HEADER_SIZE, payload->decmpfs_size - AFSC_DECMPFS_HEADER_SIZE);
+
+	blockStartPos = EndianU32_BtoN(*(UInt32 *) payload->resource_fork) + 0x4;
+	for (currBlock = 0; currBlock < info->num_blocks; currBlock++)
+	{
+		blockPos = EndianU32_LtoN(*(UInt32 *) (payload->resource_fork + blockStartPos + 0x4 + (currBlock * 8)));
+		blockSize = EndianU32_LtoN(*(UInt32 *) (payload->resource_fork + blockStartPos + 0x8 + (currBlock * 8)));
+		uncmpedsize = (info->size - ((long long int) currBlock * AFSC_BLOCK_SIZE) < AFSC_BLOCK_SIZE) ? info->size - ((long long int) currBlock * AFSC_BLOCK_SIZE) : AFSC_BLOCK_SIZE;
+		if ((result = afsc_decode_block(data + ((size_t) currBlock * AFSC_BLOCK_SIZE), uncmpedsize, payload->resource_fork + blockStartPos + blockPos, blockSize)) != AFSC_OK)
+		{
+			info->bad_block = currBlock;
+			return result;
+		}
+	}
+	return AFSC_OK;
+}
+
+enum afsc_result afsc_scrub_inline(const void *in, unsigned long int inSize, long long int size, void *scratch)
+{
+	z_stream stream;
+	long long int total = 0;
+	int inflateret;
+
+	if (size <= AFSC_BLOCK_SIZE)
+		return afsc_decode_block(scratch, size, in, inSize);
+	if (inSize > 0 && *(const unsigned char *) in == 0xFF)
+		return (inSize - 1 > size) ? AFSC_ERR_BLOCK_TOO_LARGE : (inSize - 1 < size) ? AFSC_ERR_BLOCK_TOO_SMALL : AFSC_OK;
+	// Inline data written by other tools may still be larger than a block, so it is inflated a block at a time
+	memset(&stream, 0, sizeof(stream));
+	if (inflateInit(&stream) != Z_OK)
+		return AFSC_ERR_NOMEM;
+	stream.next_in = (Bytef *) in;
+	stream.avail_in = inSize;
+	do
+	{
+		stream.next_out = scratch;
+		stream.avail_out = AFSC_BLOCK_SIZE;
+		inflateret = inflate(&stream, Z_NO_FLUSH);
+		total += AFSC_BLOCK_SIZE - stream.avail_out;
+	} while (inflateret == Z_OK && total <= size);
+	inflateEnd(&stream);
+	if (inflateret == Z_MEM_ERROR)
+		return AFSC_ERR_NOMEM;
+	if (total > size)
+		return AFSC_ERR_BLOCK_TOO_LARGE;
+	if (inflateret != Z_STREAM_END)
+		return AFSC_ERR_BLOCK_CORRUPT;
+	return (total < size) ? AFSC_ERR_BLOCK_TOO_SMALL : AFSC_OK;
+}
+
+enum afsc_result afsc_scrub(const struct afsc_payload *payload, void *scratch, struct afsc_file_info *info)
+{
+	struct afsc_file_info localInfo;
+	UInt32 blockStartPos, blockPos, blockSize;
+	unsigned int currBlock;
+	unsigned long int uncmpedsize;
+	enum afsc_result result;
+
+	if (info == NULL)
+		info = &localInfo;
+	if ((result = afsc_check_payload(payload, info)) != AFSC_OK)
+		return result;
+	if (info->type == 3)
+	{
+		if ((result = afsc_scrub_inline(payload->decmpfs + AFSC_DECMPFS_HEADER_SIZE, payload->decmpfs_size - AFSC_DECMPFS_HEADER_SIZE, info->size, scratch)) != AFSC_OK)
+			info->bad_block = 0;
+		return result;
+	}
+
+	blockStartPos = EndianU32_BtoN(*(UInt32 *) payload->resource_fork) + 0x4;
+	for (currBlock = 0; currBlock < info->num_blocks; currBlock++)
+	{
+		blockPos = EndianU32_LtoN(*(UInt32 *) (payload->resource_fork + blockStartPos + 0x4 + (currBlock * 8)));
+		blockSize = EndianU32_LtoN(*(UInt32 *) (payload->resource_fork + blockStartPos + 0x8 + (currBlock * 8)));
+		uncmpedsize = (info->size - ((long long int) currBlock * AFSC_BLOCK_SIZE) < AFSC_BLOCK_SIZE) ? info->size - ((long long int) currBlock * AFSC_BLOCK_SIZE) : AFSC_BLOCK_SIZE;
+		if ((result = afsc_decode_block(scratch, uncmpedsize, payload->resource_fork + blockStartPos + blockPos, blockSize)) != AFSC_OK)
+		{
+			info->bad_block = currBlock;
+			return result;
+		}
+	}
+	return AFSC_OK;
+}
+
+enum afsc_result afsc_read_payload(const char *path, struct afsc_payload *payload)
+{
+	ssize_t xattrsize, getxattrret, RFpos = 0;
+
+	memset(payload, 0, sizeof(struct afsc_payload));
+	xattrsize = getxattr(path, "com.apple.decmpfs", NULL, 0, 0, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW);
+	if (xattrsize < 0)
+		return (errno == ENOATTR) ? AFSC_ERR_MISSING_DECMPFS : AFSC_ERR_IO;
+	if ((payload->decmpfs = malloc(xattrsize + 1)) == NULL)
+		return AFSC_ERR_NOMEM;
+	xattrsize = getxattr(path, "com.apple.decmpfs", payload->decmpfs, xattrsize, 0, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW);
+	if (xattrsize < 0)
+	{
+		afsc_free_payload(payload);
+		return AFSC_ERR_IO;
+	}
+	payload->decmpfs_size = xattrsize;
+
+	xattrsize = getxattr(path, "com.apple.ResourceFork", NULL, 0, 0, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW);
+	if (xattrsize < 0 && errno == ENOATTR)
+		return AFSC_OK;
+	if (xattrsize < 0 || (payload->resource_fork = malloc(xattrsize + 1)) == NULL)
+	{
+		afsc_free_payload(payload);
+		return (xattrsize < 0) ? AFSC_ERR_IO : AFSC_ERR_NOMEM;
+	}
+	// Only the resource fork can be larger than one read, so it is read at increasing positions
+	do
+	{
+		getxattrret = getxattr(path, "com.apple.ResourceFork", payload->resource_fork + RFpos, xattrsize - RFpos, RFpos, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW);
+		if (getxattrret < 0)
+		{
+			afsc_free_payload(payload);
+			return AFSC_ERR_IO;
+		}
+		RFpos += getxattrret;
+	} while (RFpos < xattrsize && getxattrret > 0);
+	payload->resource_fork_size = RFpos;
+	return AFSC_OK;
+}
+
+enum afsc_result afsc_read_resource_fork(const char *path, void *buf, size_t len, size_t pos)
+{
+	ssize_t getxattrret;
+	size_t RFpos = 0;
+
+	do
+	{
+		getxattrret = getxattr(path, "com.apple.ResourceFork", buf + RFpos, len - RFpos, pos + RFpos, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW);
+		if (getxattrret < 0)
+			return AFSC_ERR_IO;
+		RFpos += getxattrret;
+	} while (RFpos < len && getxattrret > 0);
+	return (RFpos < len) ? AFSC_ERR_TRUNCATED : AFSC_OK;
+}
+
+void afsc_free_layout(struct afsc_layout *layout)
+{
+	free(layout->decmpfs);
+	free(layout->block_table);
+	memset(layout, 0, sizeof(struct afsc_layout));
+}
+
+enum afsc_result afsc_read_layout(const char *path, struct afsc_layout *layout, struct afsc_file_info *info)
+{
+	ssize_t xattrsize;
+	UInt32 dataOffset, numBlocks = 0;
+	enum afsc_result result;
+
+	memset(layout, 0, sizeof(struct afsc_layout));
+	memset(info, 0, sizeof(struct afsc_file_info));
+	info->bad_block = -1;
+	xattrsize = getxattr(path, "com.apple.decmpfs", NULL, 0, 0, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW);
+	if (xattrsize < 0)
+		return (errno == ENOATTR) ? AFSC_ERR_MISSING_DECMPFS : AFSC_ERR_IO;
+	if ((layout->decmpfs = malloc(xattrsize + 1)) == NULL)
+		return AFSC_ERR_NOMEM;
+	if ((xattrsize = getxattr(path, "com.apple.decmpfs", layout->decmpfs, xattrsize, 0, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW)) < 0)
+	{
+		afsc_free_layout(layout);
+		return AFSC_ERR_IO;
+	}
+	layout->decmpfs_size = xattrsize;
+	if ((result = afsc_check_decmpfs(layout->decmpfs, layout->decmpfs_size, info)) != AFSC_OK || info->type == 3)
+	{
+		if (result != AFSC_OK)
+			afsc_free_layout(layout);
+		return result;
+	}
+
+	xattrsize = getxattr(path, "com.apple.ResourceFork", NULL, 0, 0, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW);
+	if (xattrsize < 0)
+		result = (errno == ENOATTR) ? AFSC_ERR_MISSING_RESOURCE_FORK : AFSC_ERR_IO;
+	else if (xattrsize == 0)
+		result = AFSC_ERR_MISSING_RESOURCE_FORK;
+	else if (xattrsize < 0x13A)
+		result = AFSC_ERR_TRUNCATED;
+	layout->resource_fork_size = info->resource_fork_size = (xattrsize > 0) ? xattrsize : 0;
+	if (result == AFSC_OK)
+		result = afsc_read_resource_fork(path, &dataOffset, 4, 0);
+	if (result == AFSC_OK)
+		result = afsc_check_resource_fork_header(EndianU32_BtoN(dataOffset), layout->resource_fork_size);
+	if (result == AFSC_OK)
+	{
+		layout->block_start = EndianU32_BtoN(dataOffset) + 0x4;
+		result = afsc_read_resource_fork(path, &numBlocks, 4, layout->block_start);
+		numBlocks = EndianU32_LtoN(numBlocks);
+	}
+	// The count has to fit in the resource fork before a table that size is allocated
+	if (result == AFSC_OK && layout->resource_fork_size < (long long int) layout->block_start + 0x36 + ((long long int) numBlocks * 8))
+		result = AFSC_ERR_TRUNCATED;
+	if (result == AFSC_OK && (layout->block_table = malloc(0x4 + ((size_t) numBlocks * 8))) == NULL)
+		result = AFSC_ERR_NOMEM;
+	if (result == AFSC_OK)
+		result = afsc_read_resource_fork(path, layout->block_table, 0x4 + ((size_t) numBlocks * 8), layout->block_start);
+	if (result == AFSC_OK)
+		result = afsc_check_block_table(layout->block_table, layout->block_start, layout->resource_fork_size, info);
+	if (result != AFSC_OK)
+		afsc_free_layout(layout);
+	return result;
+}
+
+enum afsc_result afsc_alloc_block_buffers(struct afsc_block_buffers *buffers)
+{
+	buffers->in_size = 0x100000;
+	buffers->in = malloc(buffers->in_size);
+	buffers->out = malloc(AFSC_BLOCK_SIZE);
+	if (buffers->in == NULL || buffers->out == NULL)
+	{
+		afsc_free_block_buffers(buffers);
+		return AFSC_ERR_NOMEM;
+	}
+	return AFSC_OK;
+}
+
+void afsc_free_block_buffers(struct afsc_block_buffers *buffers)
+{
+	free(buffers->in);
+	free(buffers->out);
+	buffers->in = buffers->out = NULL;
+}
+
+enum afsc_result afsc_decode_blocks(const char *path, const struct afsc_layout *layout, long long int size, struct afsc_block_buffers *buffers,
+									unsigned int firstBlock, unsigned int endBlock, int outFd, long int *badBlock)
+{
+	unsigned int currBlock, lastBlock;
+	unsigned long int uncmpedsize;
+	UInt32 blockPos, blockSize, readStart = 0, readLen = 0;
+	ssize_t written;
+	enum afsc_result result;
+
+	for (currBlock = firstBlock; currBlock < endBlock; currBlock++)
+	{
+		blockPos = layout->block_start + EndianU32_LtoN(*(UInt32 *) (layout->block_table + 0x4 + (currBlock * 8)));
+		blockSize = EndianU32_LtoN(*(UInt32 *) (layout->block_table + 0x8 + (currBlock * 8)));
+		if (blockPos < readStart || blockPos + blockSize > readStart + readLen)
+		{
+			// No block that inflates to at most AFSC_BLOCK_SIZE comes near the size of the read buffer
+			if (blockSize > buffers->in_size)
+			{
+				if (badBlock != NULL)
+					*badBlock = currBlock;
+				return AFSC_ERR_BLOCK_CORRUPT;
+			}
+			// Fetch this block together with as many of the following blocks as fit in the read buffer
+			readStart = blockPos;
+			readLen = blockSize;
+			for (lastBlock = currBlock + 1; lastBlock < endBlock; lastBlock++)
+			{
+				blockPos = layout->block_start + EndianU32_LtoN(*(UInt32 *) (layout->block_table + 0x4 + (lastBlock * 8)));
+				blockSize = EndianU32_LtoN(*(UInt32 *) (layout->block_table + 0x8 + (lastBlock * 8)));
+				if (blockPos < readStart || blockPos + blockSize - readStart > buffers->in_size)
+					break;
+				if (blockPos + blockSize - readStart > readLen)
+					readLen = blockPos + blockSize - readStart;
+			}
+			if ((result = afsc_read_resource_fork(path, buffers->in, readLen, readStart)) != AFSC_OK)
+				return result;
+			blockPos = layout->block_start + EndianU32_LtoN(*(UInt32 *) (layout->block_table + 0x4 + (currBlock * 8)));
+			blockSize = EndianU32_LtoN(*(UInt32 *) (layout->block_table + 0x8 + (currBlock * 8)));
+		}
+		uncmpedsize = (size - ((long long int) currBlock * AFSC_BLOCK_SIZE) < AFSC_BLOCK_SIZE) ? size - ((long long int) currBlock * AFSC_BLOCK_SIZE) : AFSC_BLOCK_SIZE;
+		if ((result = afsc_decode_block(buffers->out, uncmpedsize, buffers->in + blockPos - readStart, blockSize)) != AFSC_OK)
+		{
+			if (badBlock != NULL)
+				*badBlock = currBlock;
+			return result;
+		}
+		if (outFd >= 0 && (written = pwrite(outFd, buffers->out, uncmpedsize, (off_t) currBlock * AFSC_BLOCK_SIZE)) != (ssize_t) uncmpedsize)
+		{
+			if (written >= 0)
+				errno = EIO;
+			return AFSC_ERR_IO;
+		}
+	}
+	return AFSC_OK;
+}
+
+struct afsc_decode_workers
+{
+	pthread_mutex_t lock;
+	const char *path;
+	const struct afsc_layout *layout;
+	long long int size;
+	int outFd;
+	unsigned int numBlocks;
+	unsigned int nextBlock;
+	enum afsc_result result;
+	int savedErrno;
+	long int bad_block;
+};
+
+static void *afsc_decode_worker(void *arg)
+{
+	struct afsc_decode_workers *workers = arg;
+	struct afsc_block_buffers buffers;
+	unsigned int firstBlock, endBlock;
+	long int badBlock = -1;
+	enum afsc_result result;
+
+	result = afsc_alloc_block_buffers(&buffers);
+	while (result == AFSC_OK)
+	{
+		pthread_mutex_lock(&workers->lock);
+		if (workers->result != AFSC_OK || workers->nextBlock >= workers->numBlocks)
+		{
+			pthread_mutex_unlock(&workers->lock);
+			break;
+		}
+		firstBlock = workers->nextBlock;
+		endBlock = (workers->numBlocks - firstBlock > 16) ? firstBlock + 16 : workers->numBlocks;
+		workers->nextBlock = endBlock;
+		pthread_mutex_unlock(&workers->lock);
+
+		result = afsc_decode_blocks(workers->path, workers->layout, workers->size, &buffers, firstBlock, endBlock, workers->outFd, &badBlock);
+	}
+	if (result != AFSC_OK)
+	{
+		pthread_mutex_lock(&workers->lock);
+		if (workers->result == AFSC_OK)
+		{
+			workers->result = result;
+			workers->savedErrno = errno;
+			workers->bad_block = badBlock;
+		}
+		pthread_mutex_unlock(&workers->lock);
+	}
+	afsc_free_block_buffers(&buffers);
+	return NULL;
+}
+
+enum afsc_result afsc_decode_resource_fork(const char *path, const struct afsc_layout *layout, long long int size, int outFd, int numThreads, long int *badBlock)
+{
+	struct afsc_decode_workers workers;
+	struct afsc_block_buffers buffers;
+	pthread_t threads[64];
+	unsigned int numBlocks = EndianU32_LtoN(*(UInt32 *) layout->block_table);
+	long int currThread;
+	fstore_t fstore;
+	enum afsc_result result;
+
+	// Reserve the whole file up front so it can be laid out in one extent while blocks arrive out of order
+	fstore.fst_flags = F_ALLOCATECONTIG | F_ALLOCATEALL;
+	fstore.fst_posmode = F_PEOFPOSMODE;
+	fstore.fst_offset = 0;
+	fstore.fst_length = size;
+	fstore.fst_bytesalloc = 0;
+	if (fcntl(outFd, F_PREALLOCATE, &fstore) < 0)
+	{
+		fstore.fst_flags = F_ALLOCATEALL;
+		fcntl(outFd, F_PREALLOCATE, &fstore);
+	}
+
+	// Each worker claims runs of 16 blocks (1 MiB of output) at a time
+	if (numThreads <= 0)
+		numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (numThreads > (numBlocks + 15) / 16)
+		numThreads = (numBlocks + 15) / 16;
+	if (numThreads > 64)
+		numThreads = 64;
+	if (numThreads > 1)
+	{
+		pthread_mutex_init(&workers.lock, NULL);
+		workers.path = path;
+		workers.layout = layout;
+		workers.size = size;
+		workers.outFd = outFd;
+		workers.numBlocks = numBlocks;
+		workers.nextBlock = 0;
+		workers.result = AFSC_OK;
+		workers.savedErrno = 0;
+		workers.bad_block = -1;
+		for (currThread = 0; currThread < numThreads; currThread++)
+		{
+			if (pthread_create(&threads[currThread], NULL, afsc_decode_worker, &workers) != 0)
+				break;
+		}
+		numThreads = currThread;
+		for (currThread = 0; currThread < numThreads; currThread++)
+			pthread_join(threads[currThread], NULL);
+		pthread_mutex_destroy(&workers.lock);
+		if (numThreads > 0)
+		{
+			if (workers.result != AFSC_OK)
+			{
+				if (badBlock != NULL)
+					*badBlock = workers.bad_block;
+				errno = workers.savedErrno;
+			}
+			return workers.result;
+		}
+	}
+
+	if ((result = afsc_alloc_block_buffers(&buffers)) != AFSC_OK)
+		return result;
+	result = afsc_decode_blocks(path, layout, size, &buffers, 0, numBlocks, outFd, badBlock);
+	afsc_free_block_buffers(&buffers);
+	return result;
+}
+
+enum afsc_result afsc_inspect_file(const char *path, struct afsc_file_info *info)
+{
+	struct stat fileinfo;
+	struct afsc_payload payload;
+	enum afsc_result result;
+
+	memset(info, 0, sizeof(struct afsc_file_info));
+	info->bad_block = -1;
+	if (lstat(path, &fileinfo) < 0)
+		return AFSC_ERR_IO;
+	if (!S_ISREG(fileinfo.st_mode))
+		return AFSC_SKIPPED_NOT_REGULAR;
+	info->size = fileinfo.st_size;
+	if ((fileinfo.st_flags & UF_COMPRESSED) == 0)
+		return AFSC_OK;
+	if ((result = afsc_read_payload(path, &payload)) != AFSC_OK)
+	{
+		info->compressed = TRUE;
+		return result;
+	}
+	result = afsc_check_payload(&payload, info);
+	afsc_free_payload(&payload);
+	return result;
+}
+
+static bool afsc_read_data(int fd, void *data, size_t size)
+{
+	size_t pos = 0;
+	ssize_t readret;
+
+	while (pos < size)
+	{
+		if ((readret = pread(fd, data + pos, size - pos, pos)) <= 0)
+		{
+			if (readret == 0)
+				errno = EIO;
+			return FALSE;
+		}
+		pos += readret;
+	}
+	return TRUE;
+}
+
+// Puts the uncompressed data back in the data fork once the compressed xattrs are gone or no longer apply
+static bool afsc_restore_data(const char *path, const void *data, size_t size)
+{
+	int fd;
+	bool ok;
+
+	if ((fd = open(path, O_WRONLY | O_TRUNC | O_NOFOLLOW)) < 0)
+		return FALSE;
+	ok = (pwrite(fd, data, size, 0) == (ssize_t) size);
+	close(fd);
+	return ok;
+}
+
+enum afsc_result afsc_commit_payload(const char *path, const struct stat *fileinfo, const struct afsc_payload *payload, const void *data, bool verify)
+{
+	struct stat checkinfo;
+	void *check;
+	int fd, savedErrno;
+	enum afsc_result result = AFSC_OK;
+
+	// XATTR_CREATE makes sure a resource fork that was already there is never overwritten, nor removed below
+	if (payload->resource_fork != NULL &&
+		setxattr(path, "com.apple.ResourceFork", payload->resource_fork, payload->resource_fork_size, 0, XATTR_NOFOLLOW | XATTR_CREATE) < 0)
+		return AFSC_ERR_IO;
+	if (setxattr(path, "com.apple.decmpfs", payload->decmpfs, payload->decmpfs_size, 0, XATTR_NOFOLLOW | XATTR_CREATE) < 0)
+	{
+		savedErrno = errno;
+		if (payload->resource_fork != NULL)
+			removexattr(path, "com.apple.ResourceFork", XATTR_NOFOLLOW | XATTR_SHOWCOMPRESSION);
+		errno = savedErrno;
+		return AFSC_ERR_IO;
+	}
+	if (truncate(path, 0) < 0 || chflags(path, UF_COMPRESSED | fileinfo->st_flags) < 0)
+	{
+		savedErrno = errno;
+		removexattr(path, "com.apple.decmpfs", XATTR_NOFOLLOW | XATTR_SHOWCOMPRESSION);
+		if (payload->resource_fork != NULL)
+			removexattr(path, "com.apple.ResourceFork", XATTR_NOFOLLOW | XATTR_SHOWCOMPRESSION);
+		afsc_restore_data(path, data, fileinfo->st_size);
+		errno = savedErrno;
+		return AFSC_ERR_IO;
+	}
+	if (verify)
+	{
+		check = malloc(fileinfo->st_size);
+		fd = open(path, O_RDONLY | O_NOFOLLOW);
+		if (check == NULL || fd < 0 || lstat(path, &checkinfo) < 0 || checkinfo.st_size != fileinfo->st_size ||
+			!afsc_read_data(fd, check, fileinfo->st_size) || memcmp(check, data, fileinfo->st_size) != 0)
+		{
+			chflags(path, (~UF_COMPRESSED) & fileinfo->st_flags);
+			removexattr(path, "com.apple.decmpfs", XATTR_NOFOLLOW | XATTR_SHOWCOMPRESSION);
+			if (payload->resource_fork != NULL)
+				removexattr(path, "com.apple.ResourceFork", XATTR_NOFOLLOW | XATTR_SHOWCOMPRESSION);
+			afsc_restore_data(path, data, fileinfo->st_size);
+			result = AFSC_ERR_VERIFY_FAILED;
+		}
+		if (fd >= 0)
+			close(fd);
+		free(check);
+	}
+	return result;
+}
+
+enum afsc_result afsc_compress_file(const char *path, const struct afsc_options *options, struct afsc_file_info *info)
+{
+	struct stat fileinfo;
+	struct statfs fsInfo;
+	struct timeval times[2];
+	struct afsc_payload payload;
+	void *data;
+	int fd, savedErrno;
+	enum afsc_result result;
+
+	memset(info, 0, sizeof(struct afsc_file_info));
+	info->bad_block = -1;
+	if (options->level < 1 || options->level > 9)
+		return AFSC_ERR_BAD_LEVEL;
+	if (lstat(path, &fileinfo) < 0)
+		return AFSC_ERR_IO;
+	info->size = fileinfo.st_size;
+	if (!S_ISREG(fileinfo.st_mode))
+		return AFSC_SKIPPED_NOT_REGULAR;
+	if ((fileinfo.st_flags & UF_COMPRESSED) != 0)
+		return AFSC_SKIPPED_COMPRESSED;
+	if (fileinfo.st_size == 0)
+		return AFSC_SKIPPED_EMPTY;
+	if (options->max_size != 0 && fileinfo.st_size > options->max_size)
+		return AFSC_SKIPPED_TOO_LARGE;
+	if (statfs(path, &fsInfo) < 0)
+		return AFSC_ERR_IO;
+	if (fsInfo.f_type != 17 && fsInfo.f_type != 23 && fsInfo.f_type != 24)
+		return AFSC_ERR_UNSUPPORTED_FS;
+	if (getxattr(path, "com.apple.ResourceFork", NULL, 0, 0, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW) >= 0 ||
+		getxattr(path, "com.apple.decmpfs", NULL, 0, 0, XATTR_SHOWCOMPRESSION | XATTR_NOFOLLOW) >= 0)
+		return AFSC_SKIPPED_HAS_RESOURCE_FORK;
+	times[0].tv_sec = fileinfo.st_atimespec.tv_sec;
+	times[0].tv_usec = fileinfo.st_atimespec.tv_nsec / 1000;
+	times[1].tv_sec = fileinfo.st_mtimespec.tv_sec;
+	times[1].tv_usec = fileinfo.st_mtimespec.tv_nsec / 1000;
+
+	if ((fd = open(path, O_RDONLY | O_NOFOLLOW)) < 0)
+		return AFSC_ERR_IO;
+	if ((data = malloc(fileinfo.st_size)) == NULL)
+	{
+		close(fd);
+		return AFSC_ERR_NOMEM;
+	}
+	if (!afsc_read_data(fd, data, fileinfo.st_size))
+	{
+		savedErrno = errno;
+		close(fd);
+		free(data);
+		errno = savedErrno;
+		return AFSC_ERR_IO;
+	}
+	close(fd);
+	if ((result = afsc_encode(data, fileinfo.st_size, options->level, &payload)) != AFSC_OK)
+	{
+		free(data);
+		return result;
+	}
+	// Inline data always saves the data fork's blocks; a resource fork has to save min_savings percent
+	if (payload.resource_fork != NULL &&
+		((((double) payload.resource_fork_size / fileinfo.st_size) >= (1.0 - options->min_savings / 100) && options->min_savings != 0.0) ||
+		 payload.resource_fork_size >= fileinfo.st_size))
+	{
+		afsc_free_payload(&payload);
+		free(data);
+		return AFSC_SKIPPED_NO_SAVINGS;
+	}
+	afsc_check_payload(&payload, info);
+	result = afsc_commit_payload(path, &fileinfo, &payload, data, options->verify);
+	if (result != AFSC_OK)
+		info->compressed = FALSE;
+	utimes(path, times);
+	afsc_free_payload(&payload);
+	free(data);
+	return result;
+}
+
+enum afsc_result afsc_decompress_file(const char *path, int numThreads, struct afsc_file_info *info)
+{
+	struct stat fileinfo;
+	struct timeval times[2];
+	struct afsc_layout layout;
+	void *data = NULL;
+	ssize_t written;
+	int fd, savedErrno;
+	enum afsc_result result;
+
+	memset(info, 0, sizeof(struct afsc_file_info));
+	info->bad_block = -1;
+	if (lstat(path, &fileinfo) < 0)
+		return AFSC_ERR_IO;
+	info->size = fileinfo.st_size;
+	if (!S_ISREG(fileinfo.st_mode))
+		return AFSC_SKIPPED_NOT_REGULAR;
+	if ((fileinfo.st_flags & UF_COMPRESSED) == 0)
+		return AFSC_NOT_COMPRESSED;
+	times[0].tv_sec = fileinfo.st_atimespec.tv_sec;
+	times[0].tv_usec = fileinfo.st_atimespec.tv_nsec / 1000;
+	times[1].tv_sec = fileinfo.st_mtimespec.tv_sec;
+	times[1].tv_usec = fileinfo.st_mtimespec.tv_nsec / 1000;
+
+	if ((result = afsc_read_layout(path, &layout, info)) != AFSC_OK)
+		return result;
+	// Inline data is decoded before the file is touched; a resource fork is decoded straight into the file, which is
+	// emptied again if that fails, so either way damaged data leaves the compressed file as it was
+	if (info->type == 3)
+	{
+		if ((data = malloc(info->size)) == NULL)
+		{
+			afsc_free_layout(&layout);
+			return AFSC_ERR_NOMEM;
+		}
+		if ((result = afsc_decode_block(data, info->size, layout.decmpfs + AFSC_DECMPFS_HEADER_SIZE, layout.decmpfs_size - AFSC_DECMPFS_HEADER_SIZE)) != AFSC_OK)
+		{
+			info->bad_block = 0;
+			afsc_free_layout(&layout);
+			free(data);
+			return result;
+		}
+	}
+	if (chflags(path, (~UF_COMPRESSED) & fileinfo.st_flags) < 0)
+		result = AFSC_ERR_IO;
+	else if ((fd = open(path, O_WRONLY | O_NOFOLLOW)) < 0)
+	{
+		savedErrno = errno;
+		chflags(path, fileinfo.st_flags);
+		errno = savedErrno;
+		result = AFSC_ERR_IO;
+	}
+	else
+	{
+		if (info->type == 4)
+			result = afsc_decode_resource_fork(path, &layout, info->size, fd, numThreads, &info->bad_block);
+		else if ((written = pwrite(fd, data, info->size, 0)) != info->size)
+		{
+			if (written >= 0)
+				errno = EIO;
+			result = AFSC_ERR_IO;
+		}
+		if (result != AFSC_OK)
+		{
+			savedErrno = errno;
+			ftruncate(fd, 0);
+			close(fd);
+			chflags(path, fileinfo.st_flags);
+			errno = savedErrno;
+		}
+		else
+		{
+			close(fd);
+			removexattr(path, "com.apple.decmpfs", XATTR_NOFOLLOW | XATTR_SHOWCOMPRESSION);
+			if (info->type == 4)
+				removexattr(path, "com.apple.ResourceFork", XATTR_NOFOLLOW | XATTR_SHOWCOMPRESSION);
+			info->compressed = FALSE;
+		}
+	}
+	utimes(path, times);
+	afsc_free_layout(&layout);
+	free(data);
+	return result;
+}
+
+enum afsc_result afsc_scrub_file(const char *path, struct afsc_block_buffers *buffers, struct afsc_file_info *info)
+{
+	struct stat fileinfo;
+	struct afsc_layout layout;
+	enum afsc_result result;
+
+	memset(info, 0, sizeof(struct afsc_file_info));
+	info->bad_block = -1;
+	if (lstat(path, &fileinfo) < 0)
+		return AFSC_ERR_IO;
+	info->size = fileinfo.st_size;
+	if (!S_ISREG(fileinfo.st_mode))
+		return AFSC_SKIPPED_NOT_REGULAR;
+	if ((fileinfo.st_flags & UF_COMPRESSED) == 0)
+		return AFSC_NOT_COMPRESSED;
+	if ((result = afsc_read_layout(path, &layout, info)) != AFSC_OK)
+	{
+		info->compressed = TRUE;
+		if (info->size <= 0)
+			info->size = fileinfo.st_size;
+		return result;
+	}
+	// Only the block table is held for the whole file; the blocks are read in runs that fit in buffers->in
+	if (info->type == 3)
+	{
+		if ((result = afsc_scrub_inline(layout.decmpfs + AFSC_DECMPFS_HEADER_SIZE, layout.decmpfs_size - AFSC_DECMPFS_HEADER_SIZE, info->size, buffers->out)) != AFSC_OK)
+			info->bad_block = 0;
+	}
+	else
+		result = afsc_decode_blocks(path, &layout, info->size, buffers, 0, info->num_blocks, -1, &info->bad_block);
+	afsc_free_layout(&layout);
+	return result;
+}
+
+enum afsc_result afsc_walk(const char *path, enum afsc_operation operation, const struct afsc_options *options, afsc_walk_callback callback, void *context)
+{
+	char *paths[2];
+	FTS *currfolder;
+	FTSENT *currfile;
+	struct afsc_file_info info;
+	enum afsc_result result, walkResult = AFSC_OK;
+	struct afsc_block_buffers buffers;
+	int savedErrno;
+
+	// A bad level would fail every file the same way, so it fails the walk before it starts
+	if (operation == AFSC_COMPRESS && (options->level < 1 || options->level > 9))
+		return AFSC_ERR_BAD_LEVEL;
+	paths[0] = (char *) path;
+	paths[1] = NULL;
+	memset(&buffers, 0, sizeof(buffers));
+	if (operation == AFSC_SCRUB && afsc_alloc_block_buffers(&buffers) != AFSC_OK)
+		return AFSC_ERR_NOMEM;
+	if ((currfolder = fts_open(paths, FTS_PHYSICAL | FTS_NOCHDIR, NULL)) == NULL)
+	{
+		savedErrno = errno;
+		afsc_free_block_buffers(&buffers);
+		errno = savedErrno;
+		return AFSC_ERR_IO;
+	}
+	for (errno = 0; (currfile = fts_read(currfolder)) != NULL; errno = 0)
+	{
+		// Entries that couldn't be read are passed on with errno set to why, and make the walk as a whole fail
+		if (currfile->fts_info == FTS_DNR || currfile->fts_info == FTS_NS || currfile->fts_info == FTS_ERR)
+		{
+			memset(&info, 0, sizeof(struct afsc_file_info));
+			info.bad_block = -1;
+			walkResult = AFSC_ERR_IO;
+			errno = currfile->fts_errno;
+			if (callback != NULL && !callback(currfile->fts_path, NULL, AFSC_ERR_IO, &info, context))
+				break;
+			continue;
+		}
+		if (currfile->fts_info != FTS_F)
+			continue;
+		if (operation == AFSC_COMPRESS)
+			result = afsc_compress_file(currfile->fts_path, options, &info);
+		else if (operation == AFSC_DECOMPRESS)
+			result = afsc_decompress_file(currfile->fts_path, 1, &info);
+		else if (operation == AFSC_SCRUB)
+			result = afsc_scrub_file(currfile->fts_path, &buffers, &info);
+		else
+			result = afsc_inspect_file(currfile->fts_path, &info);
+		if (callback != NULL && !callback(currfile->fts_path, currfile->fts_statp, result, &info, context))
+			break;
+	}
+	// fts_read also returns NULL when it fails, with errno set
+	if (currfile == NULL && errno != 0)
+		walkResult = AFSC_ERR_IO;
+	savedErrno = errno;
+	fts_close(currfolder);
+	afsc_free_block_buffers(&buffers);
+	errno = savedErrno;
+	return walkResult;
+}
@@ -0,0 +1,169 @@
+// libafsc: reading and writing HFS+ compressed (decmpfs) files without the afsctool command line around it.
+// Nothing in the library keeps state between calls or prints anything; every function reports what happened through
+// its result, with errno left as the failing call set it for AFSC_ERR_IO, so any number of threads may use it at once.
+// Callers describe AFSC_ERR_IO from errno themselves (with strerror_r where threads share the process).
+
+#ifndef LIBAFSC_H
+#define LIBAFSC_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// Data is compressed in blocks of this size; a block stored raw (because it didn't shrink) starts with a 0xFF byte
+#define AFSC_BLOCK_SIZE 0x10000
+// Compressed data up to this size (including the 16 byte header) is kept in the decmpfs xattr instead of a resource fork
+#define AFSC_MAX_INLINE_SIZE 3802
+#define AFSC_DECMPFS_HEADER_SIZE 0x10
+// The block count and block table of a resource fork start here, after the resource fork header
+#define AFSC_BLOCK_TABLE_OFFSET 0x104
+#define AFSC_RESOURCE_FORK_TRAILER_SIZE 50
+
+enum afsc_result
+{
+	AFSC_OK = 0,
+	AFSC_SKIPPED_NOT_REGULAR,
+	AFSC_SKIPPED_COMPRESSED,
+	AFSC_SKIPPED_EMPTY,
+	AFSC_SKIPPED_TOO_LARGE,
+	AFSC_SKIPPED_HAS_RESOURCE_FORK,
+	AFSC_SKIPPED_NO_SAVINGS,
+	AFSC_NOT_COMPRESSED,
+	AFSC_ERR_UNSUPPORTED_FS,
+	AFSC_ERR_IO,
+	AFSC_ERR_NOMEM,
+	AFSC_ERR_MISSING_DECMPFS,
+	AFSC_ERR_MISSING_RESOURCE_FORK,
+	AFSC_ERR_BAD_HEADER,
+	AFSC_ERR_UNKNOWN_TYPE,
+	AFSC_ERR_TRUNCATED,
+	AFSC_ERR_BLOCK_TOO_LARGE,
+	AFSC_ERR_BLOCK_TOO_SMALL,
+	AFSC_ERR_BLOCK_CORRUPT,
+	AFSC_ERR_VERIFY_FAILED,
+	AFSC_ERR_BAD_LEVEL
+};
+
+// The compressed form of some data: the decmpfs xattr, and the resource fork if the data didn't fit inline
+struct afsc_payload
+{
+	void *decmpfs;
+	size_t decmpfs_size;
+	void *resource_fork;
+	size_t resource_fork_size;
+};
+
+struct afsc_options
+{
+	// 1 to 9; anything else fails with AFSC_ERR_BAD_LEVEL
+	int level;
+	double min_savings;
+	long long int max_size;
+	bool verify;
+};
+
+// Where a compressed file's data lies, without the data itself: the decmpfs xattr and, for type 4, the resource fork's
+// block table (the block count, then each block's offset from block_start and size, as stored)
+struct afsc_layout
+{
+	void *decmpfs;
+	size_t decmpfs_size;
+	long long int resource_fork_size;
+	unsigned int block_start;
+	void *block_table;
+};
+
+// What one thread decoding a resource fork reads runs of blocks into (in) and decodes each block into (out)
+struct afsc_block_buffers
+{
+	void *in;
+	size_t in_size;
+	void *out;
+};
+
+struct afsc_file_info
+{
+	bool compressed;
+	unsigned int type;
+	long long int size;
+	long long int decmpfs_size;
+	long long int resource_fork_size;
+	unsigned int num_blocks;
+	// For the block errors, the index of the block that failed
+	long int bad_block;
+};
+
+enum afsc_operation
+{
+	AFSC_INSPECT,
+	AFSC_COMPRESS,
+	AFSC_DECOMPRESS,
+	AFSC_SCRUB
+};
+
+// Called for each regular file a walk comes to, with the result of the operation on it, and with AFSC_ERR_IO and a NULL
+// fileinfo for anything the walk couldn't read; returning false ends the walk
+typedef bool (*afsc_walk_callback)(const char *path, const struct stat *fileinfo, enum afsc_result result, const struct afsc_file_info *info, void *context);
+
+// Always a fixed string; for AFSC_ERR_IO the reason is in errno
+const char *afsc_strerror(enum afsc_result result);
+
+// Block level: out must hold compressBound(AFSC_BLOCK_SIZE) bytes for encoding, and exactly outSize bytes are
+// expected back when decoding
+enum afsc_result afsc_encode_block(void *out, unsigned long int *outSize, const void *in, unsigned long int inSize, int level);
+enum afsc_result afsc_decode_block(void *out, unsigned long int outSize, const void *in, unsigned long int inSize);
+
+// Layout helpers for writers that build the xattrs themselves; dataEnd is the offset just past the last compressed block
+void afsc_write_decmpfs_header(void *decmpfs, unsigned int type, long long int size);
+void afsc_write_resource_fork_header(void *resourceFork, unsigned int numBlocks, unsigned long int dataEnd);
+void afsc_write_resource_fork_trailer(void *trailer);
+
+// Buffer level
+// Compresses data of at most one block into decmpfs (AFSC_MAX_INLINE_SIZE bytes) after a type 3 header if it fits there,
+// trying again at level 9 if it only just misses; *level is set to the level used. If it doesn't fit, the result is
+// AFSC_SKIPPED_TOO_LARGE and the compressed block is left in out (compressBound(AFSC_BLOCK_SIZE) bytes) for a resource fork
+enum afsc_result afsc_encode_inline(void *decmpfs, size_t *decmpfsSize, void *out, unsigned long int *outSize, const void *data, size_t size, int *level);
+enum afsc_result afsc_encode(const void *data, size_t size, int level, struct afsc_payload *payload);
+enum afsc_result afsc_check_payload(const struct afsc_payload *payload, struct afsc_file_info *info);
+enum afsc_result afsc_decode(const struct afsc_payload *payload, void *data, size_t size, struct afsc_file_info *info);
+// Decodes every block into scratch, which must hold AFSC_BLOCK_SIZE bytes, only to check that each one inflates to its size
+enum afsc_result afsc_scrub(const struct afsc_payload *payload, void *scratch, struct afsc_file_info *info);
+// The same check for type 3 data; data larger than a block (as other tools may write) is inflated through scratch in turns
+enum afsc_result afsc_scrub_inline(const void *in, unsigned long int inSize, long long int size, void *scratch);
+void afsc_free_payload(struct afsc_payload *payload);
+
+// File level
+enum afsc_result afsc_read_payload(const char *path, struct afsc_payload *payload);
+// Reads len bytes of the resource fork from pos, failing with AFSC_ERR_TRUNCATED if it ends first
+enum afsc_result afsc_read_resource_fork(const char *path, void *buf, size_t len, size_t pos);
+// Reads and checks a compressed file's decmpfs xattr and block table, leaving the blocks in the resource fork
+enum afsc_result afsc_read_layout(const char *path, struct afsc_layout *layout, struct afsc_file_info *info);
+void afsc_free_layout(struct afsc_layout *layout);
+enum afsc_result afsc_alloc_block_buffers(struct afsc_block_buffers *buffers);
+void afsc_free_block_buffers(struct afsc_block_buffers *buffers);
+// Decodes blocks firstBlock up to endBlock of a type 4 file of the given uncompressed size, writing each to outFd at its
+// place in the file, or only checking them if outFd is -1; neighbouring blocks are read from the resource fork together,
+// as many as fit in buffers->in
+enum afsc_result afsc_decode_blocks(const char *path, const struct afsc_layout *layout, long long int size, struct afsc_block_buffers *buffers,
+									unsigned int firstBlock, unsigned int endBlock, int outFd, long int *badBlock);
+// Decodes every block with up to numThreads threads (0 for one per processor), each taking 16 blocks at a time
+enum afsc_result afsc_decode_resource_fork(const char *path, const struct afsc_layout *layout, long long int size, int outFd, int numThreads, long int *badBlock);
+enum afsc_result afsc_inspect_file(const char *path, struct afsc_file_info *info);
+// Stores payload as the compressed form of the file and empties its data fork; data, the uncompressed contents, is
+// written back if that fails, or if verify is set and the file doesn't read back the same. The file's times are not kept
+enum afsc_result afsc_commit_payload(const char *path, const struct stat *fileinfo, const struct afsc_payload *payload, const void *data, bool verify);
+// Reads the whole file into memory and compresses it there, so files whose compressed form might not fit in a 2 GiB
+// resource fork (in practice those over about 2 GiB) are skipped with AFSC_SKIPPED_TOO_LARGE, as afsc_encode skips
+// such data; larger files have to be streamed block by block with afsc_encode_block and the layout helpers
+enum afsc_result afsc_compress_file(const char *path, const struct afsc_options *options, struct afsc_file_info *info);
+// numThreads is as for afsc_decode_resource_fork
+enum afsc_result afsc_decompress_file(const char *path, int numThreads, struct afsc_file_info *info);
+// Checks that all of a compressed file decodes, without changing the file; besides the block table, it only needs the
+// memory in buffers, whatever the size of the file
+enum afsc_result afsc_scrub_file(const char *path, struct afsc_block_buffers *buffers, struct afsc_file_info *info);
+
+// Tree level: applies the operation to every regular file under path, which may also be a single file; the result is
+// AFSC_ERR_IO if any part of the tree couldn't be read
+enum afsc_result afsc_walk(const char *path, enum afsc_operation operation, const struct afsc_options *options, afsc_walk_callback callback, void *context);
+
+#endif